@@ -1,12 +1,16 @@
 #include "csvloadapp.hpp"
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 
-void AttemptBind(const char *param,const char* val,std::string& ipaddr, int& port, std::string& db_name) {
+void AttemptBind(const char *param,const char* val,std::string& ipaddr, int& port, std::string& db_name,
+		 fiasco::StorageProfile& profile, size_t& io_threads, fiasco::AdmissionConfig& admission) {
   if (std::string(param) == std::string("-p")) {
     auto buf = std::string(val);
     if (std::count(buf.begin(),buf.end(),',') > 0 ||
 	fiasco::DetectTypes(buf)[0] != fiasco::Types::Int) {
-      throw std::exception();
+      throw std::invalid_argument("Invalid port binding. Running on default port 8000");
     }
       else {
       port = std::atoi(val);
@@ -14,7 +18,45 @@ void AttemptBind(const char *param,const char* val,std::string& ipaddr, int& por
   }
   if (std::string(param) == std::string("-db")) {
     db_name = val;
-  }  
+  }
+  //Event loops of the epoll front end, 0 keeps httplib's thread per connection
+  if (std::string(param) == std::string("-io-threads")) {
+    auto buf = std::string(val);
+    if (std::count(buf.begin(),buf.end(),',') > 0 ||
+	fiasco::DetectTypes(buf)[0] != fiasco::Types::Int || buf[0] == '-') {
+      throw std::invalid_argument("Invalid I/O thread count. Serving a thread per connection");
+    }
+    io_threads = std::atoi(val);
+  }
+  //Whole storage profile from a file, later -storage options override it
+  if (std::string(param) == std::string("-config")) {
+    std::ifstream file(val);
+    std::stringstream config;
+    config << file.rdbuf();
+    auto parsed = fiasco::ParseStorageProfile(config.str(),profile);
+    if (!file || !parsed) {
+      throw std::invalid_argument(std::string("Invalid config file ") + val + ". Ignored");
+    }
+    profile = *parsed;
+  }
+  //Single key=value storage option
+  if (std::string(param) == std::string("-storage")) {
+    auto buf = std::string(val);
+    auto eq = buf.find('=');
+    if (eq == std::string::npos ||
+	!fiasco::SetStorageOption(profile,buf.substr(0,eq),buf.substr(eq + 1))) {
+      throw std::invalid_argument("Invalid storage option " + buf + ". Ignored");
+    }
+  }
+  //Single key=value admission control option
+  if (std::string(param) == std::string("-admission")) {
+    auto buf = std::string(val);
+    auto eq = buf.find('=');
+    if (eq == std::string::npos ||
+	!fiasco::SetAdmissionOption(admission,buf.substr(0,eq),buf.substr(eq + 1))) {
+      throw std::invalid_argument("Invalid admission option " + buf + ". Ignored");
+    }
+  }
 }
 
 int main(int argc,const char **args) {
@@ -22,21 +64,21 @@ int main(int argc,const char **args) {
   int port = 8000;
   std::string ipaddr = "127.0.0.1";
   std::string db_name = "csvs.db";
+  fiasco::StorageProfile profile;
+  size_t io_threads = 0;
+  fiasco::AdmissionConfig admission;
 
-  try {
-    if (argc >= 3) {
-      AttemptBind(args[1],args[2],ipaddr,port,db_name);
+  for (int ind = 1; ind + 1 < argc; ind += 2) {
+    try {
+      AttemptBind(args[ind],args[ind + 1],ipaddr,port,db_name,profile,io_threads,admission);
     }
-    if (argc >= 5) {
-      AttemptBind(args[3],args[4],ipaddr,port,db_name);
+    catch(std::exception& e) {
+      std::cerr << e.what() << "\n";
     }
   }
-  catch(std::exception& e) {
-    std::cerr << "Invalid port binding. Running on default port 8000\n";
-  }
   
-  fiasco::CSVApp app(db_name,false);
-  app.Run(ipaddr,port);
+  fiasco::CSVApp app(db_name,false,profile,admission);
+  app.Run(ipaddr,port,io_threads);
 
   return 0;
 }
@@ -1,929 +1,5866 @@
 #include "csvloadapp.hpp"
 #include <cctype>
+#include <cmath>
 #include <filesystem>
 #include <random>
+#include <set>
 #include <charconv>
+#include <cstring>
 #include <string_view>
+#include <unordered_set>
+#include <unistd.h>
 #include <format>
+#ifdef __linux__
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
 
 #include "sqlitecommands.hpp"
 
 
 namespace fiasco {
+  namespace {
+    std::vector<std::string>& StringPool() {
+      thread_local std::vector<std::string> pool;
+      return pool;
+    }
+
+    //Sized once, so the body is written in a single allocation and moved out from there
+    template <typename Vec>
+    std::string PackArray(const Vec& arr) {
+      size_t length = 2;
+      for (const auto& elem : arr) {
+	length += elem.length() + 1;
+      }
+      std::string packed;
+      packed.reserve(length);
+      packed += '[';
+      for (const auto& elem : arr) {
+	packed += elem;
+	packed += ',';
+      }
+      if (!arr.empty()) {
+	packed.pop_back();
+      }
+      packed += ']';
+      return packed;
+    }
+  }
+
+  PooledString::PooledString() {
+    auto& pool = StringPool();
+    if (!pool.empty()) {
+      text_ = std::move(pool.back());
+      pool.pop_back();
+    }
+  }
+
+  PooledString::~PooledString() {
+    auto& pool = StringPool();
+    if (text_.capacity() <= kPooledStringMaxBytes && pool.size() < kPooledStringsPerThread) {
+      text_.clear();
+      pool.push_back(std::move(text_));
+    }
+  }
+
   std::string PackJSON(const JSONData& obj) {
-    std::stringstream ss;
-    ss << "{";
+    size_t length = 2;
+    for (const auto& elem : obj) {
+      length += elem.first.length() + elem.second.length() + 6;
+    }
+    std::string packed;
+    packed.reserve(length);
+    packed += '{';
     for (const auto& elem : obj) {
-      ss << "\"" << elem.first << "\":\"" << elem.second << "\",";
+      packed += '"';
+      packed += elem.first;
+      packed += "\":\"";
+      packed += elem.second;
+      packed += "\",";
     }
     if (!obj.empty()) {
-      ss.seekp(-1,std::ios_base::end);
+      packed.pop_back();
     }
-    ss << "}";
-
-    return ss.str();
+    packed += '}';
+    return packed;
   }
   std::string PackJSONArray(const std::vector<std::string>& arr) {
-    std::stringstream ss;
-    ss << "[";
-    for (const auto& elem : arr) {
-      ss << elem << ",";
-    }
-    if (!arr.empty()) {
-      ss.seekp(-1,std::ios_base::end);
+    return PackArray(arr);
+  }
+  std::string PackJSONArray(const std::pmr::vector<std::pmr::string>& arr) {
+    return PackArray(arr);
+  }
+
+  // Tape parser over a string_view: strings without escapes and all scalars are views into the source
+  // so a whole document costs one node vector plus one scratch buffer at most
+  // String bodies are scanned 8 bytes at a time, which is where nearly all of the bytes are
+  class JSONParser {
+  private:
+    std::string_view src_;
+    size_t pos_ = 0;
+    JSONDocument& doc_;
+    static constexpr uint32_t kMaxDepth = 256;
+
+    void SkipSpace() {
+      while (pos_ < src_.length() &&
+	     (src_[pos_] == ' ' || src_[pos_] == '\n' || src_[pos_] == '\r' || src_[pos_] == '\t')) {
+	++pos_;
+      }
     }
-    ss << "]";
 
-    return ss.str();
-  }
+    // First quote, backslash or control character at or after pos
+    size_t FindStringSpecial(size_t pos) const {
+      constexpr uint64_t kOnes = 0x0101010101010101ULL;
+      constexpr uint64_t kHigh = 0x8080808080808080ULL;
+      while (pos + 8 <= src_.length()) {
+	uint64_t word;
+	std::memcpy(&word,src_.data() + pos,8);
+	uint64_t quote = word ^ (kOnes * '"');
+	uint64_t slash = word ^ (kOnes * '\\');
+	uint64_t hits = ((quote - kOnes) & ~quote) |
+	  ((slash - kOnes) & ~slash) |
+	  ((word - kOnes * 0x20) & ~word);
+	if ((hits & kHigh) != 0) {
+	  break;
+	}
+	pos += 8;
+      }
+      while (pos < src_.length()) {
+	auto cur_char = static_cast<unsigned char>(src_[pos]);
+	if (cur_char == '"' || cur_char == '\\' || cur_char < 0x20) {
+	  break;
+	}
+	++pos;
+      }
+      return pos;
+    }
 
-  // Parse the simple JSONs of format {"param1":"val1","param2":"val2"}
-  // It is assumed that with strings quotes are backslashed
-  // One wishes C++ had proper pattern matching in these moments
-  // I'll additionally observe that at high end one just automates generating this boiler plate code
-  std::optional<JSONData> ParseStrictJSON(const std::string& serialized) {
-    enum ParserState {
-      JSONStart,
-      ParamStringEntry,
-      ParamStringExit,
-      ValStringEntry,
-      ValStringExit,
-      JSONNextLine
-    };
-    JSONData current_data;
-    ParserState current_state = JSONStart;
-    std::string buf_key,buf_val;
-    for (size_t ind = 0; ind < serialized.length(); ++ind) {
-      char cur_char = serialized[ind];
-      switch (current_state) {
-      case JSONStart:
-	if (std::isspace(cur_char) || cur_char == '{') {}
-	else if (cur_char == '"') {
-	  current_state = ParamStringEntry;
-	  buf_key.clear();
+    bool ParseHex4(uint32_t& code) {
+      if (pos_ + 4 > src_.length()) {
+	return false;
+      }
+      code = 0;
+      for (size_t ind = 0; ind < 4; ++ind) {
+	char cur_char = src_[pos_++];
+	code <<= 4;
+	if (cur_char >= '0' && cur_char <= '9') {
+	  code |= cur_char - '0';
+	}
+	else if (cur_char >= 'a' && cur_char <= 'f') {
+	  code |= cur_char - 'a' + 10;
+	}
+	else if (cur_char >= 'A' && cur_char <= 'F') {
+	  code |= cur_char - 'A' + 10;
 	}
 	else {
-	  return std::optional<JSONData>();
+	  return false;
 	}
-	break;
-      case ParamStringEntry:
-	if (cur_char == '\\' && (ind + 1) < serialized.length()) {
-	  buf_key += serialized[ind + 1];
-	  ++ind;
+      }
+      return true;
+    }
+
+    void PutUTF8(uint32_t code) {
+      char* out = doc_.scratch_.get() + doc_.scratch_len_;
+      if (code < 0x80) {
+	out[0] = static_cast<char>(code);
+	doc_.scratch_len_ += 1;
+      }
+      else if (code < 0x800) {
+	out[0] = static_cast<char>(0xC0 | (code >> 6));
+	out[1] = static_cast<char>(0x80 | (code & 0x3F));
+	doc_.scratch_len_ += 2;
+      }
+      else if (code < 0x10000) {
+	out[0] = static_cast<char>(0xE0 | (code >> 12));
+	out[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+	out[2] = static_cast<char>(0x80 | (code & 0x3F));
+	doc_.scratch_len_ += 3;
+      }
+      else {
+	out[0] = static_cast<char>(0xF0 | (code >> 18));
+	out[1] = static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+	out[2] = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+	out[3] = static_cast<char>(0x80 | (code & 0x3F));
+	doc_.scratch_len_ += 4;
+      }
+    }
+
+    // Expects pos_ right past the opening quote
+    // Every escape sequence is at least as long as what it decodes to, so scratch never overflows
+    bool ParseString(std::string_view& out) {
+      size_t start = pos_;
+      pos_ = FindStringSpecial(pos_);
+      if (pos_ >= src_.length() || static_cast<unsigned char>(src_[pos_]) < 0x20) {
+	return false;
+      }
+      if (src_[pos_] == '"') {
+	out = src_.substr(start,pos_ - start);
+	++pos_;
+	return true;
+      }
+      if (!doc_.scratch_) {
+	doc_.scratch_ = std::make_unique<char[]>(src_.length());
+      }
+      size_t out_start = doc_.scratch_len_;
+      std::memcpy(doc_.scratch_.get() + doc_.scratch_len_,src_.data() + start,pos_ - start);
+      doc_.scratch_len_ += pos_ - start;
+      while (true) {
+	if (pos_ >= src_.length()) {
+	  return false;
 	}
-	else if (cur_char == '"') {
-	  current_state = ParamStringExit;
+	char cur_char = src_[pos_];
+	if (cur_char == '"') {
+	  ++pos_;
+	  break;
 	}
-	else {
-	  buf_key += cur_char;
+	if (static_cast<unsigned char>(cur_char) < 0x20) {
+	  return false;
 	}
-	break;
-      case ParamStringExit:
-	if (std::isspace(cur_char)) {}
-	else if (cur_char == ':') {}
-	else if (cur_char == '"') {
-	  current_state = ValStringEntry;
-	  buf_val.clear();
+	if (cur_char != '\\') {
+	  size_t run_end = FindStringSpecial(pos_);
+	  std::memcpy(doc_.scratch_.get() + doc_.scratch_len_,src_.data() + pos_,run_end - pos_);
+	  doc_.scratch_len_ += run_end - pos_;
+	  pos_ = run_end;
+	  continue;
 	}
-	else {
-	  return std::optional<JSONData>();
+	if (++pos_ >= src_.length()) {
+	  return false;
 	}
-	break;
-      case ValStringEntry:
-	if (cur_char == '\\' && (ind + 1) < serialized.length()) {
-	  buf_val += serialized[ind + 1];
-	  ++ind;
+	char escaped = src_[pos_++];
+	char decoded;
+	switch (escaped) {
+	case '"': decoded = '"'; break;
+	case '\\': decoded = '\\'; break;
+	case '/': decoded = '/'; break;
+	case 'b': decoded = '\b'; break;
+	case 'f': decoded = '\f'; break;
+	case 'n': decoded = '\n'; break;
+	case 'r': decoded = '\r'; break;
+	case 't': decoded = '\t'; break;
+	case 'u': {
+	  uint32_t code;
+	  if (!ParseHex4(code)) {
+	    return false;
+	  }
+	  if (code >= 0xD800 && code <= 0xDBFF) {
+	    uint32_t low;
+	    if (pos_ + 2 > src_.length() || src_[pos_] != '\\' || src_[pos_ + 1] != 'u') {
+	      return false;
+	    }
+	    pos_ += 2;
+	    if (!ParseHex4(low) || low < 0xDC00 || low > 0xDFFF) {
+	      return false;
+	    }
+	    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+	  }
+	  else if (code >= 0xDC00 && code <= 0xDFFF) {
+	    return false;
+	  }
+	  PutUTF8(code);
+	  continue;
 	}
-	else if (cur_char == '"') {
-	  current_state = ValStringExit;
+	default:
+	  return false;
 	}
-	else {
-	  buf_val += cur_char;
+	doc_.scratch_[doc_.scratch_len_++] = decoded;
+      }
+      out = std::string_view(doc_.scratch_.get() + out_start,doc_.scratch_len_ - out_start);
+      return true;
+    }
+
+    bool ParseNumber(JSONValue& val) {
+      size_t start = pos_;
+      bool is_float = false;
+      auto digits = [this]() {
+	size_t digits_start = pos_;
+	while (pos_ < src_.length() && std::isdigit(static_cast<unsigned char>(src_[pos_]))) {
+	  ++pos_;
 	}
-	break;
-      case ValStringExit:
-	if (std::isspace(cur_char)) {}
-	else if (cur_char == ',') {
-	  current_state = JSONNextLine;
-	  current_data[buf_key] = buf_val;
+	return pos_ - digits_start;
+      };
+      if (pos_ < src_.length() && src_[pos_] == '-') {
+	++pos_;
+      }
+      if (pos_ < src_.length() && src_[pos_] == '0') {
+	++pos_;
+      }
+      else if (digits() == 0) {
+	return false;
+      }
+      if (pos_ < src_.length() && src_[pos_] == '.') {
+	++pos_;
+	is_float = true;
+	if (digits() == 0) {
+	  return false;
+	}
+      }
+      if (pos_ < src_.length() && (src_[pos_] == 'e' || src_[pos_] == 'E')) {
+	++pos_;
+	is_float = true;
+	if (pos_ < src_.length() && (src_[pos_] == '+' || src_[pos_] == '-')) {
+	  ++pos_;
+	}
+	if (digits() == 0) {
+	  return false;
 	}
-	else if(cur_char == '}') {
-	  current_data[buf_key] = buf_val;
-	  return std::optional<JSONData>(current_data);
+      }
+      val.text = src_.substr(start,pos_ - start);
+      const char* first = src_.data() + start;
+      const char* last = src_.data() + pos_;
+      if (!is_float) {
+	auto [ptr,ec] = std::from_chars(first,last,val.int_val);
+	if (ec == std::errc()) {
+	  val.kind = JSONValue::Int;
+	  return true;
+	}
+      }
+      // Integers past int64 degrade to doubles, same as everybody else does
+      auto [ptr,ec] = std::from_chars(first,last,val.float_val);
+      val.kind = JSONValue::Float;
+      return ec == std::errc() || ec == std::errc::result_out_of_range;
+    }
+
+    bool ParseLiteral(std::string_view literal) {
+      if (src_.substr(pos_,literal.length()) != literal) {
+	return false;
+      }
+      pos_ += literal.length();
+      return true;
+    }
+
+    JSONParser(std::string_view src,JSONDocument& doc) : src_(src), doc_(doc) {}
+
+    bool AtEnd() {
+      SkipSpace();
+      return pos_ >= src_.length();
+    }
+
+    bool ParseValue(uint32_t depth) {
+      SkipSpace();
+      if (pos_ >= src_.length() || depth > kMaxDepth) {
+	return false;
+      }
+      uint32_t ind = doc_.nodes_.size();
+      doc_.nodes_.emplace_back();
+      size_t start = pos_;
+      char cur_char = src_[pos_];
+      bool ok = true;
+      switch (cur_char) {
+      case '{': {
+	doc_.nodes_[ind].kind = JSONValue::Object;
+	++pos_;
+	SkipSpace();
+	uint32_t members = 0;
+	if (pos_ < src_.length() && src_[pos_] == '}') {
+	  ++pos_;
 	}
 	else {
-	  return std::optional<JSONData>();
+	  while (true) {
+	    SkipSpace();
+	    if (pos_ >= src_.length() || src_[pos_] != '"') {
+	      return false;
+	    }
+	    ++pos_;
+	    uint32_t key_ind = doc_.nodes_.size();
+	    doc_.nodes_.emplace_back();
+	    std::string_view key;
+	    if (!ParseString(key)) {
+	      return false;
+	    }
+	    doc_.nodes_[key_ind].kind = JSONValue::String;
+	    doc_.nodes_[key_ind].text = key;
+	    doc_.nodes_[key_ind].end = key_ind + 1;
+	    SkipSpace();
+	    if (pos_ >= src_.length() || src_[pos_] != ':') {
+	      return false;
+	    }
+	    ++pos_;
+	    if (!ParseValue(depth + 1)) {
+	      return false;
+	    }
+	    ++members;
+	    SkipSpace();
+	    if (pos_ < src_.length() && src_[pos_] == ',') {
+	      ++pos_;
+	    }
+	    else if (pos_ < src_.length() && src_[pos_] == '}') {
+	      ++pos_;
+	      break;
+	    }
+	    else {
+	      return false;
+	    }
+	  }
 	}
+	doc_.nodes_[ind].size = members;
 	break;
-      case JSONNextLine:
-	if (std::isspace(cur_char)) {}
-	else if (cur_char == '"') {
-	  current_state = ParamStringEntry;
-	  buf_key.clear();
+      }
+      case '[': {
+	doc_.nodes_[ind].kind = JSONValue::Array;
+	++pos_;
+	SkipSpace();
+	uint32_t elements = 0;
+	if (pos_ < src_.length() && src_[pos_] == ']') {
+	  ++pos_;
 	}
 	else {
-	  return std::optional<JSONData>();
+	  while (true) {
+	    if (!ParseValue(depth + 1)) {
+	      return false;
+	    }
+	    ++elements;
+	    SkipSpace();
+	    if (pos_ < src_.length() && src_[pos_] == ',') {
+	      ++pos_;
+	    }
+	    else if (pos_ < src_.length() && src_[pos_] == ']') {
+	      ++pos_;
+	      break;
+	    }
+	    else {
+	      return false;
+	    }
+	  }
 	}
+	doc_.nodes_[ind].size = elements;
 	break;
       }
-
+      case '"': {
+	++pos_;
+	std::string_view str;
+	ok = ParseString(str);
+	doc_.nodes_[ind].kind = JSONValue::String;
+	doc_.nodes_[ind].text = str;
+	break;
+      }
+      case 't':
+	ok = ParseLiteral("true");
+	doc_.nodes_[ind].kind = JSONValue::Bool;
+	doc_.nodes_[ind].int_val = 1;
+	break;
+      case 'f':
+	ok = ParseLiteral("false");
+	doc_.nodes_[ind].kind = JSONValue::Bool;
+	break;
+      case 'n':
+	ok = ParseLiteral("null");
+	break;
+      default:
+	ok = ParseNumber(doc_.nodes_[ind]);
+	break;
+      }
+      if (!ok) {
+	return false;
+      }
+      auto& node = doc_.nodes_[ind];
+      if (node.kind != JSONValue::String) {
+	node.text = src_.substr(start,pos_ - start);
+      }
+      node.end = doc_.nodes_.size();
+      return true;
     }
 
-    return std::optional<JSONData>(current_data);
-    }
-  
-  std::vector<Substring> SplitIntoViews(const std::string& str,char separator) {
-    if (str.empty()) {
-      return {};
+  public:
+    static std::optional<JSONDocument> Parse(std::string_view serialized, bool allow_sequence) {
+      JSONDocument doc;
+      // Roughly one node per eight bytes is plenty for row-shaped payloads
+      doc.nodes_.reserve(serialized.length() / 8 + 4);
+      JSONParser parser(serialized,doc);
+      do {
+	doc.roots_.push_back(doc.nodes_.size());
+	if (!parser.ParseValue(0)) {
+	  return std::optional<JSONDocument>();
+	}
+      } while (allow_sequence && !parser.AtEnd());
+      if (!parser.AtEnd()) {
+	return std::optional<JSONDocument>();
+      }
+      return std::optional<JSONDocument>(std::move(doc));
     }
-    auto it = str.find(separator,0);
-    if (it == std::string::npos) {
-      return {{0,static_cast<uint32_t>(str.length())}};
+  };
+
+  std::optional<uint32_t> JSONDocument::Find(uint32_t obj, std::string_view key) const {
+    if (nodes_[obj].kind != JSONValue::Object) {
+      return std::optional<uint32_t>();
     }
-    std::vector<Substring> result;
-    result.push_back({0,static_cast<uint32_t>(it)});
-    while (it < str.length()-1) {
-      Substring tmp;
-      tmp.offset = it + 1;
-      it = str.find(separator,it + 1);
-      if (it == std::string::npos) {
-	it = str.length();
+    for (uint32_t ind = FirstChild(obj); ind < nodes_[obj].end; ind = Next(Next(ind))) {
+      if (nodes_[ind].text == key) {
+	return std::optional<uint32_t>(Next(ind));
       }
-      tmp.length = it - tmp.offset;
-      result.push_back(tmp);
     }
-    return result;
+    return std::optional<uint32_t>();
   }
 
-  // Serves primarily testing purposes, same as in-memory interface
-  // In production you just run the db setup script before any actual usage
-  void CSVApp::DbSetup() {
-    TryExecSimpleQuery(kUsersTable);
-    TryExecSimpleQuery(kTablesTable);
-    TryExecSimpleQuery(kAdminSetup);
+  std::optional<JSONDocument> ParseJSON(std::string_view serialized, bool allow_sequence) {
+    return JSONParser::Parse(serialized,allow_sequence);
   }
 
+  int BindJSONValue(sqlite3_stmt* stmt, int ind, const JSONValue& val, bool coded) {
+    switch (val.kind) {
+    case JSONValue::Null:
+      return sqlite3_bind_null(stmt,ind);
+    case JSONValue::Bool:
+    case JSONValue::Int:
+      if (coded) {
+	auto text = std::to_string(val.int_val);
+	return sqlite3_bind_text(stmt,ind,text.data(),text.length(),SQLITE_TRANSIENT);
+      }
+      return sqlite3_bind_int64(stmt,ind,val.int_val);
+    case JSONValue::Float:
+      return sqlite3_bind_double(stmt,ind,val.float_val);
+    default:
+      return sqlite3_bind_text(stmt,ind,val.text.data(),val.text.length(),SQLITE_STATIC);
+    }
+  }
 
-  CSVApp::CSVApp(const std::string& db_file, bool in_memory) : svr_() {
-    int flag;
-    if (in_memory) {
-      flag = SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY;
+  std::string ColumnToString(sqlite3_stmt* stmt, int ind) {
+    switch (sqlite3_column_type(stmt,ind)) {
+    case SQLITE_INTEGER: {
+      std::string cell;
+      AppendNumber(cell,sqlite3_column_int64(stmt,ind));
+      return cell;
     }
-    else if (std::filesystem::exists(db_file)) {
-      flag = SQLITE_OPEN_READWRITE;
+    case SQLITE_FLOAT: {
+      std::string cell;
+      AppendNumber(cell,sqlite3_column_double(stmt,ind));
+      return cell;
     }
-    else {
-      flag = SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE;
+    case SQLITE_TEXT:
+      return std::string {
+	reinterpret_cast<const char*>(sqlite3_column_text(stmt,ind))
+      };
+    default:
+      return "";
     }
-    if (sqlite3_open_v2(db_file.c_str(),&db_handle_,flag,nullptr) != SQLITE_OK) {
-      std::cerr << "In sqlite3_open\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
+  }
+
+  Statement::Statement(sqlite3* db, const std::string& sql, const char* where) : db_(db), where_(where) {
+    last_ = sqlite3_prepare_v2(db_,sql.c_str(),sql.length() + 1,&stmt_,nullptr);
+    if (last_ != SQLITE_OK) {
+      std::cerr << "In " << where_ << "::prepare\n";
+      std::cerr << sqlite3_errmsg(db_);
       std::cerr << "\n";
+      sqlite3_finalize(stmt_);
+      stmt_ = nullptr;
     }
+  }
 
-    if ((flag & SQLITE_OPEN_CREATE) != 0) {
-      DbSetup();
+  Statement::~Statement() {
+    //A failed step has been logged already and finalize only repeats its error
+    if (stmt_ && sqlite3_finalize(stmt_) != SQLITE_OK && !Failed()) {
+      std::cerr << "In " << where_ << "::finalize\n";
+      std::cerr << sqlite3_errmsg(db_);
+      std::cerr << "\n";
     }
-
-    //Connect handlers
-    svr_.Get("/tables",[this](const httplib::Request& req,httplib::Response& res) {
-      res.body = PackJSON(this->DbQueryList());
-      res.status = 200;
-    });
-    svr_.Get("/view",[this](const httplib::Request& req,httplib::Response& res) {
-      this->HandleTableQuery(req,res);
-    });
-    svr_.Post("/upload",[this](const httplib::Request& req,httplib::Response& res) {
-      this->HandleUpload(req,res);
-    });
-    svr_.Get("/delete",[this](const httplib::Request& req,httplib::Response& res) {
-      //Authorize
-      //Verify
-      //Respond
-    });
-    svr_.Post("/update",[this](const httplib::Request& req,httplib::Response& res) {
-      this->HandleTableUpdate(req,res);
-    });
   }
 
-  CSVApp::~CSVApp() {
-    sqlite3_close(db_handle_);
+  Statement& Statement::Bind(int ind, std::string_view text) {
+    if (stmt_) {
+      sqlite3_bind_text(stmt_,ind,text.data(),text.length(),SQLITE_STATIC);
+    }
+    return *this;
   }
 
-
-  Role CSVApp::DbCheckUser(const std::string& username) {
-    sqlite3_stmt* query;
-    auto role = Role::None;
-    if(sqlite3_prepare(db_handle_,
-		       kCheckUser.c_str(),
-		       kCheckUser.length() + 1,
-		       &query,
-		       nullptr) != SQLITE_OK) {
-      std::cerr << "In DbCheckUser::sqlite3_prepare\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
-    }
-    if(sqlite3_bind_text(query,
-			 1,
-			 username.c_str(),
-			 username.length() + 1,
-			 SQLITE_STATIC) != SQLITE_OK) {
-      std::cerr << "In DbCheckerUser::sqlite3_bind username\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+  Statement& Statement::Bind(int ind, int64_t val) {
+    if (stmt_) {
+      sqlite3_bind_int64(stmt_,ind,val);
     }
-    switch(sqlite3_step(query)) {
-    case SQLITE_ROW:
-      role = static_cast<Role>(sqlite3_column_int(query,1));
-      break;
-    case SQLITE_DONE:
-      break;
-    default:
-      std::cerr << "In DbCheckUser::sqlite3_step";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
-      break;
+    return *this;
+  }
+
+  bool Statement::Step() {
+    //Stepping past the end would start the statement over
+    if (!stmt_ || last_ == SQLITE_DONE || Failed()) {
+      return false;
     }
-    if (sqlite3_finalize(query) != SQLITE_OK) {
-      std::cerr << "In DbCheckUser::sqlite3_finalize";
-      std::cerr << sqlite3_errmsg(db_handle_);
+    last_ = sqlite3_step(stmt_);
+    if (Failed()) {
+      std::cerr << "In " << where_ << "::step\n";
+      std::cerr << sqlite3_errmsg(db_);
       std::cerr << "\n";
     }
-    return role;
+    return last_ == SQLITE_ROW;
   }
-  
-  int CSVApp::DbRegUser(const std::string& username) {
-    sqlite3_stmt *query;
-    int id = -1;
-    if(sqlite3_prepare_v2(db_handle_,
-			  kUserReg.c_str(),
-			  kUserReg.length()+1,
-			  &query,
-			  nullptr) != SQLITE_OK) {
-      std::cerr << sqlite3_errmsg(db_handle_);
-    }
-    if(sqlite3_bind_text(query,
-			 1,
-			 username.c_str(),
-			 username.length()+1,
-			 SQLITE_STATIC) != SQLITE_OK) {
-      std::cerr << sqlite3_errmsg(db_handle_);
+
+  void Statement::Reset() {
+    if (stmt_) {
+      sqlite3_reset(stmt_);
+      last_ = SQLITE_OK;
     }
-    if(sqlite3_step(query) != SQLITE_ROW) {
-      std::cerr << sqlite3_errmsg(db_handle_);
+  }
+
+  namespace {
+    struct ThreadArena {
+      std::unique_ptr<std::byte[]> initial {new std::byte[kRequestArenaBytes]};
+      std::pmr::monotonic_buffer_resource resource {initial.get(),kRequestArenaBytes};
+      bool active = false;
+    };
+    ThreadArena& CurrentArena() {
+      thread_local ThreadArena arena;
+      return arena;
     }
-    else {
-      id = sqlite3_column_int(query,0);
+  }
+
+  RequestArena::RequestArena() : outermost_(!CurrentArena().active) {
+    CurrentArena().active = true;
+  }
+
+  RequestArena::~RequestArena() {
+    if (outermost_) {
+      //Hands back whatever overflowed to the heap and rewinds to the start of the kept buffer
+      CurrentArena().resource.release();
+      CurrentArena().active = false;
     }
-    if(sqlite3_finalize(query) != SQLITE_OK) {
-      std::cerr << sqlite3_errmsg(db_handle_);
+  }
+
+  std::pmr::memory_resource* RequestArena::get() const {
+    return &CurrentArena().resource;
+  }
+
+  RowLayout BuildRowLayout(RowLayout cols) {
+    std::stable_sort(cols.begin(),cols.end(),[](const auto& a, const auto& b) { return a.first < b.first; });
+    RowLayout layout;
+    for (const auto& col : cols) {
+      if (!layout.empty() && layout.back().first == col.first) {
+	layout.back() = col;
+      }
+      else {
+	layout.push_back(col);
+      }
     }
-    return id;
+    return layout;
   }
 
-  //Randomized test for being a proper CSV, namely that separator count on each line matches up
-  //TODO: Check proper indexing
-  bool SampleForCSV(const std::string& csv_content, char separator,size_t samples) {
-    auto lines = SplitIntoViews(csv_content);
-    //Check directly for small csvs
-    if (lines.size() <= 1) {
-      return true;
+  void AppendJSONRow(std::pmr::string& out, sqlite3_stmt* stmt, const RowLayout& layout) {
+    out += '{';
+    for (const auto& [name,ind] : layout) {
+      out += '"';
+      out += name;
+      out += "\":\"";
+      //Straight from SQLite's buffers, no cell strings in between
+      switch (sqlite3_column_type(stmt,ind)) {
+      case SQLITE_INTEGER:
+	AppendNumber(out,sqlite3_column_int64(stmt,ind));
+	break;
+      case SQLITE_FLOAT:
+	AppendNumber(out,sqlite3_column_double(stmt,ind));
+	break;
+      case SQLITE_TEXT:
+	out.append(reinterpret_cast<const char*>(sqlite3_column_text(stmt,ind)));
+	break;
+      default:
+	break;
+      }
+      out += "\",";
     }
-    auto fst_line = csv_content.substr(lines[0].offset,lines[0].length);
-    if (lines.size() == 2) {
-      auto lst_line = csv_content.substr(lines[1].offset,lines[1].length);
-      return std::count(fst_line.begin(),fst_line.end(),separator) ==
-	     std::count(lst_line.begin(),lst_line.end(),separator);
+    if (!layout.empty()) {
+      out.pop_back();
     }
+    out += '}';
+  }
 
-    std::random_device rd;
-    std::mt19937 gen32(rd());
-    std::uniform_int_distribution<> dist(1,lines.size());
+  RowBatch::RowBatch(size_t columns) : columns_(columns), cells_(columns * kRowBatchRows) {}
 
-    
-    size_t base_cols = std::count(fst_line.begin(),fst_line.end(),separator);
-    for (size_t ind = 0;ind < samples; ++ind) {
-      auto line_num = dist(gen32);
-      auto test_line = csv_content.substr(lines[line_num].offset,lines[line_num].length);
-      size_t test_cols =  std::count(test_line.begin(),test_line.end(),separator);
-      if (base_cols != test_cols) {
-	return false;
+  void RowBatch::Append(sqlite3_stmt* stmt) {
+    auto cell = cells_.begin() + rows_ * columns_;
+    for (size_t col = 0; col < columns_; ++col, ++cell) {
+      switch (sqlite3_column_type(stmt,col)) {
+      case SQLITE_INTEGER:
+	cell->kind = Kind::Int;
+	cell->num = sqlite3_column_int64(stmt,col);
+	break;
+      case SQLITE_FLOAT:
+	cell->kind = Kind::Float;
+	cell->real = sqlite3_column_double(stmt,col);
+	break;
+      case SQLITE_TEXT: {
+	auto text = reinterpret_cast<const char*>(sqlite3_column_text(stmt,col));
+	cell->kind = Kind::Text;
+	cell->offset = text_.size();
+	cell->length = sqlite3_column_bytes(stmt,col);
+	text_.append(text,cell->length);
+	break;
+      }
+      default:
+	cell->kind = Kind::Null;
+	break;
       }
     }
-    
-    return true;
+    ++rows_;
   }
-  
-  //Returns SQL types as enum members
-  //I question whether i truly need to go so far
-  //Ahaha, of course I do, i am not going to use lexigraphic sort on floats
-  std::vector<Types> DetectTypes(const std::string& csrow, char separator) {
-    auto cols = SplitIntoViews(csrow,separator);
-    std::vector<Types> result;
-    for (const auto& col : cols) {
-      auto str = csrow.substr(col.offset,col.length);
-      auto dot_cnt = 0;
-      for (size_t ind = 0;ind < str.length() ; ++ind) {
-	if (str[ind] == '-' && ind == 0) {
-	  continue;
-	} 
-	if (str[ind] == '.') {
-	  ++dot_cnt;
-	}
-	else if (std::isdigit(str[ind])) {
-	  continue;
-	}
-	else {
-	  dot_cnt = 10;
+
+  bool RowBatch::Fill(Statement& stmt) {
+    Clear();
+    while (!Full() && stmt.Step()) {
+      Append(stmt.get());
+    }
+    return rows_ > 0;
+  }
+
+  void RowBatch::Clear() {
+    rows_ = 0;
+    text_.clear();
+  }
+
+  void AppendJSONRows(std::string& out, const RowBatch& batch, const RowLayout& layout) {
+    for (size_t row = 0; row < batch.Rows(); ++row) {
+      if (out.back() != '[') {
+	out += ',';
+      }
+      out += '{';
+      for (const auto& [name,col] : layout) {
+	out += '"';
+	out += name;
+	out += "\":\"";
+	const auto& cell = batch.At(row,col);
+	switch (cell.kind) {
+	case RowBatch::Kind::Int:
+	  AppendNumber(out,cell.num);
+	  break;
+	case RowBatch::Kind::Float:
+	  AppendNumber(out,cell.real);
+	  break;
+	case RowBatch::Kind::Text:
+	  out += batch.Text(cell);
+	  break;
+	case RowBatch::Kind::Null:
 	  break;
 	}
+	out += "\",";
       }
-      if (dot_cnt > 1) {
-	result.push_back(Types::String);
-      }
-      else if (dot_cnt == 1) {
-	result.push_back(Types::Float);
-      }
-      else {
-	result.push_back(Types::Int);
+      if (!layout.empty()) {
+	out.pop_back();
       }
+      out += '}';
     }
-    return result;
   }
 
-  void CSVApp::TryExecSimpleQuery(const std::string& query) {
-    std::cerr << "Query:" << query << "\n";
-    sqlite3_stmt* stmt_handle;
-    if(sqlite3_prepare_v2(db_handle_,
-			  query.c_str(),
-			  query.length() + 1,
-			  &stmt_handle,
-			  nullptr) != SQLITE_OK) {
-      std::cerr << "In TryExecSimpleQuery::prepare\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+  // Parse the simple JSONs of format {"param1":"val1","param2":"val2"}
+  // Anything that is not a string is kept as its JSON text, which is what the old callers expect anyway
+  std::optional<JSONData> ParseStrictJSON(const std::string& serialized) {
+    auto doc = ParseJSON(serialized);
+    if (!doc || (*doc)[0].kind != JSONValue::Object) {
+      return std::optional<JSONData>();
     }
-    if(sqlite3_step(stmt_handle) != SQLITE_DONE) {
-      std::cerr << "In TryExecSimpleQuery::step\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+    JSONData current_data;
+    for (uint32_t ind = doc->FirstChild(0); ind < (*doc)[0].end; ind = doc->Next(doc->Next(ind))) {
+      current_data[std::string((*doc)[ind].text)] = std::string((*doc)[doc->Next(ind)].text);
+    }
+    return std::optional<JSONData>(current_data);
+  }
+  
+  std::optional<std::vector<std::string>> ParseKeyList(std::string_view serialized) {
+    auto doc = ParseJSON(serialized);
+    if (!doc || (*doc)[0].kind != JSONValue::Array) {
+      return std::optional<std::vector<std::string>>();
+    }
+    std::vector<std::string> keys;
+    for (uint32_t ind = doc->FirstChild(0); ind < (*doc)[0].end; ind = doc->Next(ind)) {
+      auto kind = (*doc)[ind].kind;
+      if (kind != JSONValue::String && kind != JSONValue::Int && kind != JSONValue::Float) {
+	return std::optional<std::vector<std::string>>();
       }
-    if(sqlite3_finalize(stmt_handle) != SQLITE_OK) {
-      std::cerr << "In TryExecSimpleQuery:finalize";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+      keys.emplace_back((*doc)[ind].text);
     }
+    return std::optional<std::vector<std::string>>(std::move(keys));
   }
 
-  
-  //TODO: Implement batch inserting
-  void CSVApp::DbUpload(const std::string& name,
-			const std::string& content,
-			char separator,
-			size_t batch_size) {
-    //First of all, we will have a whole lot of substring operations here.
-    //Most low-level improvement for this would be to manipulate pointer for content.data()
-    //With careful track of length
-    //Unfortunately, no way in hell can I do that in feasible timeframe
-    
-    //We assume it is a proper CSV, beauty of private implementation
-    //Furthermore we assume user permissions are intact
-    size_t fstnewline = content.find('\n',0);
-    bool create_only = false;
-    auto header = content.substr(0,fstnewline);
-    std::vector<Types> types = DetectTypes(header);
-    bool has_signature =
-      (std::find_if(types.begin(),types.end(),[](auto t){
-	return t != Types::String;
-      }) == types.end());
-    if (fstnewline == content.size() && has_signature) {
-      create_only = true;
-    }
-    if (has_signature) {
-      size_t nextline = content.find('\n',fstnewline+1);
-      auto sndline = content.substr(fstnewline+1,
-				    nextline - fstnewline);
-      types = DetectTypes(sndline);
-    }
-
-    std::stringstream col_descr;
-    // One would likely assert that col_offsets.size() == types.size();
-    // But this is implied if col_offsets is computed properly by correct CSV
-    if (!has_signature) {
-      for (size_t ind = 0 ; ind < types.size() ; ++ind) {
-	bool last = (ind == (types.size() -1));
-	col_descr << "\"" << ind + 1 << "\" ";
-	switch (types[ind]) {
-	case Types::String:
-	  col_descr << "varchar(255)" << (last?" ":", ");
-	  break;
-	case Types::Float:
-	  col_descr << "float" << (last?" ":", ");
-	  break;
-	case Types::Int:
-	  col_descr << "int" << (last?" ":", ");
-	  break;
-	}	
+  // Batches come either as [{...},{...}] or as one object per line
+  std::optional<BatchOps> ParseBatchOps(std::string_view body) {
+    BatchOps batch;
+    auto doc = ParseJSON(body,true);
+    if (!doc) {
+      // Blank bodies are a valid, if pointless, batch
+      if (body.find_first_not_of(" \t\r\n") == std::string_view::npos) {
+	return std::optional<BatchOps>(std::move(batch));
       }
+      return std::optional<BatchOps>();
     }
-    else if(create_only) {
-      auto col_view = SplitIntoViews(header,separator);
-      for (size_t ind = 0; ind < col_view.size() ; ++ind) {
-	bool last = (ind == col_view.size() - 1);
-	col_descr << header.substr(col_view[ind].offset,
-				   col_view[ind].length)
-	<< " varchar(255) " << (last?", ":" ");
+    batch.doc = std::move(*doc);
+    const auto& roots = batch.doc.Roots();
+    if (roots.size() == 1 && batch.doc[roots[0]].kind == JSONValue::Array) {
+      for (uint32_t ind = batch.doc.FirstChild(roots[0]); ind < batch.doc[roots[0]].end; ind = batch.doc.Next(ind)) {
+	batch.ops.push_back(ind);
       }
     }
     else {
-      auto col_view = SplitIntoViews(header,separator);
-      for (size_t ind = 0; ind < col_view.size() ; ++ind) {
-	bool last = (ind == col_view.size() - 1);
-	col_descr << "\"" << header.substr(col_view[ind].offset,
-				   col_view[ind].length) << "\" ";
-
-	switch (types[ind]) {
-	case Types::String:
-	  col_descr << "varchar(255) ";
-	    break;
-	case Types::Float:
-	  col_descr << "float ";
-	  break;
-	case Types::Int:
-	  col_descr << "int ";
-	  break;
-	}
-	col_descr << (last?", ":" ");
+      batch.ops = roots;
+    }
+    for (auto op : batch.ops) {
+      if (batch.doc[op].kind != JSONValue::Object) {
+	return std::optional<BatchOps>();
       }
     }
+    return std::optional<BatchOps>(std::move(batch));
+  }
 
-    auto col_str = col_descr.str();
-
-    std::stringstream table_create_ss;
-    table_create_ss << "CREATE TABLE main.\"" << name << "\" (" << col_str <<");";
+  // INSERT with an explicit (possibly NULL) rowid, so a single statement covers both append and update
+  std::string BuildUpsertQuery(const std::string& table_name,
+			       const std::vector<std::string>& cols,
+			       const std::string& schema) {
+    std::string query {"INSERT INTO " + schema + ".\""};
+    query += table_name;
+    query += "\" (rowid";
+    for (const auto& col : cols) {
+      query += ",\"";
+      query += col;
+      query += "\"";
+    }
+    query += ") VALUES (?";
+    for (size_t ind = 0; ind < cols.size(); ++ind) {
+      query += ",?";
+    }
+    query += ") ON CONFLICT(rowid) DO ";
+    if (cols.empty()) {
+      query += "NOTHING;";
+      return query;
+    }
+    query += "UPDATE SET ";
+    for (size_t ind = 0; ind < cols.size(); ++ind) {
+      bool last = (ind + 1 == cols.size());
+      query += "\"";
+      query += cols[ind];
+      query += "\"=excluded.\"";
+      query += cols[ind];
+      query += (last?"\";":"\",");
+    }
+    return query;
+  }
 
-    //Execute this query
-    TryExecSimpleQuery(table_create_ss.str());
-    //Register the table as is
-    std::stringstream register_ss;
-    register_ss << "INSERT INTO main.Files VALUES(\"" << name  <<"\",\"testtesttest\",1);";
-    TryExecSimpleQuery(register_ss.str());
+  std::string BuildDeleteQuery(const std::string& table_name, const std::string& schema) {
+    std::string query {"DELETE FROM " + schema + ".\""};
+    query += table_name;
+    query += "\" WHERE rowid = ?;";
+    return query;
+  }
+  
+  std::string SearchIndexName(const std::string& table_name) {
+    return table_name + "__fts";
+  }
 
-    //The virgin version: row-by-row insert calls for each csv row
-    //The chad version: batch insert with mass bind for safety and performance
-    //I'm still a virgin though
-    if (!create_only) {
-      auto lines = SplitIntoViews(content);
-      for (size_t ind = has_signature?1:0; ind < lines.size() ; ++ind) {
-	//For whatever reason Apple's stdc++ header does not have std::format
-	std::stringstream table_insert_ss;
-        table_insert_ss
-	<< "INSERT INTO main.\"" << name << "\" VALUES("
-        << content.substr(lines[ind].offset,lines[ind].length)
-	<< ");";
+  // External content index, so the text is not stored twice
+  // Triggers rather than hooks in the write paths: upserts, batches and plain SQL all go through them
+  std::vector<std::string> BuildSearchIndexQueries(const std::string& table_name,
+						   const std::vector<std::string>& text_cols,
+						   SearchMode mode,
+						   const std::string& schema) {
+    auto fts_name = SearchIndexName(table_name);
+    std::string col_list;
+    for (const auto& col : text_cols) {
+      col_list += ",\"" + col + "\"";
+    }
+    std::vector<std::string> queries;
+    queries.push_back("CREATE VIRTUAL TABLE " + schema + ".\"" + fts_name + "\" USING fts5(" +
+		      col_list.substr(1) + ", content='" + table_name + "', content_rowid='rowid'" +
+		      (mode == TrigramSearch?", tokenize='trigram'":"") + ");");
+    queries.push_back("INSERT INTO " + schema + ".\"" + fts_name + "\"(\"" + fts_name + "\") VALUES ('rebuild');");
+    auto triggers = BuildSearchTriggerQueries(table_name,text_cols,schema);
+    queries.insert(queries.end(),triggers.begin(),triggers.end());
+    return queries;
+  }
 
-	TryExecSimpleQuery(table_insert_ss.str());
-      }
+  //With external content the index only ever holds what is inserted into it, so it can be filled
+  //straight from the staged rows while the content table it names does not exist yet
+  std::vector<std::string> BuildStagedSearchIndexQueries(const std::string& table_name,
+							 const std::string& staged_name,
+							 const std::vector<std::string>& text_cols,
+							 SearchMode mode,
+							 const std::string& schema) {
+    auto fts_name = SearchIndexName(staged_name);
+    std::string col_list;
+    for (const auto& col : text_cols) {
+      col_list += ",\"" + col + "\"";
     }
-    
+    std::vector<std::string> queries;
+    queries.push_back("CREATE VIRTUAL TABLE " + schema + ".\"" + fts_name + "\" USING fts5(" +
+		      col_list.substr(1) + ", content='" + table_name + "', content_rowid='rowid'" +
+		      (mode == TrigramSearch?", tokenize='trigram'":"") + ");");
+    queries.push_back("INSERT INTO " + schema + ".\"" + fts_name + "\"(rowid" + col_list + ") SELECT rowid" +
+		      col_list + " FROM " + schema + ".\"" + staged_name + "\";");
+    return queries;
   }
 
-  //This will fail miserably with non-ASCII table names
-  //Solution? Refuse to upload CSVs under non-ASCII names :-)
+  std::string ColumnIndexName(const std::string& table_name, const std::string& col) {
+    return table_name + "__idx_" + col;
+  }
 
-  std::vector<std::string> CSVApp::DbQueryTableList() {
-    sqlite3_stmt *table_list_query;
-    std::cerr << "Query:" << kTableQuery << "\n";
-    std::cerr << "Query length:" << kTableQuery.length() << "\n";
-    if (sqlite3_prepare_v2(db_handle_,
-			   kTableQuery.c_str(),
-			   kTableQuery.length() + 1,
-			   &table_list_query,
-			   nullptr) != SQLITE_OK) {
-      std::cerr << "In DbQueryTableList::prepare\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+  std::string BuildColumnIndexQuery(const std::string& table_name, const std::string& col, const std::string& schema) {
+    return BuildStagedColumnIndexQuery(table_name,table_name,col,schema);
+  }
+
+  std::string BuildStagedColumnIndexQuery(const std::string& table_name,
+					  const std::string& staged_name,
+					  const std::string& col,
+					  const std::string& schema) {
+    return "CREATE INDEX " + schema + ".\"" + ColumnIndexName(table_name,col) + "\" ON \"" + staged_name + "\" (\"" + col + "\");";
+  }
+
+  std::vector<std::string> BuildSearchTriggerQueries(const std::string& table_name,
+						     const std::vector<std::string>& text_cols,
+						     const std::string& schema) {
+    auto fts_name = SearchIndexName(table_name);
+    std::string col_list,new_list,old_list;
+    for (const auto& col : text_cols) {
+      col_list += ",\"" + col + "\"";
+      new_list += ",new.\"" + col + "\"";
+      old_list += ",old.\"" + col + "\"";
     }
-    std::vector<std::string> table_names;
-    while (sqlite3_step(table_list_query) == SQLITE_ROW) {
-      auto table_name = sqlite3_column_text(table_list_query,0);
-      table_names.emplace_back(reinterpret_cast<const char*>(table_name));
+    auto insert_new = "INSERT INTO \"" + fts_name + "\"(rowid" + col_list + ") VALUES (new.rowid" + new_list + ");";
+    auto delete_old = "INSERT INTO \"" + fts_name + "\"(\"" + fts_name + "\",rowid" + col_list +
+      ") VALUES ('delete',old.rowid" + old_list + ");";
+
+    std::vector<std::string> queries;
+    queries.push_back("CREATE TRIGGER " + schema + ".\"" + fts_name + "_ai\" AFTER INSERT ON \"" + table_name +
+		      "\" BEGIN " + insert_new + " END;");
+    queries.push_back("CREATE TRIGGER " + schema + ".\"" + fts_name + "_ad\" AFTER DELETE ON \"" + table_name +
+		      "\" BEGIN " + delete_old + " END;");
+    queries.push_back("CREATE TRIGGER " + schema + ".\"" + fts_name + "_au\" AFTER UPDATE ON \"" + table_name +
+		      "\" BEGIN " + delete_old + " " + insert_new + " END;");
+    return queries;
+  }
+
+  // Ranking and the page window are applied inside the index before joining back to the rows
+  std::string BuildSearchQuery(const std::string& table_name,
+			       const std::vector<std::string>& cols,
+			       const std::string& source) {
+    auto fts_name = SearchIndexName(table_name);
+    std::string query {"SELECT base.rowid, hits.rank, hits.snip"};
+    for (const auto& col : cols) {
+      query += ", base.\"" + col + "\"";
     }
-    
-    //Finalization to reuse table_list_query later
-    //Who needs many pointer when one pointer do the thing?
-    if (sqlite3_finalize(table_list_query) != SQLITE_OK) {
-      std::cerr << "In DbQueryTableList::finalize\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+    query += " FROM (SELECT rowid, rank, snippet(\"" + fts_name + "\",-1,'[',']','...',16) AS snip FROM \"" +
+      fts_name + "\" WHERE \"" + fts_name + "\" MATCH ? ORDER BY rank LIMIT ? OFFSET ?) AS hits " +
+      "INNER JOIN " + source + " AS base ON base.rowid = hits.rowid ORDER BY hits.rank;";
+    return query;
+  }
+
+  std::string QuoteSearchPhrase(const std::string& text) {
+    std::string phrase {"\""};
+    for (auto cur_char : text) {
+      if (cur_char == '"') {
+	phrase += '"';
+      }
+      phrase += cur_char;
     }
+    phrase += '"';
+    return phrase;
+  }
 
-    return table_names;
+  uint64_t WindowRows(const std::pair<uint32_t,uint32_t>& row_range) {
+    return (row_range.second >= row_range.first)?(uint64_t(row_range.second) - row_range.first + 1):0;
   }
 
-  std::vector<std::string> CSVApp::DbQueryColList(const std::string& table_name) {
-    sqlite3_stmt *table_col_query;
-    std::string col_query ("SELECT name FROM pragma_table_info('");
-    col_query += table_name;
-    col_query += "');";
+  std::vector<std::pair<std::string,bool>> OrderedSortParams(std::string_view target) {
+    std::vector<std::pair<std::string,bool>> sorts;
+    auto query_pos = target.find('?');
+    if (query_pos == std::string_view::npos) {
+      return sorts;
+    }
+    auto query = target.substr(query_pos + 1);
+    while (!query.empty()) {
+      auto end = std::min(query.find('&'),query.size());
+      auto param = query.substr(0,end);
+      query.remove_prefix(std::min(end + 1,query.size()));
+      auto eq = param.find('=');
+      auto key = param.substr(0,eq);
+      if (eq != std::string_view::npos && (key == "asc" || key == "desc")) {
+	sorts.emplace_back(httplib::detail::decode_url(std::string(param.substr(eq + 1)),true),key == "asc");
+      }
+    }
+    return sorts;
+  }
 
-    std::cerr << "Query:" << col_query << "\n";
-    if (sqlite3_prepare_v2(db_handle_,
-			   col_query.c_str(),
-			   col_query.length() + 1,
-			   &table_col_query,
-			   nullptr) != SQLITE_OK) {
-      std::cerr << "In DbQueryColList::prepare\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+  std::string BuildViewCacheKey(const std::string& table_name,
+				const std::vector<std::string>& cols,
+				const std::vector<std::pair<std::string,bool>>& sorts,
+				const std::pair<uint32_t,uint32_t> row_range,
+				const std::vector<std::string>& issues) {
+    // Unit separators can't come in through a table or column name we'd accept anyway
+    std::string key {table_name};
+    key += '\x1f';
+    for (const auto& col : cols) {
+      key += col;
+      key += '\x1e';
     }
-    std::vector<std::string> cols;
-    while(sqlite3_step(table_col_query) == SQLITE_ROW) {
-      auto col_name = sqlite3_column_text(table_col_query,0);
-      cols.emplace_back(reinterpret_cast<const char*>(col_name));
+    key += '\x1f';
+    for (const auto& sort : sorts) {
+      key += sort.first;
+      key += (sort.second?"\x1e+":"\x1e-");
     }
-    
-    if (sqlite3_finalize(table_col_query) != SQLITE_OK) {
-      std::cerr << "In DbQueryColList::finalize\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+    key += '\x1f';
+    AppendNumber(key,row_range.first);
+    key += ':';
+    AppendNumber(key,row_range.second);
+    key += '\x1f';
+    for (const auto& issue : issues) {
+      key += issue;
+      key += '\x1e';
     }
-    return cols;
+    return key;
   }
-  
-  JSONData CSVApp::DbQueryList() {
-    JSONData list;
-    //And once again i cry over lack of std::format
-    auto table_names = DbQueryTableList();
-    std::vector<std::string> tables_json;
-    for (const auto& table : table_names) {
-      JSONData table_desc;
-      auto cols = DbQueryColList(table);
-      table_desc[table] = PackJSONArray(cols);
-      tables_json.push_back(PackJSON(table_desc));
+
+  bool ETagMatches(std::string_view header, std::string_view etag) {
+    while (!header.empty()) {
+      auto end = std::min(header.find(','),header.size());
+      auto tag = header.substr(0,end);
+      header.remove_prefix(std::min(end + 1,header.size()));
+      while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+	tag.remove_prefix(1);
+      }
+      while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+	tag.remove_suffix(1);
+      }
+      if (tag.substr(0,2) == "W/") {
+	tag.remove_prefix(2);
+      }
+      if (tag == "*" || tag == etag) {
+	return true;
+      }
     }
-    list["tables"] = PackJSONArray(tables_json);
-    return list;
+    return false;
   }
 
-  //Once again we offload the authorization duty to handler
-  JSONData CSVApp::DbQueryTable(const std::string& table_name,
-				const std::vector<std::string>& cols,
-				const std::unordered_map<std::string,bool> sorts,
-				const std::pair<uint32_t,uint32_t> row_range) {
-    JSONData table;
-    
-    //Build the query string
-    std::stringstream query_ss;
-    query_ss << "SELECT ";
+  ViewCache::ViewCache(size_t shard_count, size_t capacity_bytes) {
+    for (size_t ind = 0; ind < shard_count; ++ind) {
+      shards_.push_back(std::make_unique<Shard>());
+    }
+    shard_capacity_ = capacity_bytes / std::max<size_t>(shard_count,1);
+  }
 
-    std::vector<std::string> real_cols;
-    if (cols.empty()) {
-      real_cols = DbQueryColList(table_name);
+  ViewCache::Shard& ViewCache::ShardFor(const std::string& key) {
+    return *shards_[std::hash<std::string>{}(key) % shards_.size()];
+  }
+
+  std::shared_ptr<const std::string> ViewCache::Get(const std::string& key) {
+    auto& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      return nullptr;
     }
-    const std::vector<std::string>& used_cols = (cols.empty())?real_cols:cols;
-    for (size_t ind = 0;ind <used_cols.size() ;++ind) {
-      bool last = (ind + 1 == used_cols.size());
-      query_ss << "\"" << used_cols[ind] << (last?"\" ":"\", ");
+    shard.lru.splice(shard.lru.begin(),shard.lru,it->second);
+    return it->second->second;
+  }
+
+  void ViewCache::Put(const std::string& key, std::shared_ptr<const std::string> body) {
+    size_t size = key.length() + body->length();
+    if (size > shard_capacity_) {
+      return;
+    }
+    auto& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      shard.bytes -= it->first.length() + it->second->second->length();
+      shard.lru.erase(it->second);
+      shard.index.erase(it);
     }
-    query_ss << "FROM main.\"" << table_name << "\" ";
-    if(!sorts.empty()) {
-      query_ss <<" ORDER BY ";
-      for(const auto sort : sorts) {
-	query_ss << "\"" << sort.first << "\" " << (sort.second?"ASC,":"DESC,");
+    shard.lru.emplace_front(key,std::move(body));
+    shard.index[key] = shard.lru.begin();
+    shard.bytes += size;
+    while (shard.bytes > shard_capacity_) {
+      auto& victim = shard.lru.back();
+      shard.bytes -= victim.first.length() + victim.second->length();
+      shard.index.erase(victim.first);
+      shard.lru.pop_back();
+    }
+  }
+
+  namespace {
+    void AppendBigEndian(std::string& key, uint64_t val) {
+      for (int shift = 56; shift >= 0; shift -= 8) {
+	key += static_cast<char>((val >> shift) & 0xFF);
       }
-      query_ss.seekp(-1,std::ios::end);
     }
-    query_ss << " WHERE rowid >= " << row_range.first <<
-    " AND rowid <= " << row_range.second << ";";
-    auto query_str = query_ss.str();
-    //Execute query and pack it into JSON
-    std::cerr << "View query:" << query_str << "\n";
 
-    sqlite3_stmt *query;
-    if (sqlite3_prepare_v2(db_handle_,
-			   query_str.c_str(),
-			   query_str.length() + 1,
-			   &query,
-			   nullptr) != SQLITE_OK) {
-      std::cerr << "In DbQueryTable::prepare\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+    void ComplementFrom(std::string& key, size_t start, bool desc) {
+      if (!desc) {
+	return;
+      }
+      for (size_t ind = start; ind < key.length(); ++ind) {
+	key[ind] = static_cast<char>(~key[ind]);
+      }
     }
+  }
 
-    std::vector<std::string> rows_json;
-    while(sqlite3_step(query) == SQLITE_ROW) {
-      JSONData row;      
-      for (size_t ind = 0; ind < used_cols.size() ;++ind) {
-	auto type = sqlite3_column_type(query,ind);
-	switch (type) {
-	case SQLITE_INTEGER:
-	  row[used_cols[ind]] = std::to_string(sqlite3_column_int(query,ind));
-	  break;
-	case SQLITE_FLOAT:
-	  row[used_cols[ind]] = std::to_string(sqlite3_column_double(query,ind));
-	  break;
-	case SQLITE_TEXT:
-	  row[used_cols[ind]] = std::string {
-	    reinterpret_cast<const char*>(sqlite3_column_text(query,ind))
-	  };
-	  break;
-	case SQLITE_NULL:
-	  row[used_cols[ind]] = "";
-	default:
-	  break;
-	}
+  //Type tags follow SQLite's cross type order
+  void AppendNullKey(std::string& key, bool desc) {
+    auto start = key.length();
+    key += '\x01';
+    ComplementFrom(key,start,desc);
+  }
+
+  //Numbers compare by the double, integers too large for it to tell apart fall back to the exact value
+  void AppendNumericKey(std::string& key, double val, int64_t tiebreak, bool desc) {
+    auto start = key.length();
+    key += '\x02';
+    if (val == 0.0) {
+      val = 0.0;
+    }
+    uint64_t bits;
+    std::memcpy(&bits,&val,sizeof(bits));
+    bits = (bits >> 63)?~bits:(bits | (1ull << 63));
+    AppendBigEndian(key,bits);
+    AppendBigEndian(key,static_cast<uint64_t>(tiebreak) ^ (1ull << 63));
+    ComplementFrom(key,start,desc);
+  }
+
+  //Zero bytes are escaped as 00 FF and the value ends with 00 00, so a prefix sorts first
+  void AppendBytesKey(std::string& key, std::string_view bytes, bool is_blob, bool desc) {
+    auto start = key.length();
+    key += is_blob?'\x04':'\x03';
+    for (auto c : bytes) {
+      key += c;
+      if (c == '\0') {
+	key += '\xFF';
       }
-      rows_json.push_back(PackJSON(row));
     }
+    key.append(2,'\0');
+    ComplementFrom(key,start,desc);
+  }
+
+  void AppendColumnKey(std::string& key, sqlite3_stmt* stmt, int ind, bool desc) {
+    switch (sqlite3_column_type(stmt,ind)) {
+    case SQLITE_INTEGER: {
+      auto val = sqlite3_column_int64(stmt,ind);
+      AppendNumericKey(key,static_cast<double>(val),val,desc);
+      break;
+    }
+    case SQLITE_FLOAT: {
+      auto val = sqlite3_column_double(stmt,ind);
+      int64_t tiebreak = (val >= 9.2e18)?INT64_MAX:
+	(val <= -9.2e18)?INT64_MIN:static_cast<int64_t>(val);
+      AppendNumericKey(key,val,tiebreak,desc);
+      break;
+    }
+    case SQLITE_TEXT:
+    case SQLITE_BLOB: {
+      bool is_blob = sqlite3_column_type(stmt,ind) == SQLITE_BLOB;
+      auto data = static_cast<const char*>(sqlite3_column_blob(stmt,ind));
+      auto len = static_cast<size_t>(sqlite3_column_bytes(stmt,ind));
+      AppendBytesKey(key,{data,len},is_blob,desc);
+      break;
+    }
+    default:
+      AppendNullKey(key,desc);
+    }
+  }
+
+  void AppendRowidKey(std::string& key, int64_t rowid) {
+    AppendBigEndian(key,static_cast<uint64_t>(rowid) ^ (1ull << 63));
+  }
+
+  int64_t RowidFromKey(std::string_view key) {
+    uint64_t val = 0;
+    for (size_t ind = key.length() - 8; ind < key.length(); ++ind) {
+      val = (val << 8) | static_cast<uint8_t>(key[ind]);
+    }
+    return static_cast<int64_t>(val ^ (1ull << 63));
+  }
+
+  void AppendSortKey(std::string& key, sqlite3_stmt* stmt,
+		     const std::vector<std::pair<std::string,bool>>& sorts) {
+    for (size_t ind = 0; ind < sorts.size(); ++ind) {
+      AppendColumnKey(key,stmt,ind + 1,!sorts[ind].second);
+    }
+    AppendRowidKey(key,sqlite3_column_int64(stmt,0));
+  }
+
+  std::string BuildSortScanQuery(const std::string& source,
+				 const std::vector<std::pair<std::string,bool>>& sorts,
+				 bool partitioned,
+				 const std::string& filter) {
+    std::string query = "SELECT rowid";
+    for (const auto& sort : sorts) {
+      query += ", \"" + sort.first + "\"";
+    }
+    query += " FROM " + source;
+    if (!filter.empty()) {
+      query += " WHERE " + filter + (partitioned?" AND rowid > ? AND rowid <= ?;":";");
+    }
+    else {
+      query += partitioned?" WHERE rowid > ? AND rowid <= ?;":";";
+    }
+    return query;
+  }
+
+  void TopKHeap::Offer(const std::string& key) {
+    if (heap_.size() < limit_) {
+      heap_.push(key);
+    }
+    else if (limit_ > 0 && key < heap_.top()) {
+      heap_.pop();
+      heap_.push(key);
+    }
+  }
+
+  std::vector<std::string> TopKHeap::Take() {
+    std::vector<std::string> result(heap_.size());
+    for (auto it = result.rbegin(); it != result.rend(); ++it) {
+      *it = heap_.top();
+      heap_.pop();
+    }
+    return result;
+  }
+
+  std::vector<int64_t> MergeTopK(std::vector<std::vector<std::string>> parts, size_t limit, size_t skip) {
+    std::vector<std::string> all;
+    for (auto& part : parts) {
+      std::move(part.begin(),part.end(),std::back_inserter(all));
+    }
+    limit = std::min(limit,all.size());
+    std::partial_sort(all.begin(),all.begin() + limit,all.end());
+    std::vector<int64_t> result;
+    for (size_t ind = skip; ind < limit; ++ind) {
+      result.push_back(RowidFromKey(all[ind]));
+    }
+    return result;
+  }
+
+  std::vector<int64_t> SampleRowids(int64_t max_rowid, size_t n, uint64_t seed) {
+    std::vector<int64_t> rowids;
+    if (max_rowid <= 0 || n == 0) {
+      return rowids;
+    }
+    if (n >= static_cast<uint64_t>(max_rowid)) {
+      rowids.reserve(max_rowid);
+      for (int64_t rowid = 1; rowid <= max_rowid; ++rowid) {
+	rowids.push_back(rowid);
+      }
+      return rowids;
+    }
+    //Floyd's algorithm, exactly n draws however large the table is
+    std::mt19937_64 gen(seed);
+    std::unordered_set<int64_t> picked(2 * n);
+    for (int64_t top = max_rowid - n + 1; top <= max_rowid; ++top) {
+      auto pick = std::uniform_int_distribution<int64_t>(1,top)(gen);
+      if (!picked.insert(pick).second) {
+	picked.insert(top);
+      }
+    }
+    rowids.assign(picked.begin(),picked.end());
+    std::sort(rowids.begin(),rowids.end());
+    return rowids;
+  }
+
+  std::optional<AggregateOp> ParseAggregateOp(std::string_view name) {
+    if (name == "count") {
+      return AggregateOp::Count;
+    }
+    if (name == "sum") {
+      return AggregateOp::Sum;
+    }
+    if (name == "avg") {
+      return AggregateOp::Avg;
+    }
+    return std::nullopt;
+  }
+
+  Estimate EstimateAggregate(AggregateOp op, const SampleMoments& group, uint64_t probes, uint64_t population,
+			     double z) {
+    Estimate est;
+    if (probes == 0) {
+      return est;
+    }
+    double n = probes;
+    double slots = population;
+    //Finite population correction, a sample of every slot is exact
+    double fpc = (probes >= population)?0:(1 - n / slots);
+    auto bound = [&](double variance, double size) -> std::optional<double> {
+      if (fpc == 0) {
+	return 0.0;
+      }
+      if (size < 2) {
+	return std::nullopt;
+      }
+      return z * std::sqrt(std::max(variance,0.0) / size * fpc);
+    };
+    switch (op) {
+    case AggregateOp::Count: {
+      //Share of the probes landing on the group, scaled up to every slot
+      double share = group.rows / n;
+      est.value = share * slots;
+      if (auto err = bound(share * (1 - share) * n / (n - 1),n)) {
+	est.error = *err * slots;
+      }
+      break;
+    }
+    case AggregateOp::Sum: {
+      double mean = group.sum / n;
+      est.value = mean * slots;
+      if (auto err = bound((group.sum_sq - n * mean * mean) / (n - 1),n)) {
+	est.error = *err * slots;
+      }
+      break;
+    }
+    case AggregateOp::Avg: {
+      //Ratio estimate, only the group's own rows say anything about its mean
+      double rows = group.rows;
+      if (rows == 0) {
+	break;
+      }
+      est.value = group.sum / rows;
+      est.error = bound((group.sum_sq - rows * est.value * est.value) / (rows - 1),rows);
+      break;
+    }
+    }
+    return est;
+  }
+
+  ExternalSorter::ExternalSorter(size_t limit, size_t memory_bytes, size_t threads)
+    : limit_(limit),
+      memory_bytes_(memory_bytes),
+      threads_(std::max<size_t>(threads,1)),
+      current_(std::make_unique<Run>()) {
+    //A run being filled, one being sorted per thread and the kept runs all share the budget
+    run_bytes_ = std::max<size_t>(memory_bytes_ / (4 * (threads_ + 1)),4096);
+  }
+
+  ExternalSorter::~ExternalSorter() {
+    for (auto& pending : pending_) {
+      pending.wait();
+    }
+    for (auto& run : runs_) {
+      if (run->spill) {
+	std::fclose(run->spill);
+      }
+    }
+  }
+
+  void ExternalSorter::Add(std::string_view key) {
+    current_->keys.emplace_back(static_cast<uint32_t>(current_->arena.length()),
+				static_cast<uint32_t>(key.length()));
+    current_->arena.append(key);
+    if (current_->arena.length() + 8 * current_->keys.size() >= run_bytes_) {
+      SealRun();
+    }
+  }
+
+  void ExternalSorter::SealRun() {
+    if (current_->keys.empty()) {
+      return;
+    }
+    if (pending_.size() >= threads_) {
+      pending_.front().get();
+      pending_.pop_front();
+    }
+    runs_.push_back(std::move(current_));
+    current_ = std::make_unique<Run>();
+    Run* run = runs_.back().get();
+    pending_.push_back(std::async(std::launch::async,[this,run]() { SortRun(*run); }));
+  }
+
+  void ExternalSorter::SortRun(Run& run) {
+    const auto& arena = run.arena;
+    auto view = [&arena](const std::pair<uint32_t,uint32_t>& k) {
+      return std::string_view(arena.data() + k.first,k.second);
+    };
+    auto less = [&view](const auto& a, const auto& b) { return view(a) < view(b); };
+    //Keys past the limit can never reach the page, only the head of the run is ordered
+    if (run.keys.size() > limit_) {
+      std::partial_sort(run.keys.begin(),run.keys.begin() + limit_,run.keys.end(),less);
+      run.keys.resize(limit_);
+    }
+    else {
+      std::sort(run.keys.begin(),run.keys.end(),less);
+    }
+
+    std::string packed;
+    std::vector<std::pair<uint32_t,uint32_t>> packed_keys;
+    packed_keys.reserve(run.keys.size());
+    for (const auto& k : run.keys) {
+      packed_keys.emplace_back(static_cast<uint32_t>(packed.length()),k.second);
+      packed.append(view(k));
+    }
+
+    std::unique_lock<std::mutex> lock(kept_mutex_);
+    if (kept_bytes_ + packed.length() <= memory_bytes_ || !(run.spill = std::tmpfile())) {
+      kept_bytes_ += packed.length();
+      lock.unlock();
+      run.arena = std::move(packed);
+      run.keys = std::move(packed_keys);
+      return;
+    }
+    lock.unlock();
+    for (const auto& k : packed_keys) {
+      std::fwrite(&k.second,sizeof(k.second),1,run.spill);
+      std::fwrite(packed.data() + k.first,1,k.second,run.spill);
+    }
+    run.spilled = packed_keys.size();
+    run.arena = std::string();
+    run.keys = {};
+  }
+
+  std::vector<int64_t> ExternalSorter::Finish(size_t skip) {
+    SealRun();
+    for (auto& pending : pending_) {
+      pending.get();
+    }
+    pending_.clear();
+
+    struct Cursor {
+      Run* run;
+      size_t pos;
+      std::string buf;
+      std::string_view cur;
+    };
+    auto advance = [](Cursor& c) {
+      if (c.run->spill) {
+	if (c.pos >= c.run->spilled) {
+	  return false;
+	}
+	uint32_t len = 0;
+	if (std::fread(&len,sizeof(len),1,c.run->spill) != 1) {
+	  return false;
+	}
+	c.buf.resize(len);
+	if (std::fread(c.buf.data(),1,len,c.run->spill) != len) {
+	  return false;
+	}
+	c.cur = c.buf;
+      }
+      else {
+	if (c.pos >= c.run->keys.size()) {
+	  return false;
+	}
+	auto k = c.run->keys[c.pos];
+	c.cur = std::string_view(c.run->arena.data() + k.first,k.second);
+      }
+      ++c.pos;
+      return true;
+    };
+
+    std::vector<Cursor> cursors;
+    cursors.reserve(runs_.size());
+    for (auto& run : runs_) {
+      if (run->spill) {
+	std::rewind(run->spill);
+      }
+      cursors.push_back({run.get(),0,{},{}});
+    }
+    auto greater = [&cursors](size_t a, size_t b) { return cursors[a].cur > cursors[b].cur; };
+    std::priority_queue<size_t,std::vector<size_t>,decltype(greater)> heap(greater);
+    for (size_t ind = 0; ind < cursors.size(); ++ind) {
+      if (advance(cursors[ind])) {
+	heap.push(ind);
+      }
+    }
+
+    std::vector<int64_t> result;
+    for (size_t pos = 0; pos < limit_ && !heap.empty(); ++pos) {
+      auto top = heap.top();
+      heap.pop();
+      if (pos >= skip) {
+	result.push_back(RowidFromKey(cursors[top].cur));
+      }
+      if (advance(cursors[top])) {
+	heap.push(top);
+      }
+    }
+    return result;
+  }
+
+  std::string_view UnquoteField(std::string_view field) {
+    if (field.length() >= 2 && (field.front() == '"' || field.front() == '\'') && field.back() == field.front()) {
+      return field.substr(1,field.length() - 2);
+    }
+    return field;
+  }
+
+  void SplitFields(std::string_view line, char separator, std::vector<std::string_view>& fields) {
+    fields.clear();
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    size_t start = 0;
+    while (true) {
+      auto it = line.find(separator,start);
+      if (it == std::string_view::npos) {
+	fields.push_back(line.substr(start));
+	return;
+      }
+      fields.push_back(line.substr(start,it - start));
+      start = it + 1;
+    }
+  }
+
+  std::vector<std::vector<std::string_view>> DetectDictionaries(const std::string& content,
+								const std::vector<Substring>& lines,
+								size_t first_line,
+								const std::vector<Types>& types,
+								char separator) {
+    std::vector<std::vector<std::string_view>> dicts(types.size());
+    size_t rows = (lines.size() > first_line)?(lines.size() - first_line):0;
+    if (rows < kDictionaryMinRows) {
+      return dicts;
+    }
+    size_t max_codes = std::min(kDictionaryMaxCodes,rows / kDictionaryMinRepeats);
+    std::vector<std::unordered_set<std::string_view>> seen(types.size());
+    std::vector<bool> open(types.size());
+    size_t open_count = 0;
+    for (size_t col = 0; col < types.size(); ++col) {
+      open[col] = (types[col] == Types::String);
+      open_count += open[col];
+    }
+
+    std::string_view text(content);
+    std::vector<std::string_view> fields;
+    for (size_t ind = first_line; ind < lines.size() && open_count > 0; ++ind) {
+      SplitFields(text.substr(lines[ind].offset,lines[ind].length),separator,fields);
+      for (size_t col = 0; col < fields.size() && col < types.size(); ++col) {
+	//Empty fields are NULLs rather than a value of their own
+	if (!open[col] || fields[col].empty()) {
+	  continue;
+	}
+	seen[col].insert(UnquoteField(fields[col]));
+	if (seen[col].size() > max_codes) {
+	  open[col] = false;
+	  --open_count;
+	  seen[col] = {};
+	}
+      }
+    }
+    for (size_t col = 0; col < types.size(); ++col) {
+      if (open[col]) {
+	dicts[col].assign(seen[col].begin(),seen[col].end());
+	std::sort(dicts[col].begin(),dicts[col].end());
+      }
+    }
+    return dicts;
+  }
+
+  std::string DictionaryTableName(const std::string& table_name, const std::string& col) {
+    return table_name + "__dict_" + col;
+  }
+
+  std::string DecodedViewName(const std::string& table_name) {
+    return table_name + "__decoded";
+  }
+
+  std::vector<std::string> BuildDictionaryQueries(const std::string& table_name, const std::string& col,
+						  const std::string& schema) {
+    auto dict = DictionaryTableName(table_name,col);
+    std::vector<std::string> queries;
+    queries.push_back("CREATE TABLE " + schema + ".\"" + dict + "\" (" + kDictTableColumns + ");");
+    //Integers are the codes themselves, every other value is encoded as its text. Writers bind
+    //integer values as text (see BindJSONValue), the update that stores a code must not encode it again
+    auto value = "CAST(new.\"" + col + "\" AS TEXT)";
+    //Not OR IGNORE, the conflict policy of an outer upsert overrides that of the trigger
+    std::string encode = "BEGIN INSERT INTO \"" + dict + "\"(value) SELECT " + value + " WHERE NOT EXISTS "
+      "(SELECT 1 FROM \"" + dict + "\" WHERE value = " + value + "); "
+      "UPDATE \"" + table_name + "\" SET \"" + col + "\" = (SELECT code FROM \"" + dict +
+      "\" WHERE value = " + value + ") WHERE rowid = new.rowid; END;";
+    auto when = "\" WHEN typeof(new.\"" + col + "\") IN ('text','real','blob') ";
+    queries.push_back("CREATE TRIGGER " + schema + ".\"" + dict + "_ai\" AFTER INSERT ON \"" + table_name +
+		      when + encode);
+    queries.push_back("CREATE TRIGGER " + schema + ".\"" + dict + "_au\" AFTER UPDATE OF \"" + col + "\" ON \"" + table_name +
+		      when + encode);
+    return queries;
+  }
+
+  std::string BuildDecodedView(const std::string& table_name,
+			       const std::vector<std::string>& cols,
+			       const std::vector<bool>& coded,
+			       const std::string& schema) {
+    std::string select = "SELECT base.rowid AS rowid";
+    std::string joins;
+    for (size_t ind = 0; ind < cols.size(); ++ind) {
+      if (ind < coded.size() && coded[ind]) {
+	auto alias = "d" + std::to_string(ind);
+	select += ", " + alias + ".value AS \"" + cols[ind] + "\"";
+	joins += " LEFT JOIN \"" + DictionaryTableName(table_name,cols[ind]) + "\" AS " + alias +
+	  " ON " + alias + ".code = base.\"" + cols[ind] + "\"";
+      }
+      else {
+	select += ", base.\"" + cols[ind] + "\" AS \"" + cols[ind] + "\"";
+      }
+    }
+    return "CREATE VIEW " + schema + ".\"" + DecodedViewName(table_name) + "\" AS " + select +
+      " FROM \"" + table_name + "\" AS base" + joins + ";";
+  }
+
+  bool ColumnProfile::Value::operator<(const Value& other) const {
+    if (text != other.text) {
+      return !text;
+    }
+    return text?(str < other.str):(num < other.num);
+  }
+
+  ColumnProfile::ColumnProfile(std::string column, bool numeric) {
+    stats_.column = std::move(column);
+    stats_.numeric = numeric;
+  }
+
+  ColumnProfile::Value ColumnProfile::Make(std::string_view value) const {
+    Value made {true,0,std::string(value)};
+    //What column affinity would store as a number
+    if (stats_.numeric && !value.empty() && (std::isdigit(static_cast<unsigned char>(value[0])) || value[0] == '-' || value[0] == '.')) {
+      auto [end, ec] = std::from_chars(value.data(),value.data() + value.size(),made.num);
+      made.text = (ec != std::errc() || end != value.data() + value.size() || !std::isfinite(made.num));
+    }
+    return made;
+  }
+
+  void ColumnProfile::Add(std::optional<std::string_view> cell) {
+    ++stats_.rows;
+    if (!cell) {
+      ++stats_.nulls;
+      return;
+    }
+    auto value = *cell;
+    auto made = Make(value);
+    //Numbers hash by value so 2 and 2.0 are one value, as they are once stored
+    uint64_t hash;
+    if (made.text) {
+      hash = HashKey(value);
+    }
+    else {
+      double num = made.num + 0.0;
+      std::memcpy(&hash,&num,sizeof(hash));
+    }
+    //FNV-1a and raw doubles leave the top bits poorly mixed, the sketch needs them uniform
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    auto& reg = registers_[hash >> (64 - kHllBits)];
+    uint64_t rest = (hash << kHllBits) | (uint64_t(1) << (kHllBits - 1));
+    reg = std::max<uint8_t>(reg,__builtin_clzll(rest) + 1);
+
+    if (!min_ || made < *min_) {
+      min_ = made;
+    }
+    if (!max_ || *max_ < made) {
+      max_ = made;
+    }
+    //Algorithm R keeps every value seen so far in the sample with the same chance
+    uint64_t seen = stats_.rows - stats_.nulls;
+    if (sample_.size() < kHistogramSample) {
+      sample_.push_back(std::move(made));
+      return;
+    }
+    rng_ ^= rng_ << 13;
+    rng_ ^= rng_ >> 7;
+    rng_ ^= rng_ << 17;
+    uint64_t slot = rng_ % seen;
+    if (slot < kHistogramSample) {
+      sample_[slot] = std::move(made);
+    }
+  }
+
+  ColumnStats ColumnProfile::Finish() {
+    double inverse = 0;
+    size_t zeros = 0;
+    for (auto reg : registers_) {
+      inverse += std::ldexp(1.0,-reg);
+      zeros += (reg == 0);
+    }
+    double slots = registers_.size();
+    double estimate = 0.7213 / (1 + 1.079 / slots) * slots * slots / inverse;
+    //Linear counting is the better estimate while many registers are still empty
+    if (estimate <= 2.5 * slots && zeros > 0) {
+      estimate = slots * std::log(slots / zeros);
+    }
+    stats_.distinct = (stats_.rows > stats_.nulls)?std::llround(estimate):0;
+    stats_.distinct = std::min(std::max<uint64_t>(stats_.distinct,stats_.rows > stats_.nulls),stats_.rows - stats_.nulls);
+    if (min_) {
+      stats_.min = min_->str;
+      stats_.max = max_->str;
+    }
+    std::sort(sample_.begin(),sample_.end());
+    size_t buckets = std::min(kHistogramBuckets,sample_.size());
+    for (size_t ind = 0; ind < buckets; ++ind) {
+      stats_.bounds.push_back(sample_[(ind + 1) * sample_.size() / buckets - 1].str);
+    }
+    //The sample may have missed the extremes
+    if (!stats_.bounds.empty()) {
+      stats_.bounds.back() = stats_.max;
+    }
+    return stats_;
+  }
+
+  std::optional<std::string> HistogramCut(const ColumnStats& stats, uint64_t leading, bool asc) {
+    if (stats.bounds.empty() || stats.rows <= stats.nulls) {
+      return std::nullopt;
+    }
+    double depth = static_cast<double>(stats.rows - stats.nulls) / stats.bounds.size();
+    //NULLs come first in ascending order and last in descending
+    uint64_t before = asc?stats.nulls:0;
+    uint64_t needed = (leading > before)?(leading - before):0;
+    size_t buckets = static_cast<size_t>(std::ceil(needed / depth)) + 1;
+    if (buckets >= stats.bounds.size()) {
+      return std::nullopt;
+    }
+    //Values up to the bound of bucket k - 1 fill the first k buckets, values from the bound below
+    //the top k buckets fill those
+    return asc?stats.bounds[buckets - 1]:stats.bounds[stats.bounds.size() - 1 - buckets];
+  }
+
+  std::string StatLiteral(const ColumnStats& stats, const std::string& value) {
+    if (stats.numeric && !value.empty() &&
+	(std::isdigit(static_cast<unsigned char>(value[0])) || value[0] == '-' || value[0] == '.')) {
+      double num;
+      auto [end, ec] = std::from_chars(value.data(),value.data() + value.size(),num);
+      if (ec == std::errc() && end == value.data() + value.size() && std::isfinite(num)) {
+	return value;
+      }
+    }
+    std::string literal {"'"};
+    for (char chr : value) {
+      literal += chr;
+      if (chr == '\'') {
+	literal += chr;
+      }
+    }
+    literal += '\'';
+    return literal;
+  }
+
+  std::optional<RollupSpec> ParseRollupSpec(std::string_view serialized) {
+    auto doc = ParseJSON(serialized);
+    if (!doc || (*doc)[0].kind != JSONValue::Object) {
+      return std::optional<RollupSpec>();
+    }
+    //Names end up quoted in SQL, so they can't carry a quote themselves
+    auto name_ok = [](std::string_view name) {
+      return !name.empty() && name.find('"') == std::string_view::npos;
+    };
+    auto text = [&](std::string_view key, std::string& out) {
+      auto val = doc->Find(0,key);
+      if (!val || (*doc)[*val].kind != JSONValue::String || !name_ok((*doc)[*val].text)) {
+	return false;
+      }
+      out = std::string((*doc)[*val].text);
+      return true;
+    };
+    auto names = [&](std::string_view key, std::vector<std::string>& out) {
+      auto val = doc->Find(0,key);
+      if (!val) {
+	return true;
+      }
+      if ((*doc)[*val].kind != JSONValue::Array) {
+	return false;
+      }
+      for (uint32_t ind = doc->FirstChild(*val); ind < (*doc)[*val].end; ind = doc->Next(ind)) {
+	if ((*doc)[ind].kind != JSONValue::String || !name_ok((*doc)[ind].text)) {
+	  return false;
+	}
+	out.emplace_back((*doc)[ind].text);
+      }
+      return true;
+    };
+    RollupSpec spec;
+    if (!text("name",spec.name) || !text("table",spec.source) ||
+	!names("group",spec.group) || !names("aggregates",spec.aggregates)) {
+      return std::optional<RollupSpec>();
+    }
+    if (auto where = doc->Find(0,"where")) {
+      if ((*doc)[*where].kind != JSONValue::Object) {
+	return std::optional<RollupSpec>();
+      }
+      for (uint32_t ind = doc->FirstChild(*where); ind < (*doc)[*where].end; ind = doc->Next(doc->Next(ind))) {
+	const auto& val = (*doc)[doc->Next(ind)];
+	std::string literal;
+	switch (val.kind) {
+	case JSONValue::Null:
+	  literal = "NULL";
+	  break;
+	case JSONValue::Bool:
+	case JSONValue::Int:
+	  AppendNumber(literal,val.int_val);
+	  break;
+	case JSONValue::Float:
+	  literal = std::string(val.text);
+	  break;
+	case JSONValue::String:
+	  literal = "'";
+	  for (char chr : val.text) {
+	    literal += chr;
+	    if (chr == '\'') {
+	      literal += chr;
+	    }
+	  }
+	  literal += '\'';
+	  break;
+	default:
+	  return std::optional<RollupSpec>();
+	}
+	if (!name_ok((*doc)[ind].text)) {
+	  return std::optional<RollupSpec>();
+	}
+	spec.where.emplace_back(std::string((*doc)[ind].text),std::move(literal));
+      }
+    }
+    return std::optional<RollupSpec>(std::move(spec));
+  }
+
+  std::string RollupTriggerName(const std::string& rollup, const std::string& event) {
+    return rollup + "__rollup_" + event;
+  }
+
+  std::vector<std::string> BuildRollupTableQueries(const RollupSpec& spec, const std::string& schema) {
+    std::string cols;
+    for (const auto& col : spec.group) {
+      cols += "\"" + col + "\", ";
+    }
+    cols += "\"rows\" INTEGER NOT NULL";
+    for (const auto& col : spec.aggregates) {
+      cols += ", \"sum_" + col + "\" NOT NULL, \"count_" + col + "\" INTEGER NOT NULL, \"avg_" + col + "\" REAL";
+    }
+    std::vector<std::string> queries;
+    queries.push_back("CREATE TABLE " + schema + ".\"" + spec.name + "\" (" + cols + ");");
+    if (!spec.group.empty()) {
+      std::string group_list;
+      for (const auto& col : spec.group) {
+	group_list += ",\"" + col + "\"";
+      }
+      queries.push_back("CREATE INDEX " + schema + ".\"" + spec.name + "__idx_group\" ON \"" + spec.name +
+			"\" (" + group_list.substr(1) + ");");
+    }
+    return queries;
+  }
+
+  std::vector<std::string> BuildRollupRefreshQueries(const RollupSpec& spec,
+						     const std::vector<std::string>& coded,
+						     const std::string& source,
+						     const std::string& schema) {
+    auto table = "\"" + spec.name + "\"";
+    std::vector<std::string> queries;
+    for (const char* event : {"ai","ad","au"}) {
+      queries.push_back("DROP TRIGGER IF EXISTS " + schema + ".\"" + RollupTriggerName(spec.name,event) + "\";");
+    }
+    queries.push_back("DELETE FROM " + schema + "." + table + ";");
+
+    //Full computation over the decoded rows
+    std::string insert_cols,select_cols,group_list,filter;
+    for (const auto& col : spec.group) {
+      insert_cols += "\"" + col + "\", ";
+      select_cols += "\"" + col + "\", ";
+      group_list += ",\"" + col + "\"";
+    }
+    insert_cols += "\"rows\"";
+    select_cols += "count(*)";
+    for (const auto& col : spec.aggregates) {
+      insert_cols += ", \"sum_" + col + "\", \"count_" + col + "\", \"avg_" + col + "\"";
+      select_cols += ", coalesce(sum(\"" + col + "\"),0), count(\"" + col + "\"), avg(\"" + col + "\")";
+    }
+    for (const auto& [col, literal] : spec.where) {
+      filter += (filter.empty()?" WHERE \"":" AND \"") + col + "\" IS " + literal;
+    }
+    queries.push_back("INSERT INTO " + schema + "." + table + " (" + insert_cols + ") SELECT " + select_cols +
+		      " FROM " + source + filter + (group_list.empty()?"":" GROUP BY " + group_list.substr(1)) +
+		      " HAVING count(*) > 0;");
+
+    //The triggers add the new row to its group and take the old one out of it
+    auto value = [&](const std::string& row, const std::string& col) {
+      auto ref = row + ".\"" + col + "\"";
+      if (std::find(coded.begin(),coded.end(),col) == coded.end()) {
+	return ref;
+      }
+      return "CASE WHEN typeof(" + ref + ") = 'integer' THEN (SELECT value FROM \"" +
+	DictionaryTableName(spec.source,col) + "\" WHERE code = " + ref + ") ELSE " + ref + " END";
+    };
+    auto passes = [&](const std::string& row) {
+      std::string cond = "1";
+      for (const auto& [col, literal] : spec.where) {
+	cond += " AND (" + value(row,col) + ") IS " + literal;
+      }
+      return cond;
+    };
+    auto in_group = [&](const std::string& row) {
+      std::string cond = "1";
+      for (const auto& col : spec.group) {
+	cond += " AND \"" + col + "\" IS (" + value(row,col) + ")";
+      }
+      return cond;
+    };
+    auto apply = [&](const std::string& row, const char* sign) {
+      std::string set = "\"rows\" = \"rows\" " + std::string(sign) + " 1";
+      for (const auto& col : spec.aggregates) {
+	auto val = "(" + value(row,col) + ")";
+	auto sum = "\"sum_" + col + "\" " + sign + " coalesce(" + val + ",0)";
+	auto count = "\"count_" + col + "\" " + sign + " (" + val + " IS NOT NULL)";
+	set += ", \"sum_" + col + "\" = " + sum + ", \"count_" + col + "\" = " + count +
+	  ", \"avg_" + col + "\" = CASE WHEN " + count + " > 0 THEN CAST(" + sum + " AS REAL) / (" + count + ") END";
+      }
+      return "UPDATE " + table + " SET " + set + " WHERE " + passes(row) + " AND " + in_group(row) + ";";
+    };
+    std::string new_group,zeros;
+    for (const auto& col : spec.group) {
+      new_group += "(" + value("new",col) + "), ";
+    }
+    for (size_t ind = 0; ind < spec.aggregates.size(); ++ind) {
+      zeros += ", 0, 0, NULL";
+    }
+    auto add_new = "INSERT INTO " + table + " (" + insert_cols + ") SELECT " + new_group + "0" + zeros + " WHERE " +
+      passes("new") + " AND NOT EXISTS (SELECT 1 FROM " + table + " WHERE " + in_group("new") + "); " + apply("new","+");
+    auto remove_old = apply("old","-") + " DELETE FROM " + table + " WHERE \"rows\" = 0 AND " + in_group("old") + ";";
+
+    //Updates only matter to the rollup through the columns it reads
+    std::set<std::string> used(spec.group.begin(),spec.group.end());
+    used.insert(spec.aggregates.begin(),spec.aggregates.end());
+    for (const auto& cond : spec.where) {
+      used.insert(cond.first);
+    }
+    std::string update_of;
+    for (const auto& col : used) {
+      update_of += ",\"" + col + "\"";
+    }
+    auto on = " ON \"" + spec.source + "\" BEGIN ";
+    queries.push_back("CREATE TRIGGER " + schema + ".\"" + RollupTriggerName(spec.name,"ai") + "\" AFTER INSERT" +
+		      on + add_new + " END;");
+    queries.push_back("CREATE TRIGGER " + schema + ".\"" + RollupTriggerName(spec.name,"ad") + "\" AFTER DELETE" +
+		      on + remove_old + " END;");
+    queries.push_back("CREATE TRIGGER " + schema + ".\"" + RollupTriggerName(spec.name,"au") + "\" AFTER UPDATE" +
+		      (update_of.empty()?"":" OF " + update_of.substr(1)) + on + remove_old + " " + add_new + " END;");
+    return queries;
+  }
+
+  std::vector<Substring> SplitIntoViews(const std::string& str,char separator) {
+    if (str.empty()) {
+      return {};
+    }
+    auto it = str.find(separator,0);
+    if (it == std::string::npos) {
+      return {{0,static_cast<uint32_t>(str.length())}};
+    }
+    std::vector<Substring> result;
+    result.push_back({0,static_cast<uint32_t>(it)});
+    while (it < str.length()-1) {
+      Substring tmp;
+      tmp.offset = it + 1;
+      it = str.find(separator,it + 1);
+      if (it == std::string::npos) {
+	it = str.length();
+      }
+      tmp.length = it - tmp.offset;
+      result.push_back(tmp);
+    }
+    return result;
+  }
+
+  bool SetStorageOption(StorageProfile& profile, const std::string& key, const std::string& value) {
+    std::string upper(value);
+    std::transform(upper.begin(),upper.end(),upper.begin(),[](unsigned char c) { return std::toupper(c); });
+    auto one_of = [&upper](std::initializer_list<const char*> allowed) {
+      return std::find_if(allowed.begin(),allowed.end(),[&upper](const char* a) { return upper == a; }) != allowed.end();
+    };
+    auto as_int = [&value](int64_t& out) {
+      auto res = std::from_chars(value.data(),value.data() + value.length(),out);
+      return res.ec == std::errc() && res.ptr == value.data() + value.length();
+    };
+    int64_t num = 0;
+    if (key == "journal_mode" && one_of({"DELETE","TRUNCATE","PERSIST","MEMORY","WAL","OFF"})) {
+      profile.journal_mode = upper;
+    }
+    else if (key == "synchronous" && one_of({"OFF","NORMAL","FULL","EXTRA"})) {
+      profile.synchronous = upper;
+    }
+    else if (key == "temp_store" && one_of({"DEFAULT","FILE","MEMORY"})) {
+      profile.temp_store = upper;
+    }
+    else if (key == "page_size" && as_int(num) && num >= 512 && num <= 65536 && (num & (num - 1)) == 0) {
+      profile.page_size = static_cast<int>(num);
+    }
+    else if (key == "cache_size" && as_int(num)) {
+      profile.cache_size = num;
+    }
+    else if (key == "mmap_size" && as_int(num) && num >= 0) {
+      profile.mmap_size = num;
+    }
+    else if (key == "bulk_load" && one_of({"0","1","OFF","ON","FALSE","TRUE"})) {
+      profile.bulk_load = one_of({"1","ON","TRUE"});
+    }
+    else if (key == "shards" && as_int(num) && num >= 0 && num <= 64) {
+      profile.shards = static_cast<int>(num);
+    }
+    else {
+      return false;
+    }
+    return true;
+  }
+
+  std::optional<StorageProfile> ParseStorageProfile(const std::string& config, StorageProfile profile) {
+    auto trim = [](std::string_view str) {
+      while (!str.empty() && std::isspace(static_cast<unsigned char>(str.front()))) {
+	str.remove_prefix(1);
+      }
+      while (!str.empty() && std::isspace(static_cast<unsigned char>(str.back()))) {
+	str.remove_suffix(1);
+      }
+      return str;
+    };
+    std::string_view text(config);
+    while (!text.empty()) {
+      auto eol = text.find('\n');
+      auto line = text.substr(0,eol);
+      text.remove_prefix((eol == std::string_view::npos)?text.length():eol + 1);
+      line = trim(line.substr(0,line.find('#')));
+      if (line.empty()) {
+	continue;
+      }
+      auto eq = line.find('=');
+      if (eq == std::string_view::npos ||
+	  !SetStorageOption(profile,std::string(trim(line.substr(0,eq))),std::string(trim(line.substr(eq + 1))))) {
+	std::cerr << "Bad storage option: " << line << "\n";
+	return std::optional<StorageProfile>();
+      }
+    }
+    return profile;
+  }
+
+  std::vector<std::string> BuildStoragePragmas(const StorageProfile& profile, const std::string& schema) {
+    std::vector<std::string> pragmas {
+      "PRAGMA " + schema + ".page_size = " + std::to_string(profile.page_size) + ";",
+      "PRAGMA " + schema + ".journal_mode = " + profile.journal_mode + ";",
+      "PRAGMA " + schema + ".synchronous = " + profile.synchronous + ";",
+      "PRAGMA " + schema + ".cache_size = " + std::to_string(profile.cache_size) + ";",
+      "PRAGMA " + schema + ".mmap_size = " + std::to_string(profile.mmap_size) + ";"
+    };
+    if (schema == "main") {
+      pragmas.push_back("PRAGMA temp_store = " + profile.temp_store + ";");
+    }
+    return pragmas;
+  }
+
+  IngestScheduler::IngestScheduler(size_t workers) {
+    for (size_t ind = 0; ind < std::max<size_t>(workers,1); ++ind) {
+      workers_.emplace_back([this]() {
+	while (true) {
+	  std::function<void()> task;
+	  {
+	    std::unique_lock<std::mutex> lock(mutex_);
+	    ready_.wait(lock,[this]() { return stopping_ || !queue_.empty(); });
+	    if (queue_.empty()) {
+	      return;
+	    }
+	    task = std::move(queue_.front());
+	    queue_.pop_front();
+	  }
+	  task();
+	}
+      });
+    }
+  }
+
+  IngestScheduler::~IngestScheduler() {
+    Shutdown();
+  }
+
+  void IngestScheduler::Submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(task));
+    }
+    ready_.notify_one();
+  }
+
+  void IngestScheduler::Shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    ready_.notify_all();
+    for (auto& worker : workers_) {
+      if (worker.joinable()) {
+	worker.join();
+      }
+    }
+  }
+
+  DbReaderPool::DbReaderPool(std::vector<sqlite3*> connections) {
+    for (auto db : connections) {
+      workers_.emplace_back([this,db]() {
+	while (true) {
+	  std::function<void(sqlite3*)> task;
+	  {
+	    std::unique_lock<std::mutex> lock(mutex_);
+	    ready_.wait(lock,[this]() { return stopping_ || !queue_.empty(); });
+	    if (queue_.empty()) {
+	      break;
+	    }
+	    task = std::move(queue_.front());
+	    queue_.pop_front();
+	  }
+	  task(db);
+	}
+	sqlite3_close(db);
+      });
+    }
+  }
+
+  DbReaderPool::~DbReaderPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    ready_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  JSONData PackIngestJob(uint64_t id, const IngestJob& job) {
+    JSONData status;
+    status["job"] = std::to_string(id);
+    status["table"] = job.table;
+    status["state"] = job.state;
+    status["message"] = job.message;
+    if (job.status != 0) {
+      status["status"] = std::to_string(job.status);
+    }
+    status["rows_loaded"] = std::to_string(job.rows_loaded);
+    status["rows_rejected"] = std::to_string(job.rows_rejected);
+    status["rows_total"] = std::to_string(job.rows_total);
+    status["indexes_built"] = std::to_string(job.indexes_built);
+    status["indexes_total"] = std::to_string(job.indexes_total);
+    return status;
+  }
+
+  std::string ShardSchemaName(size_t shard) {
+    return "shard" + std::to_string(shard);
+  }
+
+  size_t ShardForTable(const std::string& table_name, size_t shard_count) {
+    return static_cast<size_t>(HashKey(table_name) % std::max<size_t>(shard_count,1));
+  }
+
+  uint64_t HashKey(std::string_view key) {
+    uint64_t hash = 14695981039346656037ull;
+    for (auto c : key) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  namespace {
+    //FNV-1a leaves the low bits poorly mixed, the probe start is taken from these instead
+    uint64_t MixHash(uint64_t hash) {
+      hash ^= hash >> 33;
+      hash *= 0xff51afd7ed558ccdull;
+      hash ^= hash >> 33;
+      return hash;
+    }
+
+    uint64_t SlotHash(std::string_view key) {
+      auto hash = HashKey(key);
+      return hash?hash:1;
+    }
+  }
+
+  HashIndex::HashIndex(size_t expected) {
+    size_t capacity = 16;
+    while (capacity < 2 * expected) {
+      capacity *= 2;
+    }
+    slots_.resize(capacity);
+  }
+
+  void HashIndex::Place(const Slot& slot) {
+    size_t mask = slots_.size() - 1;
+    for (size_t pos = MixHash(slot.hash) & mask;; pos = (pos + 1) & mask) {
+      if (slots_[pos].hash == 0) {
+	slots_[pos] = slot;
+	return;
+      }
+    }
+  }
+
+  void HashIndex::Insert(std::string_view key, int64_t rowid) {
+    if (2 * (size_ + 1) > slots_.size()) {
+      std::vector<Slot> old(slots_.size() * 2);
+      old.swap(slots_);
+      for (const auto& slot : old) {
+	if (slot.hash) {
+	  Place(slot);
+	}
+      }
+    }
+    Place({SlotHash(key),rowid});
+    ++size_;
+  }
+
+  void HashIndex::Lookup(std::string_view key, std::vector<int64_t>& rowids) const {
+    auto hash = SlotHash(key);
+    size_t mask = slots_.size() - 1;
+    for (size_t pos = MixHash(hash) & mask; slots_[pos].hash; pos = (pos + 1) & mask) {
+      if (slots_[pos].hash == hash) {
+	rowids.push_back(slots_[pos].rowid);
+      }
+    }
+  }
+
+  //Lowering the shard count must not cut off the tables of the shards left out, they stay attached
+  //for reads and writes but get no new tables
+  void CSVApp::DbAttachHeldShards(const std::string& db_file) {
+    std::vector<std::string> held;
+    {
+      Statement query(db_handle_,"SELECT DISTINCT internal_name FROM main.Files;","DbAttachHeldShards");
+      while (query.Step()) {
+	held.push_back(ColumnToString(query.get(),0));
+      }
+    }
+    for (const auto& schema : held) {
+      bool is_shard = schema.size() > 5 && schema.compare(0,5,"shard") == 0 &&
+	std::all_of(schema.begin() + 5,schema.end(),[](char chr) { return std::isdigit(static_cast<unsigned char>(chr)); });
+      if (!is_shard || std::find(attached_schemas_.begin(),attached_schemas_.end(),schema) != attached_schemas_.end()) {
+	continue;
+      }
+      auto shard_file = db_file + "." + schema;
+      if (!std::filesystem::exists(shard_file) ||
+	  !TryExecSimpleQuery("ATTACH DATABASE '" + shard_file + "' AS " + schema + ";")) {
+	std::cerr << "Tables recorded in " << schema << " are unavailable, " << shard_file << " can't be attached\n";
+	continue;
+      }
+      for (const auto& pragma : BuildStoragePragmas(profile_,schema)) {
+	DbApplyPragma(pragma);
+      }
+      std::cerr << "Attached " << schema << " beyond the configured shards, it still holds tables\n";
+      attached_schemas_.push_back(schema);
+    }
+  }
+
+  void CSVApp::DbDropPublishLeftovers(const std::string& db_file) {
+    std::vector<std::string> schemas {"main"};
+    schemas.insert(schemas.end(),attached_schemas_.begin(),attached_schemas_.end());
+    for (const auto& schema : schemas) {
+      //One at a time and search indexes first, their shadow tables go along with them
+      for (bool dropped = true; dropped; ) {
+	std::string table;
+	{
+	  Statement query(db_handle_,"SELECT name FROM " + schema + ".sqlite_master WHERE type = 'table' "
+			  "AND name GLOB '*__publish[0-9]*' ORDER BY sql LIKE 'CREATE VIRTUAL%' DESC LIMIT 1;",
+			  "DbDropPublishLeftovers");
+	  if (query.Step()) {
+	    table = ColumnToString(query.get(),0);
+	  }
+	}
+	dropped = !table.empty() && TryExecSimpleQuery("DROP TABLE " + schema + ".\"" + table + "\";");
+	if (dropped) {
+	  std::cerr << "Dropped unpublished " << schema << "." << table << "\n";
+	}
+      }
+    }
+    auto db_path = std::filesystem::path(db_file);
+    auto prefix = db_path.filename().string() + ".staging";
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(db_path.parent_path().empty()?".":db_path.parent_path(),error)) {
+      auto file = entry.path().filename().string();
+      if (file.size() > prefix.size() && file.compare(0,prefix.size(),prefix) == 0 &&
+	  std::all_of(file.begin() + prefix.size(),file.end(),[](char chr) { return std::isdigit(static_cast<unsigned char>(chr)); })) {
+	std::filesystem::remove(entry.path(),error);
+	std::cerr << "Removed staging file " << file << "\n";
+      }
+    }
+  }
+
+  // Serves primarily testing purposes, same as in-memory interface
+  // In production you just run the db setup script before any actual usage
+  void CSVApp::DbSetup() {
+    TryExecSimpleQuery(kUsersTable);
+    TryExecSimpleQuery(kTablesTable);
+    TryExecSimpleQuery(kAdminSetup);
+  }
+
+
+  CSVApp::CSVApp(const std::string& db_file, bool in_memory, StorageProfile profile, AdmissionConfig admission) :
+    svr_(), epoch_((uint64_t(std::random_device{}()) << 32) ^ std::random_device{}() ^
+		   std::chrono::system_clock::now().time_since_epoch().count()),
+    view_cache_(kViewCacheShards,kViewCacheBytes), profile_(std::move(profile)), admission_(admission),
+    ip_limiter_(admission.ip_rate,admission.ip_burst),
+    ingest_(kIngestWorkers) {
+    int flag;
+    if (in_memory) {
+      flag = SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY;
+    }
+    else if (std::filesystem::exists(db_file)) {
+      flag = SQLITE_OPEN_READWRITE;
+    }
+    else {
+      flag = SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE;
+    }
+    if (sqlite3_open_v2(db_file.c_str(),&db_handle_,flag,nullptr) != SQLITE_OK) {
+      std::cerr << "In sqlite3_open\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    //Uploads build their indexes on connections of their own and hold the file's write lock meanwhile,
+    //writers fail fast instead of stalling everyone queued on the write mutex
+    sqlite3_busy_timeout(db_handle_,kWriteBusyMs);
+
+    for (const auto& pragma : BuildStoragePragmas(profile_)) {
+      std::cerr << pragma << " -> " << DbApplyPragma(pragma) << "\n";
+    }
+
+    for (int ind = 0; ind < profile_.shards; ++ind) {
+      auto schema = ShardSchemaName(ind);
+      auto shard_file = in_memory?std::string(":memory:"):(db_file + "." + schema);
+      auto attach_str = "ATTACH DATABASE '" + shard_file + "' AS " + schema + ";";
+      TryExecSimpleQuery(attach_str);
+      for (const auto& pragma : BuildStoragePragmas(profile_,schema)) {
+	DbApplyPragma(pragma);
+      }
+      shard_schemas_.push_back(schema);
+    }
+    attached_schemas_ = shard_schemas_;
+
+    if ((flag & SQLITE_OPEN_CREATE) != 0) {
+      DbSetup();
+    }
+    if (!in_memory) {
+      DbAttachHeldShards(db_file);
+      DbDropPublishLeftovers(db_file);
+    }
+    //Dbs from before rollups and statistics don't have these catalogs yet
+    TryExecSimpleQuery(kRollupsTable);
+    TryExecSimpleQuery(kColumnStatsTable);
+    DbLoadRollups();
+    if (!in_memory) {
+      DbOpenReaders(db_file);
+    }
+
+    //Connect handlers
+    svr_.Get("/tables",[this](const httplib::Request& req,httplib::Response& res) {
+      res.body = PackJSON(this->DbQueryList());
+      res.status = 200;
+    });
+    svr_.Get("/view",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleTableQuery(req,res);
+    });
+    svr_.Post("/upload",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleUpload(req,res);
+    });
+    svr_.Get("/delete",[this](const httplib::Request& req,httplib::Response& res) {
+      //Authorize
+      //Verify
+      //Respond
+    });
+    svr_.Post("/update",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleTableUpdate(req,res);
+    });
+    svr_.Post("/batch",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleBatch(req,res);
+    });
+    svr_.Get("/search",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleSearch(req,res);
+    });
+    svr_.Get("/upload_status",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleUploadStatus(req,res);
+    });
+    svr_.Get("/get",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleGet(req,res);
+    });
+    svr_.Post("/get",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleGet(req,res);
+    });
+    svr_.Get("/metrics",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleMetrics(req,res);
+    });
+    svr_.Get("/aggregate",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleAggregate(req,res);
+    });
+    svr_.Post("/rollup",[this](const httplib::Request& req,httplib::Response& res) {
+      this->HandleRollup(req,res);
+    });
+    svr_.set_pre_routing_handler([this](const httplib::Request& req,httplib::Response& res) {
+      return this->AdmitClient(req,res);
+    });
+    //Same worker count as httplib's own pool
+    svr_.new_task_queue = [this]() {
+      auto executor = new PriorityExecutor(CPPHTTPLIB_THREAD_POOL_COUNT,DefaultClassLimits(CPPHTTPLIB_THREAD_POOL_COUNT),admission_);
+      executor_ = executor;
+      return executor;
+    };
+  }
+
+  CSVApp::~CSVApp() {
+    ingest_.Shutdown();
+    readers_.reset();
+    sqlite3_close(db_handle_);
+  }
+
+
+  Role CSVApp::DbCheckUser(const std::string& username) {
+    Statement query(db_handle_,kCheckUser,"DbCheckUser");
+    return query.Bind(1,username).Step()?static_cast<Role>(sqlite3_column_int(query.get(),0)):Role::None;
+  }
+
+  
+  int CSVApp::DbRegUser(const std::string& username) {
+    sqlite3_stmt *query;
+    int id = -1;
+    if(sqlite3_prepare_v2(db_handle_,
+			  kUserReg.c_str(),
+			  kUserReg.length()+1,
+			  &query,
+			  nullptr) != SQLITE_OK) {
+      std::cerr << sqlite3_errmsg(db_handle_);
+    }
+    if(sqlite3_bind_text(query,
+			 1,
+			 username.c_str(),
+			 username.length()+1,
+			 SQLITE_STATIC) != SQLITE_OK) {
+      std::cerr << sqlite3_errmsg(db_handle_);
+    }
+    if(sqlite3_step(query) != SQLITE_ROW) {
+      std::cerr << sqlite3_errmsg(db_handle_);
+    }
+    else {
+      id = sqlite3_column_int(query,0);
+    }
+    if(sqlite3_finalize(query) != SQLITE_OK) {
+      std::cerr << sqlite3_errmsg(db_handle_);
+    }
+    return id;
+  }
+
+  //Randomized test for being a proper CSV, namely that separator count on each line matches up
+  //TODO: Check proper indexing
+  bool SampleForCSV(const std::string& csv_content, char separator,size_t samples) {
+    auto lines = SplitIntoViews(csv_content);
+    //Check directly for small csvs
+    if (lines.size() <= 1) {
+      return true;
+    }
+    auto fst_line = csv_content.substr(lines[0].offset,lines[0].length);
+    if (lines.size() == 2) {
+      auto lst_line = csv_content.substr(lines[1].offset,lines[1].length);
+      return std::count(fst_line.begin(),fst_line.end(),separator) ==
+	     std::count(lst_line.begin(),lst_line.end(),separator);
+    }
+
+    std::random_device rd;
+    std::mt19937 gen32(rd());
+    std::uniform_int_distribution<> dist(1,lines.size() - 1);
+
+    
+    size_t base_cols = std::count(fst_line.begin(),fst_line.end(),separator);
+    for (size_t ind = 0;ind < samples; ++ind) {
+      auto line_num = dist(gen32);
+      auto test_line = csv_content.substr(lines[line_num].offset,lines[line_num].length);
+      size_t test_cols =  std::count(test_line.begin(),test_line.end(),separator);
+      if (base_cols != test_cols) {
+	return false;
+      }
+    }
+    
+    return true;
+  }
+  
+  //Returns SQL types as enum members
+  //I question whether i truly need to go so far
+  //Ahaha, of course I do, i am not going to use lexigraphic sort on floats
+  std::vector<Types> DetectTypes(const std::string& csrow, char separator) {
+    auto cols = SplitIntoViews(csrow,separator);
+    std::vector<Types> result;
+    for (const auto& col : cols) {
+      auto str = csrow.substr(col.offset,col.length);
+      auto dot_cnt = 0;
+      for (size_t ind = 0;ind < str.length() ; ++ind) {
+	if (str[ind] == '-' && ind == 0) {
+	  continue;
+	} 
+	if (str[ind] == '.') {
+	  ++dot_cnt;
+	}
+	else if (std::isdigit(str[ind])) {
+	  continue;
+	}
+	else {
+	  dot_cnt = 10;
+	  break;
+	}
+      }
+      if (dot_cnt > 1) {
+	result.push_back(Types::String);
+      }
+      else if (dot_cnt == 1) {
+	result.push_back(Types::Float);
+      }
+      else {
+	result.push_back(Types::Int);
+      }
+    }
+    return result;
+  }
+
+  std::optional<std::vector<ColumnSpec>> ParseUploadSchema(std::string_view serialized) {
+    auto doc = ParseJSON(serialized);
+    if (!doc || (*doc)[0].kind != JSONValue::Array || (*doc)[0].size == 0) {
+      return std::optional<std::vector<ColumnSpec>>();
+    }
+    std::vector<ColumnSpec> columns;
+    bool has_key = false;
+    for (uint32_t ind = doc->FirstChild(0); ind < (*doc)[0].end; ind = doc->Next(ind)) {
+      if ((*doc)[ind].kind != JSONValue::Object) {
+	return std::optional<std::vector<ColumnSpec>>();
+      }
+      auto name = doc->Find(ind,"name");
+      if (!name || (*doc)[*name].kind != JSONValue::String || (*doc)[*name].text.empty()) {
+	return std::optional<std::vector<ColumnSpec>>();
+      }
+      ColumnSpec spec;
+      spec.name = std::string((*doc)[*name].text);
+      if (auto type = doc->Find(ind,"type")) {
+	auto type_str = (*doc)[*type].text;
+	if ((*doc)[*type].kind != JSONValue::String) {
+	  return std::optional<std::vector<ColumnSpec>>();
+	}
+	if (type_str == "int" || type_str == "integer") {
+	  spec.type = Types::Int;
+	}
+	else if (type_str == "float" || type_str == "real") {
+	  spec.type = Types::Float;
+	}
+	else if (type_str != "text") {
+	  return std::optional<std::vector<ColumnSpec>>();
+	}
+      }
+      auto flag = [&](std::string_view key) {
+	auto val = doc->Find(ind,key);
+	return val && (*doc)[*val].kind == JSONValue::Bool && (*doc)[*val].int_val;
+      };
+      spec.key = flag("key");
+      spec.not_null = flag("not_null");
+      spec.index = flag("index");
+      if (spec.key && (has_key || spec.type != Types::Int)) {
+	return std::optional<std::vector<ColumnSpec>>();
+      }
+      has_key = has_key || spec.key;
+      if (std::find_if(columns.begin(),columns.end(),[&](const auto& c) { return c.name == spec.name; }) != columns.end()) {
+	return std::optional<std::vector<ColumnSpec>>();
+      }
+      columns.push_back(std::move(spec));
+    }
+    return std::optional<std::vector<ColumnSpec>>(std::move(columns));
+  }
+
+  namespace {
+    bool ExecSimpleQuery(sqlite3* db, const std::string& query) {
+      std::cerr << "Query:" << query << "\n";
+      sqlite3_stmt* stmt_handle;
+      if(sqlite3_prepare_v2(db,
+			    query.c_str(),
+			    query.length() + 1,
+			    &stmt_handle,
+			    nullptr) != SQLITE_OK) {
+	std::cerr << "In TryExecSimpleQuery::prepare\n";
+	std::cerr << sqlite3_errmsg(db);
+	std::cerr << "\n";
+	return false;
+      }
+      bool done = (sqlite3_step(stmt_handle) == SQLITE_DONE);
+      if(!done) {
+	std::cerr << "In TryExecSimpleQuery::step\n";
+	std::cerr << sqlite3_errmsg(db);
+	std::cerr << "\n";
+      }
+      if(sqlite3_finalize(stmt_handle) != SQLITE_OK) {
+	std::cerr << "In TryExecSimpleQuery:finalize";
+	std::cerr << sqlite3_errmsg(db);
+	std::cerr << "\n";
+      }
+      return done;
+    }
+
+    std::string ApplyPragma(sqlite3* db, const std::string& pragma) {
+      std::string result;
+      sqlite3_stmt* stmt_handle;
+      if (sqlite3_prepare_v2(db,
+			     pragma.c_str(),
+			     pragma.length() + 1,
+			     &stmt_handle,
+			     nullptr) != SQLITE_OK) {
+        std::cerr << "In ApplyPragma::prepare\n";
+        std::cerr << sqlite3_errmsg(db);
+        std::cerr << "\n";
+        return result;
+      }
+      int rc;
+      while ((rc = sqlite3_step(stmt_handle)) == SQLITE_ROW) {
+        if (result.empty() && sqlite3_column_text(stmt_handle,0)) {
+	  result = reinterpret_cast<const char*>(sqlite3_column_text(stmt_handle,0));
+        }
+      }
+      if (rc != SQLITE_DONE) {
+        std::cerr << "In ApplyPragma::step\n";
+        std::cerr << sqlite3_errmsg(db);
+        std::cerr << "\n";
+      }
+      sqlite3_finalize(stmt_handle);
+      return result;
+    }
+  }
+
+  std::string CSVApp::DbApplyPragma(const std::string& pragma) {
+    return ApplyPragma(db_handle_,pragma);
+  }
+
+  void CSVApp::DbOpenReaders(const std::string& db_file) {
+    std::vector<sqlite3*> connections;
+    for (size_t ind = 0; ind < kDbReaders; ++ind) {
+      sqlite3* db = nullptr;
+      if (sqlite3_open_v2(db_file.c_str(),&db,SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,nullptr) != SQLITE_OK) {
+	std::cerr << "In DbOpenReaders::open\n";
+	std::cerr << sqlite3_errmsg(db);
+	std::cerr << "\n";
+	sqlite3_close(db);
+	break;
+      }
+      sqlite3_busy_timeout(db,kPublishBusyMs);
+      //Only the per connection settings, the rest belongs to the files and the write connection
+      ApplyPragma(db,"PRAGMA temp_store = " + profile_.temp_store + ";");
+      std::vector<std::string> schemas {"main"};
+      schemas.insert(schemas.end(),attached_schemas_.begin(),attached_schemas_.end());
+      bool attached = true;
+      for (const auto& schema : schemas) {
+	if (schema != "main") {
+	  attached = attached && ExecSimpleQuery(db,"ATTACH DATABASE '" + db_file + "." + schema + "' AS " + schema + ";");
+	}
+	ApplyPragma(db,"PRAGMA " + schema + ".cache_size = " + std::to_string(profile_.cache_size) + ";");
+	ApplyPragma(db,"PRAGMA " + schema + ".mmap_size = " + std::to_string(profile_.mmap_size) + ";");
+      }
+      if (!attached) {
+	sqlite3_close(db);
+	break;
+      }
+      connections.push_back(db);
+    }
+    //Reads see every table or they don't go through the pool at all
+    if (connections.size() < kDbReaders) {
+      for (auto db : connections) {
+	sqlite3_close(db);
+      }
+      return;
+    }
+    readers_ = std::make_unique<DbReaderPool>(std::move(connections));
+  }
+
+  bool CSVApp::TryExecSimpleQuery(const std::string& query) {
+    return ExecSimpleQuery(db_handle_,query);
+  }
+
+  
+  //Rows are loaded into a private staging file on a connection of their own, so uploads of different
+  //tables run side by side. Only the publish step takes the write lock, and it copies everything into
+  //the final schema in one transaction, readers see either no table or the whole of it
+  bool CSVApp::DbUpload(const std::string& name,
+			const std::string& content,
+			char separator,
+			SearchMode search_mode,
+			bool replace,
+			const std::vector<ColumnSpec>& declared,
+			uint64_t job) {
+    if (job == 0) {
+      job = NewJob(name);
+    }
+    if (!replace && DbCachedColList(name)) {
+      FailJob(job,409,"Table already exists");
+      return false;
+    }
+    //We assume it is a proper CSV, beauty of private implementation
+    //Furthermore we assume user permissions are intact
+    auto lines = SplitIntoViews(content);
+    if (lines.empty()) {
+      FailJob(job,400,"Empty CSV");
+      return false;
+    }
+    std::string_view text(content);
+    auto line_at = [&](size_t ind) {
+      return content.substr(lines[ind].offset,lines[ind].length);
+    };
+    auto header = line_at(0);
+    std::vector<Types> types;
+    std::vector<std::string> col_names;
+    std::vector<std::string_view> fields;
+    bool has_signature;
+    if (!declared.empty()) {
+      //Nothing to infer, the first line is only a header if it repeats the declared names
+      SplitFields(text.substr(lines[0].offset,lines[0].length),separator,fields);
+      has_signature = (fields.size() == declared.size());
+      for (size_t ind = 0; ind < declared.size(); ++ind) {
+	has_signature = has_signature && UnquoteField(fields[ind]) == declared[ind].name;
+	types.push_back(declared[ind].type);
+	col_names.push_back(declared[ind].name);
+      }
+    }
+    else {
+      types = DetectTypes(header,separator);
+      has_signature =
+	(std::find_if(types.begin(),types.end(),[](auto t){
+	  return t != Types::String;
+	}) == types.end());
+      if (has_signature) {
+	SplitFields(text.substr(lines[0].offset,lines[0].length),separator,fields);
+	for (const auto& field : fields) {
+	  col_names.emplace_back(UnquoteField(field));
+	}
+	if (lines.size() > 1) {
+	  types = DetectTypes(line_at(1),separator);
+	}
+      }
+      else {
+	for (size_t ind = 0 ; ind < types.size() ; ++ind) {
+	  col_names.push_back(std::to_string(ind + 1));
+	}
+      }
+    }
+    bool create_only = has_signature && lines.size() == 1;
+    size_t first_line = has_signature?1:0;
+
+    auto dicts = create_only?std::vector<std::vector<std::string_view>>(col_names.size()):
+      DetectDictionaries(content,lines,first_line,types,separator);
+    dicts.resize(col_names.size());
+    std::vector<bool> coded(col_names.size());
+    PooledString col_descr;
+    std::vector<std::string> text_cols;
+    for (size_t ind = 0; ind < col_names.size(); ++ind) {
+      coded[ind] = !dicts[ind].empty();
+      *col_descr += (ind?", \"":"\"");
+      *col_descr += col_names[ind];
+      *col_descr += "\" ";
+      if (coded[ind]) {
+	*col_descr += kDictColumnType;
+      }
+      else if (ind < declared.size() && declared[ind].key) {
+	//Exactly this spelling makes it an alias of the rowid
+	*col_descr += "INTEGER PRIMARY KEY";
+      }
+      else {
+	switch ((ind >= types.size())?Types::String:types[ind]) {
+	case Types::String:
+	  *col_descr += kTextColumnType;
+	  text_cols.push_back(col_names[ind]);
+	  break;
+	case Types::Float:
+	  *col_descr += "float";
+	  break;
+	case Types::Int:
+	  *col_descr += "int";
+	  break;
+	}
+      }
+      if (ind < declared.size() && declared[ind].not_null) {
+	*col_descr += " NOT NULL";
+      }
+    }
+
+    auto col_str = *col_descr;
+    std::string schema = shard_schemas_.empty()?"main":shard_schemas_[ShardForTable(name,shard_schemas_.size())];
+    std::vector<std::string> dict_tables;
+    for (size_t col = 0; col < col_names.size(); ++col) {
+      if (coded[col]) {
+	dict_tables.push_back(DictionaryTableName(name,col_names[col]));
+      }
+    }
+
+    //Stage: nothing here is shared, a crash just leaves a file to throw away
+    SetJobState(job,"loading");
+    auto stage_file = StagingFileName(job);
+    std::filesystem::remove(stage_file);
+    sqlite3 *stage = nullptr;
+    if (sqlite3_open_v2(stage_file.c_str(),&stage,
+			SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,nullptr) != SQLITE_OK) {
+      std::cerr << "In DbUpload::open staging\n";
+      std::cerr << sqlite3_errmsg(stage);
+      std::cerr << "\n";
+      sqlite3_close(stage);
+      FailJob(job,500,"Can't open staging db");
+      return false;
+    }
+    ApplyPragma(stage,"PRAGMA journal_mode = OFF;");
+    ApplyPragma(stage,"PRAGMA synchronous = OFF;");
+    //Rows breaking a declared constraint are skipped, any other failure leaves nothing worth publishing
+    bool staged = ExecSimpleQuery(stage,"CREATE TABLE main.\"" + name + "\" (" + col_str + ");");
+    size_t wide_line = 0;
+
+    //Column statistics are gathered on the way, no second pass over the rows
+    std::vector<ColumnProfile> profiles;
+    for (size_t col = 0; col < col_names.size(); ++col) {
+      bool numeric = !coded[col] && ((col < declared.size() && declared[col].key) ||
+				     (col < types.size() && types[col] != Types::String));
+      profiles.emplace_back(col_names[col],numeric);
+    }
+
+    //The chad version at last: one transaction, one prepared insert, every field bound
+    //Codes are looked up here, the encoding triggers only come with publishing
+    if (staged && !create_only) {
+      size_t rejected = 0;
+      SetJobProgress(job,0,0,lines.size() - first_line);
+      staged = ExecSimpleQuery(stage,"BEGIN;");
+      std::vector<std::unordered_map<std::string_view,int64_t>> codes(col_names.size());
+      for (size_t col = 0; staged && col < col_names.size(); ++col) {
+	if (!coded[col]) {
+	  continue;
+	}
+	sqlite3_stmt *dict_insert;
+	auto dict_str = "INSERT INTO main.\"" + DictionaryTableName(name,col_names[col]) + "\" (code, value) VALUES (?,?);";
+	if (!ExecSimpleQuery(stage,BuildDictionaryQueries(name,col_names[col])[0]) ||
+	    sqlite3_prepare_v2(stage,dict_str.c_str(),dict_str.length() + 1,&dict_insert,nullptr) != SQLITE_OK) {
+	  std::cerr << "In DbUpload::prepare dictionary\n";
+	  std::cerr << sqlite3_errmsg(stage);
+	  std::cerr << "\n";
+	  staged = false;
+	  break;
+	}
+	for (size_t code = 0; staged && code < dicts[col].size(); ++code) {
+	  codes[col][dicts[col][code]] = code + 1;
+	  sqlite3_bind_int64(dict_insert,1,code + 1);
+	  sqlite3_bind_text(dict_insert,2,dicts[col][code].data(),dicts[col][code].length(),SQLITE_STATIC);
+	  if (sqlite3_step(dict_insert) != SQLITE_DONE) {
+	    std::cerr << "In DbUpload::step dictionary\n";
+	    std::cerr << sqlite3_errmsg(stage);
+	    std::cerr << "\n";
+	    staged = false;
+	  }
+	  sqlite3_reset(dict_insert);
+	}
+	sqlite3_finalize(dict_insert);
+      }
+
+      std::string insert_str = "INSERT INTO main.\"" + name + "\" VALUES (";
+      for (size_t col = 0; col < col_names.size(); ++col) {
+	insert_str += col?",?":"?";
+      }
+      insert_str += ");";
+      sqlite3_stmt *insert = nullptr;
+      if (staged && sqlite3_prepare_v2(stage,insert_str.c_str(),insert_str.length() + 1,&insert,nullptr) != SQLITE_OK) {
+	std::cerr << "In DbUpload::prepare\n";
+	std::cerr << sqlite3_errmsg(stage);
+	std::cerr << "\n";
+	staged = false;
+      }
+      if (staged) {
+	for (size_t ind = first_line; staged && ind < lines.size() ; ++ind) {
+	  SplitFields(text.substr(lines[ind].offset,lines[ind].length),separator,fields);
+	  //The extra fields would have nowhere to go
+	  if (!declared.empty() && fields.size() > col_names.size()) {
+	    wide_line = ind + 1;
+	    staged = false;
+	    break;
+	  }
+	  for (size_t col = 0; col < col_names.size() && col < fields.size(); ++col) {
+	    auto value = UnquoteField(fields[col]);
+	    if (fields[col].empty()) {
+	      continue;
+	    }
+	    if (coded[col]) {
+	      sqlite3_bind_int64(insert,col + 1,codes[col][value]);
+	    }
+	    else {
+	      //Column affinity turns numeric text into numbers just like the literals used to
+	      sqlite3_bind_text(insert,col + 1,value.data(),value.length(),SQLITE_STATIC);
+	    }
+	  }
+	  auto rc = sqlite3_step(insert);
+	  if (rc != SQLITE_DONE) {
+	    std::cerr << "In DbUpload::step line " << ind << "\n";
+	    std::cerr << sqlite3_errmsg(stage);
+	    std::cerr << "\n";
+	    //A constraint turns the row away, anything else fails the upload
+	    if ((rc & 0xff) == SQLITE_CONSTRAINT) {
+	      ++rejected;
+	    }
+	    else {
+	      staged = false;
+	    }
+	  }
+	  else {
+	    //Only rows that made it in count towards the statistics, and only unbound fields as NULLs
+	    for (size_t col = 0; col < col_names.size(); ++col) {
+	      if (col < fields.size() && !fields[col].empty()) {
+		profiles[col].Add(UnquoteField(fields[col]));
+	      }
+	      else {
+		profiles[col].Add(std::nullopt);
+	      }
+	    }
+	  }
+	  sqlite3_reset(insert);
+	  sqlite3_clear_bindings(insert);
+	  if ((ind - first_line + 1) % kIngestProgressRows == 0) {
+	    SetJobProgress(job,ind - first_line + 1 - rejected,rejected,lines.size() - first_line);
+	  }
+	}
+	sqlite3_finalize(insert);
+      }
+      staged = staged && ExecSimpleQuery(stage,"COMMIT;");
+      SetJobProgress(job,lines.size() - first_line - rejected,rejected,lines.size() - first_line);
+    }
+    if (!staged) {
+      sqlite3_close(stage);
+      std::filesystem::remove(stage_file);
+      if (wide_line != 0) {
+	FailJob(job,400,"Line " + std::to_string(wide_line) + " has more fields than the declared schema");
+      }
+      else {
+	FailJob(job,500,"Staging the rows failed");
+      }
+      return false;
+    }
+    std::vector<ColumnStats> stats;
+    for (auto& profile : profiles) {
+      stats.push_back(profile.Finish());
+    }
+
+    //Publish in two steps. The rows are first copied into hidden tables of the target schema, on the
+    //staging connection when the target is a file so our own writers are not held up meanwhile
+    SetJobState(job,"publishing");
+    auto hidden = [job](const std::string& table) { return table + "__publish" + std::to_string(job); };
+    std::vector<std::pair<std::string,std::string>> copied {{name,col_str}};
+    for (size_t col = 0; col < col_names.size(); ++col) {
+      if (coded[col]) {
+	copied.emplace_back(DictionaryTableName(name,col_names[col]),kDictTableColumns);
+      }
+    }
+    //Same definitions on both sides, so SQLite copies the records over without decoding them
+    auto copy_hidden = [&](sqlite3* db, const std::string& from, const std::string& to) {
+      bool ok = ExecSimpleQuery(db,"BEGIN IMMEDIATE;");
+      for (const auto& table : copied) {
+	ok = ok &&
+	  ExecSimpleQuery(db,"CREATE TABLE " + to + ".\"" + hidden(table.first) + "\" (" + table.second + ");") &&
+	  ExecSimpleQuery(db,"INSERT INTO " + to + ".\"" + hidden(table.first) + "\" SELECT * FROM " +
+			  from + ".\"" + table.first + "\";");
+      }
+      ok = ok && ExecSimpleQuery(db,"COMMIT;");
+      if (!ok) {
+	ExecSimpleQuery(db,"ROLLBACK;");
+      }
+      return ok;
+    };
+    //Secondary indexes are built only once the rows are all in, in one sorted pass each
+    //Every build commits on its own so other writers of the schema get their turn in between
+    std::vector<std::pair<std::string,std::string>> renamed;
+    for (const auto& table : copied) {
+      renamed.emplace_back(hidden(table.first),table.first);
+    }
+    bool searchable = (search_mode != NoSearch && !text_cols.empty());
+    if (searchable) {
+      renamed.emplace_back(SearchIndexName(hidden(name)),SearchIndexName(name));
+    }
+    else if (search_mode != NoSearch) {
+      std::cerr << "No text columns to index in " << name << "\n";
+    }
+    //Column indexes get their final name right away. While a replaced table still holds that name
+    //the build waits for the publishing transaction, after the old table is gone
+    std::vector<std::string> deferred;
+    auto build_indexes = [&](sqlite3* db, const std::string& to) {
+      std::vector<std::vector<std::string>> builds;
+      for (const auto& spec : declared) {
+	if (!spec.index || spec.key) {
+	  continue;
+	}
+	auto index_name = ColumnIndexName(name,spec.name);
+	Statement taken(db,"SELECT 1 FROM " + to + ".sqlite_master WHERE name = ?;","DbUpload");
+	if (taken.Bind(1,index_name).Step()) {
+	  deferred.push_back(spec.name);
+	}
+	else {
+	  builds.push_back({BuildStagedColumnIndexQuery(name,hidden(name),spec.name,to)});
+	}
+      }
+      if (searchable) {
+	builds.push_back(BuildStagedSearchIndexQueries(name,hidden(name),text_cols,search_mode,to));
+      }
+      SetJobState(job,"indexing");
+      SetJobIndexProgress(job,0,builds.size() + deferred.size());
+      for (size_t ind = 0; ind < builds.size(); ++ind) {
+	bool ok = ExecSimpleQuery(db,"BEGIN IMMEDIATE;") &&
+	  std::all_of(builds[ind].begin(),builds[ind].end(),[db](const auto& q) { return ExecSimpleQuery(db,q); }) &&
+	  ExecSimpleQuery(db,"COMMIT;");
+	if (!ok) {
+	  ExecSimpleQuery(db,"ROLLBACK;");
+	  return false;
+	}
+	SetJobIndexProgress(job,ind + 1,builds.size() + deferred.size());
+      }
+      return true;
+    };
+
+    bool published;
+    std::string target_file;
+    if (auto file = sqlite3_db_filename(db_handle_,schema.c_str())) {
+      target_file = file;
+    }
+    if (!target_file.empty()) {
+      sqlite3_busy_timeout(stage,kPublishBusyMs);
+      published = ExecSimpleQuery(stage,"ATTACH DATABASE '" + target_file + "' AS target;");
+      //No fsyncs for the copy and the index builds. The setting is the connection's own, so every other
+      //writer and the publishing transaction keep the configured one
+      if (published && profile_.bulk_load) {
+	ApplyPragma(stage,"PRAGMA target.synchronous = OFF;");
+      }
+      published = published && copy_hidden(stage,"main","target") && build_indexes(stage,"target");
+      sqlite3_close(stage);
+    }
+    else {
+      sqlite3_close(stage);
+      auto stage_schema = "staging" + std::to_string(job);
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      published = ExecSimpleQuery(db_handle_,"ATTACH DATABASE '" + stage_file + "' AS " + stage_schema + ";") &&
+	copy_hidden(db_handle_,stage_schema,schema) && build_indexes(db_handle_,schema);
+      TryExecSimpleQuery("DETACH DATABASE " + stage_schema + ";");
+    }
+    std::filesystem::remove(stage_file);
+
+    //Then one short transaction renames them into place, replacing the old table if asked to
+    std::string failure = "Copying into the target database failed";
+    SetJobState(job,"publishing");
+    {
+      //Other uploads may hold the file's write lock for a while, so the long wait is spent here in
+      //short tries, handing the write mutex to our other writers in between
+      std::unique_lock<std::mutex> lock(write_mutex_);
+      auto give_up = std::chrono::steady_clock::now() + std::chrono::milliseconds(kPublishBusyMs);
+      bool begun = published && TryExecSimpleQuery("BEGIN IMMEDIATE;");
+      while (published && !begun && sqlite3_errcode(db_handle_) == SQLITE_BUSY &&
+	     std::chrono::steady_clock::now() < give_up) {
+	lock.unlock();
+	std::this_thread::yield();
+	lock.lock();
+	begun = TryExecSimpleQuery("BEGIN IMMEDIATE;");
+      }
+      if (published && !begun) {
+	failure = "The target database stayed locked";
+      }
+      published = begun;
+      if (published) {
+	auto tables = DbQueryTableList();
+	if (std::find(tables.begin(),tables.end(),name) != tables.end()) {
+	  if (replace) {
+	    DbInvalidateSchema(name);
+	    DbDropTableObjects(name,DbTableSchema(name));
+	  }
+	  else {
+	    failure = "Table already exists";
+	    published = false;
+	  }
+	}
+      }
+      for (size_t ind = 0; published && ind < renamed.size(); ++ind) {
+	published = TryExecSimpleQuery("ALTER TABLE " + schema + ".\"" + renamed[ind].first +
+				       "\" RENAME TO \"" + renamed[ind].second + "\";");
+      }
+      for (size_t ind = 0; published && ind < deferred.size(); ++ind) {
+	published = TryExecSimpleQuery(BuildColumnIndexQuery(name,deferred[ind],schema));
+      }
+      for (size_t col = 0; published && col < col_names.size(); ++col) {
+	if (coded[col]) {
+	  auto queries = BuildDictionaryQueries(name,col_names[col],schema);
+	  published = std::all_of(queries.begin() + 1,queries.end(),[this](const auto& q) { return TryExecSimpleQuery(q); });
+	}
+      }
+      if (published && std::find(coded.begin(),coded.end(),true) != coded.end()) {
+	published = TryExecSimpleQuery(BuildDecodedView(name,col_names,coded,schema));
+      }
+      if (published && searchable) {
+	auto queries = BuildSearchTriggerQueries(name,text_cols,schema);
+	published = std::all_of(queries.begin(),queries.end(),[this](const auto& q) { return TryExecSimpleQuery(q); });
+      }
+      published = published && DbRegisterTable(name,schema);
+      if (published) {
+	DbStoreColumnStats(name,schema,stats);
+	DbRestoreRollups(name,schema);
+      }
+      if (published && !TryExecSimpleQuery("COMMIT;")) {
+	failure = "Publishing the table failed";
+	published = false;
+      }
+      if (!published) {
+	TryExecSimpleQuery("ROLLBACK;");
+	for (const auto& table : renamed) {
+	  TryExecSimpleQuery("DROP TABLE IF EXISTS " + schema + ".\"" + table.first + "\";");
+	}
+	//A replaced rollup comes back with the rollback
+	DbLoadRollups();
+      }
+      DbInvalidateSchema(name);
+      BumpGeneration(name);
+    }
+
+    if (!published) {
+      FailJob(job,(failure == "Table already exists")?409:500,failure);
+      return false;
+    }
+    if (!deferred.empty()) {
+      auto total = JobStatus(job)->indexes_total;
+      SetJobIndexProgress(job,total,total);
+    }
+    SetJobState(job,"done");
+    return true;
+  }
+
+  //Caller holds the write lock
+  bool CSVApp::DbRegisterTable(const std::string& name, const std::string& schema) {
+    sqlite3_stmt *register_query;
+    if (sqlite3_prepare_v2(db_handle_,kTableReg.c_str(),kTableReg.length() + 1,&register_query,nullptr) != SQLITE_OK) {
+      std::cerr << "In DbRegisterTable::prepare\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+      return false;
+    }
+    sqlite3_bind_text(register_query,1,name.c_str(),name.length(),SQLITE_STATIC);
+    sqlite3_bind_text(register_query,2,schema.c_str(),schema.length(),SQLITE_STATIC);
+    sqlite3_bind_int(register_query,3,1);
+    bool done = (sqlite3_step(register_query) == SQLITE_DONE);
+    if (!done) {
+      std::cerr << "In DbRegisterTable::step\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    sqlite3_finalize(register_query);
+    return done;
+  }
+
+  void CSVApp::DbLoadRollups() {
+    static const std::string query_str {"SELECT name, source FROM main.Rollups;"};
+    Statement query(db_handle_,query_str,"DbLoadRollups");
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    rollup_sources_.clear();
+    while (query.Step()) {
+      rollup_sources_[ColumnToString(query.get(),0)] = ColumnToString(query.get(),1);
+    }
+  }
+
+  std::vector<std::string> CSVApp::RollupsOf(const std::string& source) {
+    std::vector<std::string> rollups;
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    for (const auto& [rollup, from] : rollup_sources_) {
+      if (from == source) {
+	rollups.push_back(rollup);
+      }
+    }
+    return rollups;
+  }
+
+  bool CSVApp::IsRollup(const std::string& name) {
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    return rollup_sources_.count(name) > 0;
+  }
+
+  bool CSVApp::DbCreateRollup(const RollupSpec& spec, const std::string& definition, bool& commit_failed) {
+    static const std::string register_str {"INSERT INTO main.Rollups (name,source,definition) VALUES (?,?,?);"};
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    //Triggers only reach tables of their own database, so the rollup lives next to its source
+    auto schema = DbTableSchema(spec.source);
+    auto queries = BuildRollupTableQueries(spec,schema);
+    auto refresh = BuildRollupRefreshQueries(spec,DbQueryColListOfType(spec.source,kDictColumnType,schema),
+					     DbReadSource(spec.source),schema);
+    queries.insert(queries.end(),refresh.begin(),refresh.end());
+
+    bool built = TryExecSimpleQuery("BEGIN IMMEDIATE;") &&
+      std::all_of(queries.begin(),queries.end(),[this](const auto& q) { return TryExecSimpleQuery(q); });
+    if (built) {
+      Statement record(db_handle_,register_str,"DbCreateRollup");
+      record.Bind(1,spec.name).Bind(2,spec.source).Bind(3,definition).Step();
+      built = record.Ok() && !record.Failed();
+    }
+    built = built && DbRegisterTable(spec.name,schema);
+    commit_failed = built && !TryExecSimpleQuery("COMMIT;");
+    if (!built || commit_failed) {
+      TryExecSimpleQuery("ROLLBACK;");
+      built = false;
+    }
+    if (built) {
+      std::lock_guard<std::mutex> schema_lock(schema_mutex_);
+      rollup_sources_[spec.name] = spec.source;
+    }
+    DbInvalidateSchema(spec.name);
+    BumpGeneration(spec.name);
+    return built;
+  }
+
+  void CSVApp::DbRestoreRollups(const std::string& source, const std::string& schema) {
+    static const std::string query_str {"SELECT definition FROM main.Rollups WHERE name = ?;"};
+    auto rollups = RollupsOf(source);
+    if (rollups.empty()) {
+      return;
+    }
+    DbInvalidateSchema(source);
+    auto coded = DbQueryColListOfType(source,kDictColumnType,schema);
+    auto read_source = DbReadSource(source);
+    auto cols = DbQueryColList(source);
+    //SQLite takes an unknown double quoted name for a string, so missing columns have to be caught here
+    auto fits = [&cols](const RollupSpec& spec) {
+      auto known = [&cols](const std::string& col) { return std::find(cols.begin(),cols.end(),col) != cols.end(); };
+      return std::all_of(spec.group.begin(),spec.group.end(),known) &&
+	std::all_of(spec.aggregates.begin(),spec.aggregates.end(),known) &&
+	std::all_of(spec.where.begin(),spec.where.end(),[&known](const auto& cond) { return known(cond.first); });
+    };
+    for (const auto& rollup : rollups) {
+      std::optional<RollupSpec> spec;
+      {
+	Statement query(db_handle_,query_str,"DbRestoreRollups");
+	if (query.Bind(1,rollup).Step()) {
+	  spec = ParseRollupSpec(ColumnToString(query.get(),0));
+	}
+      }
+      bool restored = spec && fits(*spec);
+      if (restored) {
+	auto queries = BuildRollupRefreshQueries(*spec,coded,read_source,schema);
+	restored = std::all_of(queries.begin(),queries.end(),[this](const auto& q) { return TryExecSimpleQuery(q); });
+      }
+      if (!restored) {
+	std::cerr << "Dropping rollup " << rollup << " that doesn't fit the new " << source << "\n";
+	DbDropTableObjects(rollup,DbTableSchema(rollup));
+      }
+      BumpGeneration(rollup);
+    }
+  }
+
+  void WriteStat1(sqlite3* db, const std::string& table_name, const std::string& schema,
+		  const std::vector<ColumnStats>& stats) {
+    static const std::string indexes_str {"SELECT l.name, i.name FROM pragma_index_list(?1,?2) AS l, "
+					  "pragma_index_info(l.name,?2) AS i WHERE i.seqno = 0 AND l.origin = 'c';"};
+    uint64_t rows = 0;
+    for (const auto& col : stats) {
+      rows = std::max(rows,col.rows);
+    }
+    //SQLite reads "rows [rows per distinct value...]" per index
+    std::vector<std::pair<std::string,std::string>> stat_rows {{"",std::to_string(rows)}};
+    {
+      Statement indexes(db,indexes_str,"WriteStat1");
+      indexes.Bind(1,table_name).Bind(2,schema);
+      while (indexes.Step()) {
+	auto col = ColumnToString(indexes.get(),1);
+	auto it = std::find_if(stats.begin(),stats.end(),[&col](const auto& c) { return c.column == col; });
+	if (it != stats.end() && it->distinct > 0) {
+	  stat_rows.emplace_back(ColumnToString(indexes.get(),0),
+				 std::to_string(rows) + " " + std::to_string((rows + it->distinct - 1) / it->distinct));
+	}
+      }
+    }
+    //Analyzing sqlite_master creates sqlite_stat1 if need be and makes SQLite reload it
+    ExecSimpleQuery(db,"ANALYZE " + schema + ".sqlite_master;");
+    {
+      Statement forget(db,"DELETE FROM " + schema + ".sqlite_stat1 WHERE tbl = ?;","WriteStat1");
+      forget.Bind(1,table_name).Step();
+    }
+    {
+      Statement insert(db,"INSERT INTO " + schema + ".sqlite_stat1 (tbl, idx, stat) VALUES (?,?,?);","WriteStat1");
+      for (const auto& [index, stat] : stat_rows) {
+	insert.Bind(1,table_name).Bind(3,stat);
+	if (index.empty()) {
+	  sqlite3_bind_null(insert.get(),2);
+	}
+	else {
+	  insert.Bind(2,index);
+	}
+	insert.Step();
+	insert.Reset();
+      }
+    }
+    ExecSimpleQuery(db,"ANALYZE " + schema + ".sqlite_master;");
+  }
+
+  void CSVApp::DbStoreColumnStats(const std::string& table_name, const std::string& schema,
+				  const std::vector<ColumnStats>& stats) {
+    static const std::string record_str {"INSERT INTO main.ColumnStats (table_name, ordinal, col, numeric, rows, nulls, "
+					 "distinct_count, min, max, histogram) VALUES (?,?,?,?,?,?,?,?,?,?);"};
+    {
+      Statement forget(db_handle_,"DELETE FROM main.ColumnStats WHERE table_name = ?;","DbStoreColumnStats");
+      forget.Bind(1,table_name).Step();
+    }
+    Statement record(db_handle_,record_str,"DbStoreColumnStats");
+    for (size_t ind = 0; ind < stats.size(); ++ind) {
+      const auto& col = stats[ind];
+      std::string histogram;
+      for (const auto& bound : col.bounds) {
+	histogram += bound;
+	histogram += '\x1f';
+      }
+      record.Bind(1,table_name).Bind(2,static_cast<int64_t>(ind)).Bind(3,col.column).Bind(4,int64_t(col.numeric))
+	.Bind(5,static_cast<int64_t>(col.rows)).Bind(6,static_cast<int64_t>(col.nulls))
+	.Bind(7,static_cast<int64_t>(col.distinct)).Bind(8,col.min).Bind(9,col.max).Bind(10,histogram).Step();
+      record.Reset();
+    }
+    WriteStat1(db_handle_,table_name,schema,stats);
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    stats_cache_.erase(table_name);
+  }
+
+  std::vector<ColumnStats> CSVApp::DbTableStats(const std::string& table_name) {
+    static const std::string query_str {"SELECT col, numeric, rows, nulls, distinct_count, min, max, histogram "
+				       "FROM main.ColumnStats WHERE table_name = ? ORDER BY ordinal;"};
+    {
+      std::lock_guard<std::mutex> lock(schema_mutex_);
+      auto it = stats_cache_.find(table_name);
+      if (it != stats_cache_.end()) {
+	return it->second;
+      }
+    }
+    std::vector<ColumnStats> stats;
+    Statement query(db_handle_,query_str,"DbTableStats");
+    query.Bind(1,table_name);
+    while (query.Step()) {
+      ColumnStats col;
+      col.column = ColumnToString(query.get(),0);
+      col.numeric = sqlite3_column_int(query.get(),1) != 0;
+      col.rows = sqlite3_column_int64(query.get(),2);
+      col.nulls = sqlite3_column_int64(query.get(),3);
+      col.distinct = sqlite3_column_int64(query.get(),4);
+      col.min = ColumnToString(query.get(),5);
+      col.max = ColumnToString(query.get(),6);
+      auto histogram = ColumnToString(query.get(),7);
+      size_t start = 0;
+      for (size_t end = histogram.find('\x1f'); end != std::string::npos; end = histogram.find('\x1f',start)) {
+	col.bounds.push_back(histogram.substr(start,end - start));
+	start = end + 1;
+      }
+      stats.push_back(std::move(col));
+    }
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    stats_cache_[table_name] = stats;
+    return stats;
+  }
+
+  std::optional<ColumnStats> CSVApp::DbColumnStats(const std::string& table_name, const std::string& col) {
+    for (auto& stats : DbTableStats(table_name)) {
+      if (stats.column == col) {
+	return std::optional<ColumnStats>(std::move(stats));
+      }
+    }
+    return std::nullopt;
+  }
+
+  std::string CSVApp::SortPruneFilter(const std::string& table_name,
+				      const std::vector<std::pair<std::string,bool>>& sorts,
+				      uint64_t leading) {
+    if (sorts.empty()) {
+      return "";
+    }
+    const auto& [col, asc] = sorts.front();
+    auto stats = DbColumnStats(table_name,col);
+    auto cut = stats?HistogramCut(*stats,leading,asc):std::nullopt;
+    if (!cut) {
+      return "";
+    }
+    auto literal = StatLiteral(*stats,*cut);
+    return asc?("(\"" + col + "\" IS NULL OR \"" + col + "\" <= " + literal + ")"):("\"" + col + "\" >= " + literal);
+  }
+
+  //Next to the main db so the final copy stays on one device, the temp dir for in-memory dbs
+  std::string CSVApp::StagingFileName(uint64_t job) {
+    std::string db_file;
+    if (auto name = sqlite3_db_filename(db_handle_,"main")) {
+      db_file = name;
+    }
+    if (db_file.empty()) {
+      db_file = (std::filesystem::temp_directory_path() / ("csvapp-" + std::to_string(::getpid()))).string();
+    }
+    return db_file + ".staging" + std::to_string(job);
+  }
+
+  std::vector<std::string> CSVApp::DbQueryColListOfType(const std::string& table_name, const std::string& type,
+						       const std::string& schema) {
+    sqlite3_stmt *table_col_query;
+    std::string col_query ("SELECT name FROM pragma_table_info('");
+    col_query += table_name;
+    col_query += "','" + schema + "') WHERE type = '" + type + "';";
+
+    std::cerr << "Query:" << col_query << "\n";
+    if (sqlite3_prepare_v2(db_handle_,
+			   col_query.c_str(),
+			   col_query.length() + 1,
+			   &table_col_query,
+			   nullptr) != SQLITE_OK) {
+      std::cerr << "In DbQueryColListOfType::prepare\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    std::vector<std::string> cols;
+    while(sqlite3_step(table_col_query) == SQLITE_ROW) {
+      auto col_name = sqlite3_column_text(table_col_query,0);
+      cols.emplace_back(reinterpret_cast<const char*>(col_name));
+    }
+    
+    if (sqlite3_finalize(table_col_query) != SQLITE_OK) {
+      std::cerr << "In DbQueryColListOfType::finalize\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    return cols;
+  }
+
+  //Caller holds the write lock
+  bool CSVApp::DbHasSearchIndex(const std::string& table_name) {
+    auto query_str = "SELECT count(*) FROM " + DbTableSchema(table_name) + ".sqlite_master WHERE type = 'table' AND name = ?;";
+    auto fts_name = SearchIndexName(table_name);
+    Statement query(db_handle_,query_str,"DbHasSearchIndex");
+    return query.Bind(1,fts_name).Step() && sqlite3_column_int(query.get(),0) > 0;
+  }
+
+  std::optional<JSONData> CSVApp::DbSearchTable(const std::string& table_name,
+						const std::string& match,
+						const std::pair<uint32_t,uint32_t> row_range) {
+    auto cols = DbCachedColList(table_name).value_or(std::vector<std::string>());
+    auto query_str = BuildSearchQuery(table_name,cols,DbReadSource(table_name));
+    std::cerr << "Search query:" << query_str << "\n";
+
+    RowLayout layout {{"_rowid",0},{"_rank",1},{"_snippet",2}};
+    for (size_t ind = 0; ind < cols.size(); ++ind) {
+      layout.emplace_back(cols[ind],ind + 3);
+    }
+    layout = BuildRowLayout(std::move(layout));
+    return DbRead([&](sqlite3* db) {
+      Statement query(db,query_str,"DbSearchTable");
+      query.Bind(1,match);
+      query.Bind(2,static_cast<int64_t>(WindowRows(row_range)));
+      query.Bind(3,static_cast<int64_t>(row_range.first));
+
+      RowBatch batch(cols.size() + 3);
+      std::string contents {"["};
+      while (batch.Fill(query)) {
+	AppendJSONRows(contents,batch,layout);
+      }
+      //Malformed match expressions only surface at step time
+      if (!query.Ok() || query.Failed()) {
+	return std::optional<JSONData>();
+      }
+      contents += ']';
+      JSONData table;
+      table["contents"] = std::move(contents);
+      return std::optional<JSONData>(table);
+    });
+  }
+
+  //This will fail miserably with non-ASCII table names
+  //Solution? Refuse to upload CSVs under non-ASCII names :-)
+
+  std::vector<std::string> CSVApp::DbQueryTableList() {
+    sqlite3_stmt *table_list_query;
+    std::cerr << "Query:" << kTableQuery << "\n";
+    std::cerr << "Query length:" << kTableQuery.length() << "\n";
+    if (sqlite3_prepare_v2(db_handle_,
+			   kTableQuery.c_str(),
+			   kTableQuery.length() + 1,
+			   &table_list_query,
+			   nullptr) != SQLITE_OK) {
+      std::cerr << "In DbQueryTableList::prepare\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    std::vector<std::string> table_names;
+    while (sqlite3_step(table_list_query) == SQLITE_ROW) {
+      auto table_name = sqlite3_column_text(table_list_query,0);
+      table_names.emplace_back(reinterpret_cast<const char*>(table_name));
+    }
+    
+    //Finalization to reuse table_list_query later
+    //Who needs many pointer when one pointer do the thing?
+    if (sqlite3_finalize(table_list_query) != SQLITE_OK) {
+      std::cerr << "In DbQueryTableList::finalize\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+
+    return table_names;
+  }
+
+  std::vector<std::string> CSVApp::DbQueryColList(const std::string& table_name) {
+    sqlite3_stmt *table_col_query;
+    std::string col_query ("SELECT name FROM pragma_table_info('");
+    col_query += table_name;
+    col_query += "');";
+
+    std::cerr << "Query:" << col_query << "\n";
+    if (sqlite3_prepare_v2(db_handle_,
+			   col_query.c_str(),
+			   col_query.length() + 1,
+			   &table_col_query,
+			   nullptr) != SQLITE_OK) {
+      std::cerr << "In DbQueryColList::prepare\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    std::vector<std::string> cols;
+    while(sqlite3_step(table_col_query) == SQLITE_ROW) {
+      auto col_name = sqlite3_column_text(table_col_query,0);
+      cols.emplace_back(reinterpret_cast<const char*>(col_name));
+    }
+    
+    if (sqlite3_finalize(table_col_query) != SQLITE_OK) {
+      std::cerr << "In DbQueryColList::finalize\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    return cols;
+  }
+  
+  std::optional<std::vector<std::string>> CSVApp::DbCachedColList(const std::string& table_name) {
+    {
+      std::lock_guard<std::mutex> lock(schema_mutex_);
+      auto it = schema_cache_.find(table_name);
+      if (it != schema_cache_.end()) {
+	return std::optional<std::vector<std::string>>(it->second);
+      }
+    }
+    auto table_list = DbQueryTableList();
+    if (std::find(table_list.begin(),table_list.end(),table_name) == table_list.end()) {
+      return std::optional<std::vector<std::string>>();
+    }
+    auto cols = DbQueryColList(table_name);
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    schema_cache_[table_name] = cols;
+    return std::optional<std::vector<std::string>>(cols);
+  }
+
+  void CSVApp::DbInvalidateSchema(const std::string& table_name) {
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    schema_cache_.erase(table_name);
+    read_source_cache_.erase(table_name);
+    table_schema_cache_.erase(table_name);
+    stats_cache_.erase(table_name);
+  }
+
+  std::string CSVApp::DbTableSchema(const std::string& table_name) {
+    {
+      std::lock_guard<std::mutex> lock(schema_mutex_);
+      auto it = table_schema_cache_.find(table_name);
+      if (it != table_schema_cache_.end()) {
+	return it->second;
+      }
+    }
+    static const std::string query_str {"SELECT internal_name FROM main.Files WHERE name = ?;"};
+    std::string schema = "main";
+    sqlite3_stmt *query;
+    if (sqlite3_prepare_v2(db_handle_,
+			   query_str.c_str(),
+			   query_str.length() + 1,
+			   &query,
+			   nullptr) != SQLITE_OK) {
+      std::cerr << "In DbTableSchema::prepare\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    sqlite3_bind_text(query,1,table_name.c_str(),table_name.length(),SQLITE_STATIC);
+    if (sqlite3_step(query) == SQLITE_ROW) {
+      std::string recorded = reinterpret_cast<const char*>(sqlite3_column_text(query,0));
+      //Tables from before sharding carry a placeholder here
+      if (std::find(attached_schemas_.begin(),attached_schemas_.end(),recorded) != attached_schemas_.end()) {
+	schema = recorded;
+      }
+    }
+    if (sqlite3_finalize(query) != SQLITE_OK) {
+      std::cerr << "In DbTableSchema::finalize\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    table_schema_cache_[table_name] = schema;
+    return schema;
+  }
+
+  std::string CSVApp::DbReadSource(const std::string& table_name) {
+    {
+      std::lock_guard<std::mutex> lock(schema_mutex_);
+      auto it = read_source_cache_.find(table_name);
+      if (it != read_source_cache_.end()) {
+	return it->second;
+      }
+    }
+    auto schema = DbTableSchema(table_name);
+    auto query_str = "SELECT count(*) FROM " + schema + ".sqlite_master WHERE type = 'view' AND name = ?;";
+    auto view_name = DecodedViewName(table_name);
+    bool decoded = false;
+    sqlite3_stmt *query;
+    if (sqlite3_prepare_v2(db_handle_,
+			   query_str.c_str(),
+			   query_str.length() + 1,
+			   &query,
+			   nullptr) != SQLITE_OK) {
+      std::cerr << "In DbReadSource::prepare\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    sqlite3_bind_text(query,1,view_name.c_str(),view_name.length(),SQLITE_STATIC);
+    if (sqlite3_step(query) == SQLITE_ROW) {
+      decoded = (sqlite3_column_int(query,0) > 0);
+    }
+    if (sqlite3_finalize(query) != SQLITE_OK) {
+      std::cerr << "In DbReadSource::finalize\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    auto source = schema + ".\"" + (decoded?view_name:table_name) + "\"";
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    read_source_cache_[table_name] = source;
+    return source;
+  }
+
+  uint64_t CSVApp::TableGeneration(const std::string& table_name) {
+    std::lock_guard<std::mutex> lock(generation_mutex_);
+    return generations_[table_name];
+  }
+
+  void CSVApp::BumpGeneration(const std::string& table_name) {
+    //Triggers have changed the rollups along with their source
+    auto tables = RollupsOf(table_name);
+    tables.push_back(table_name);
+    {
+      std::lock_guard<std::mutex> lock(generation_mutex_);
+      for (const auto& table : tables) {
+	++generations_[table];
+      }
+    }
+    //Rebuilt from the new rows on the next lookup
+    std::lock_guard<std::mutex> lock(hash_index_mutex_);
+    for (const auto& table : tables) {
+      auto it = hash_indexes_.lower_bound({table,std::string()});
+      while (it != hash_indexes_.end() && it->first.first == table) {
+	hash_index_bytes_ -= it->second.index->Bytes();
+	it = hash_indexes_.erase(it);
+      }
+    }
+  }
+  
+  JSONData CSVApp::DbQueryList() {
+    JSONData list;
+    //And once again i cry over lack of std::format
+    auto table_names = DbQueryTableList();
+    std::vector<std::string> tables_json;
+    std::vector<std::string> stats_json;
+    for (const auto& table : table_names) {
+      JSONData table_desc;
+      auto cols = DbQueryColList(table);
+      table_desc[table] = PackJSONArray(cols);
+      tables_json.push_back(PackJSON(table_desc));
+      std::vector<std::string> cols_json;
+      for (const auto& col : DbTableStats(table)) {
+	cols_json.push_back(PackJSON({{"column",col.column},{"rows",std::to_string(col.rows)},
+				      {"nulls",std::to_string(col.nulls)},{"distinct",std::to_string(col.distinct)},
+				      {"min",col.min},{"max",col.max},{"histogram",PackJSONArray(col.bounds)}}));
+      }
+      JSONData stats_desc;
+      stats_desc[table] = PackJSONArray(cols_json);
+      stats_json.push_back(PackJSON(stats_desc));
+    }
+    list["tables"] = PackJSONArray(tables_json);
+    list["stats"] = PackJSONArray(stats_json);
+    return list;
+  }
+
+  //Once again we offload the authorization duty to handler
+  JSONData CSVApp::DbQueryTable(const std::string& table_name,
+				const std::vector<std::string>& cols,
+				const std::vector<std::pair<std::string,bool>>& ordered,
+				const std::pair<uint32_t,uint32_t> row_range,
+				size_t sample, uint64_t seed) {
+    JSONData table;
+    
+    //Build the query string
+    PooledString query_str;
+    *query_str += "SELECT ";
+
+    std::vector<std::string> real_cols;
+    if (cols.empty()) {
+      real_cols = DbQueryColList(table_name);
+    }
+    const std::vector<std::string>& used_cols = (cols.empty())?real_cols:cols;
+    for (size_t ind = 0;ind <used_cols.size() ;++ind) {
+      bool last = (ind + 1 == used_cols.size());
+      *query_str += '"';
+      *query_str += used_cols[ind];
+      *query_str += (last?"\" ":"\", ");
+    }
+    *query_str += "FROM ";
+    *query_str += DbReadSource(table_name);
+    *query_str += ' ';
+
+    //Unsorted views are a rowid range, sorted ones the same positions of the ordered rows, both ends included
+    auto count = WindowRows(row_range);
+    std::pair<uint32_t,uint32_t> window {row_range.first,
+					 row_range.first + std::min<uint64_t>(count,UINT32_MAX - row_range.first)};
+    std::vector<int64_t> rowids;
+    bool external = false;
+    RowidSample drawn;
+    if (sample > 0) {
+      drawn = DbSampleRowids(table_name,sample,seed);
+      rowids = drawn.rowids;
+      external = true;
+      *query_str += "WHERE rowid = ?;";
+    }
+    else if (ordered.empty()) {
+      *query_str += "WHERE rowid >= ";
+      AppendNumber(*query_str,row_range.first);
+      *query_str += " AND rowid <= ";
+      AppendNumber(*query_str,row_range.second);
+      *query_str += ';';
+    }
+    else if (window.second > window.first &&
+	     static_cast<size_t>(DbEstimateRows(table_name)) >= kExternalSortMinRows &&
+	     !DbHasLeadingIndex(table_name,ordered.front().first)) {
+      //Large unindexed sorts go through our own merge so SQLite's single threaded sorter stays out of it
+      rowids = (window.second <= kTopKMaxRows)?
+	DbTopKSort(table_name,ordered,window):DbExternalSort(table_name,ordered,window);
+      external = true;
+      *query_str += "WHERE rowid = ?;";
+    }
+    else {
+      *query_str += "ORDER BY ";
+      for (size_t ind = 0; ind < ordered.size(); ++ind) {
+	*query_str += '"';
+	*query_str += ordered[ind].first;
+	*query_str += (ordered[ind].second?"\" ASC":"\" DESC");
+	*query_str += ((ind + 1 == ordered.size())?" ":", ");
+      }
+      *query_str += "LIMIT ";
+      AppendNumber(*query_str,count);
+      *query_str += " OFFSET ";
+      AppendNumber(*query_str,row_range.first);
+      *query_str += ';';
+    }
+    //Execute query and pack it into JSON
+    std::cerr << "View query:" << *query_str << "\n";
+
+    RowLayout layout;
+    for (size_t ind = 0; ind < used_cols.size(); ++ind) {
+      layout.emplace_back(used_cols[ind],ind);
+    }
+    layout = BuildRowLayout(std::move(layout));
+    uint64_t found = 0;
+    table["contents"] = DbRead([&](sqlite3* db) {
+      Statement query(db,*query_str,"DbQueryTable");
+      RowBatch batch(used_cols.size());
+      std::string contents {"["};
+      if (external) {
+	for (auto rowid : rowids) {
+	  if (query.Bind(1,rowid).Step()) {
+	    batch.Append(query.get());
+	    ++found;
+	  }
+	  query.Reset();
+	  if (batch.Full()) {
+	    AppendJSONRows(contents,batch,layout);
+	    batch.Clear();
+	  }
+	}
+	AppendJSONRows(contents,batch,layout);
+      }
+      else {
+	while (batch.Fill(query)) {
+	  AppendJSONRows(contents,batch,layout);
+	}
+      }
+      contents += ']';
+      return contents;
+    });
+    if (sample > 0) {
+      //Probes that found a row tell how many of the rowid slots are still taken
+      SampleMoments hits {found,static_cast<double>(found),static_cast<double>(found)};
+      auto rows = EstimateAggregate(AggregateOp::Count,hits,drawn.probes,drawn.slots);
+      AppendNumber(table["sampled"],found);
+      AppendNumber(table["estimated_rows"],static_cast<uint64_t>(std::llround(rows.value)));
+      if (rows.error) {
+	AppendNumber(table["estimated_rows_error"],*rows.error);
+      }
+    }
+    return table;
+  }
+
+  JSONData CSVApp::DbAggregate(const std::string& table_name,
+			       AggregateOp op,
+			       const std::string& value_col,
+			       const std::string& group_col,
+			       size_t sample, uint64_t seed) {
+    JSONData result;
+    auto source = DbReadSource(table_name);
+    std::string group_expr = group_col.empty()?"NULL":"\"" + group_col + "\"";
+    std::string value_expr = value_col.empty()?"1":"\"" + value_col + "\"";
+
+    //Group keys are the values as /view shows them
+    std::map<std::string,SampleMoments> groups;
+    uint64_t probes = 0;
+    uint64_t population = 0;
+    //Exact sums as SQLite gives them, integers stay integers like in view
+    std::map<std::string,std::string> sums;
+    if (sample == 0) {
+      std::string query_str = "SELECT " + group_expr + ", count(" + value_expr + "), total(" + value_expr +
+	"), coalesce(sum(" + value_expr + "),0) FROM " + source + (group_col.empty()?";":" GROUP BY 1;");
+      std::cerr << "Aggregate query:" << query_str << "\n";
+      DbRead([&](sqlite3* db) {
+	Statement query(db,query_str,"DbAggregate");
+	while (query.Step()) {
+	  auto key = ColumnToString(query.get(),0);
+	  auto& moments = groups[key];
+	  moments.rows = sqlite3_column_int64(query.get(),1);
+	  moments.sum = sqlite3_column_double(query.get(),2);
+	  sums[key] = ColumnToString(query.get(),3);
+	}
+      });
+    }
+    else {
+      auto drawn = DbSampleRowids(table_name,sample,seed);
+      auto& rowids = drawn.rowids;
+      probes = drawn.probes;
+      population = drawn.slots;
+      std::string query_str = "SELECT " + group_expr + ", " + value_expr + " FROM " + source + " WHERE rowid = ?;";
+      std::cerr << "Sampled aggregate query:" << query_str << "\n";
+      DbRead([&](sqlite3* db) {
+	Statement query(db,query_str,"DbAggregate");
+	for (auto rowid : rowids) {
+	  if (query.Bind(1,rowid).Step()) {
+	    auto& moments = groups[ColumnToString(query.get(),0)];
+	    if (sqlite3_column_type(query.get(),1) != SQLITE_NULL) {
+	      double val = sqlite3_column_double(query.get(),1);
+	      ++moments.rows;
+	      moments.sum += val;
+	      moments.sum_sq += val * val;
+	    }
+	  }
+	  query.Reset();
+	}
+      });
+    }
+    //An ungrouped aggregate always has its one row, as in SQL
+    if (group_col.empty()) {
+      groups.try_emplace("");
+    }
+
+    bool exact = (sample == 0 || probes >= population);
+    std::vector<std::string> group_list;
+    for (const auto& [key, moments] : groups) {
+      if (group_list.size() == kMaxAggregateGroups) {
+	break;
+      }
+      JSONData entry;
+      entry["group"] = key;
+      AppendNumber(entry["rows"],moments.rows);
+      if (sample == 0) {
+	if (op == AggregateOp::Count) {
+	  AppendNumber(entry["value"],moments.rows);
+	}
+	else if (op == AggregateOp::Sum) {
+	  auto sum = sums.find(key);
+	  entry["value"] = (sum != sums.end())?sum->second:"0";
+	}
+	else {
+	  AppendNumber(entry["value"],(moments.rows > 0)?moments.sum / moments.rows:0.0);
+	}
+	entry["error"] = "0";
+      }
+      else {
+	auto est = EstimateAggregate(op,moments,probes,population);
+	AppendNumber(entry["value"],est.value);
+	if (est.error) {
+	  AppendNumber(entry["error"],*est.error);
+	}
+      }
+      group_list.push_back(PackJSON(entry));
+    }
+    result["groups"] = PackJSONArray(group_list);
+    AppendNumber(result["group_count"],groups.size());
+    result["exact"] = exact?"1":"0";
+    if (sample > 0) {
+      AppendNumber(result["sampled"],probes);
+      AppendNumber(result["population"],population);
+      result["confidence"] = "0.95";
+    }
+    return result;
+  }
+
+  uint32_t CSVApp::DbQueryTableSize(const std::string& table_name) {
+    std::string query_str = "SELECT count(*) FROM " + DbTableSchema(table_name) + ".\"" + table_name + "\";";
+    return DbRead([&](sqlite3* db) {
+      Statement query(db,query_str,"DbQueryTableSize");
+      return query.Step()?static_cast<uint32_t>(sqlite3_column_int(query.get(),0)):0;
+    });
+  }
+
+
+  int64_t CSVApp::DbEstimateRows(const std::string& table_name) {
+    std::string query_str = "SELECT max(rowid) FROM " + DbTableSchema(table_name) + ".\"" + table_name + "\";";
+    Statement query(db_handle_,query_str,"DbEstimateRows");
+    return query.Step()?sqlite3_column_int64(query.get(),0):0;
+  }
+
+  RowidSample CSVApp::DbSampleRowids(const std::string& table_name, size_t n, uint64_t seed) {
+    auto source = DbTableSchema(table_name) + ".\"" + table_name + "\"";
+    return DbRead([&](sqlite3* db) {
+      RowidSample sample;
+      int64_t lo = 0;
+      int64_t hi = -1;
+      {
+	Statement span(db,"SELECT min(rowid), max(rowid) FROM " + source + ";","DbSampleRowids");
+	if (span.Step() && sqlite3_column_type(span.get(),0) != SQLITE_NULL) {
+	  lo = sqlite3_column_int64(span.get(),0);
+	  hi = sqlite3_column_int64(span.get(),1);
+	}
+      }
+      if (n == 0 || hi < lo) {
+	return sample;
+      }
+      //Unsigned, a span across the whole int64 range does not fit, such a table is too sparse to probe anyway
+      uint64_t slots = static_cast<uint64_t>(hi) - static_cast<uint64_t>(lo);
+      slots = std::min<uint64_t>(slots,INT64_MAX - 1) + 1;
+      if (slots > kSampleProbeFactor * n) {
+	Statement probe(db,"SELECT 1 FROM " + source + " WHERE rowid = ?;","DbSampleRowids");
+	std::unordered_set<int64_t> probed;
+	for (uint64_t round = 0; sample.rowids.size() < n && probed.size() < kSampleProbeFactor * n; ++round) {
+	  for (auto offset : SampleRowids(slots,n - sample.rowids.size(),seed + round)) {
+	    auto rowid = static_cast<int64_t>(static_cast<uint64_t>(lo) + static_cast<uint64_t>(offset - 1));
+	    if (!probed.insert(rowid).second) {
+	      continue;
+	    }
+	    if (probe.Bind(1,rowid).Step()) {
+	      sample.rowids.push_back(rowid);
+	    }
+	    probe.Reset();
+	  }
+	}
+	if (sample.rowids.size() == n) {
+	  std::sort(sample.rowids.begin(),sample.rowids.end());
+	  sample.probes = probed.size();
+	  sample.slots = slots;
+	  return sample;
+	}
+      }
+      //By rank, one pass to count the rows and one to pick the drawn positions in rowid order
+      sample.rowids.clear();
+      {
+	Statement count(db,"SELECT count(*) FROM " + source + ";","DbSampleRowids");
+	sample.slots = count.Step()?sqlite3_column_int64(count.get(),0):0;
+      }
+      auto ranks = SampleRowids(sample.slots,n,seed);
+      Statement scan(db,"SELECT rowid FROM " + source + ";","DbSampleRowids");
+      uint64_t rank = 0;
+      for (auto next = ranks.begin(); next != ranks.end() && scan.Step(); ) {
+	if (static_cast<uint64_t>(*next) == ++rank) {
+	  sample.rowids.push_back(sqlite3_column_int64(scan.get(),0));
+	  ++next;
+	}
+      }
+      sample.probes = ranks.size();
+      return sample;
+    });
+  }
+
+  //An index led by the column lets SQLite walk the rows in order and stop at the window
+  bool CSVApp::DbHasLeadingIndex(const std::string& table_name, const std::string& col) {
+    //A declared key is the rowid itself and never shows up among the indexes
+    static const std::string query_str {"SELECT (SELECT count(*) FROM pragma_index_list(?1) AS l, "
+					"pragma_index_info(l.name) AS i WHERE i.seqno = 0 AND i.name = ?2) + "
+					"(SELECT count(*) FROM pragma_table_info(?1) WHERE pk = 1 AND name = ?2 "
+					"AND type = 'INTEGER');"};
+    Statement query(db_handle_,query_str,"DbHasLeadingIndex");
+    return query.Bind(1,table_name).Bind(2,col).Step() && sqlite3_column_int(query.get(),0) > 0;
+  }
+
+  std::optional<std::string> CSVApp::DbKeyColumn(const std::string& table_name) {
+    static const std::string query_str {"SELECT name FROM pragma_table_info(?) WHERE pk = 1 AND type = 'INTEGER';"};
+    std::optional<std::string> key;
+    Statement query(db_handle_,query_str,"DbKeyColumn");
+    if (query.Bind(1,table_name).Step()) {
+      key = ColumnToString(query.get(),0);
+    }
+    return key;
+  }
+
+  std::shared_ptr<const HashIndex> CSVApp::DbHashIndex(const std::string& table_name, const std::string& col) {
+    auto generation = TableGeneration(table_name);
+    {
+      std::lock_guard<std::mutex> lock(hash_index_mutex_);
+      auto it = hash_indexes_.find({table_name,col});
+      if (it != hash_indexes_.end() && it->second.generation == generation) {
+	it->second.last_used = ++hash_index_clock_;
+	return it->second.index;
+      }
+    }
+    //Upload statistics only size the table up front, the scan itself gives up past the cap
+    auto stats = DbColumnStats(table_name,col);
+    auto expected = stats?(stats->rows - stats->nulls):0;
+    if (expected > kHashIndexMaxRows) {
+      return nullptr;
+    }
+
+    //Keys are the values as /view shows them, NULLs are never found
+    auto index = std::make_shared<HashIndex>(expected);
+    auto query_str = "SELECT rowid, \"" + col + "\" FROM " + DbReadSource(table_name) + " WHERE \"" + col + "\" IS NOT NULL;";
+    std::cerr << "Query:" << query_str << "\n";
+    bool capped = DbRead([&](sqlite3* db) {
+      Statement query(db,query_str,"DbHashIndex");
+      while (query.Step()) {
+	if (index->Size() == kHashIndexMaxRows) {
+	  return true;
+	}
+	index->Insert(ColumnToString(query.get(),1),sqlite3_column_int64(query.get(),0));
+      }
+      return false;
+    });
+    if (capped) {
+      return nullptr;
+    }
+    //A write racing the scan has bumped the generation past ours, so this entry is just never used
+    std::lock_guard<std::mutex> lock(hash_index_mutex_);
+    auto& entry = hash_indexes_[{table_name,col}];
+    if (entry.index) {
+      hash_index_bytes_ -= entry.index->Bytes();
+    }
+    entry = {generation,index,++hash_index_clock_};
+    hash_index_bytes_ += index->Bytes();
+    while (hash_index_bytes_ > kHashIndexBudgetBytes) {
+      auto oldest = std::min_element(hash_indexes_.begin(),hash_indexes_.end(),[](const auto& a, const auto& b) {
+	return a.second.last_used < b.second.last_used;
+      });
+      hash_index_bytes_ -= oldest->second.index->Bytes();
+      hash_indexes_.erase(oldest);
+    }
+    return index;
+  }
+
+  JSONData CSVApp::DbLookupRows(const std::string& table_name,
+				const std::string& col,
+				const std::vector<std::string>& keys) {
+    auto cols = DbCachedColList(table_name).value_or(std::vector<std::string>());
+    auto col_pos = std::find(cols.begin(),cols.end(),col) - cols.begin();
+    auto source = DbReadSource(table_name);
+    std::string select_str {"SELECT rowid"};
+    for (const auto& name : cols) {
+      select_str += ", \"" + name + "\"";
+    }
+    select_str += " FROM " + source;
+
+    //The key is the rowid, an indexed column goes through SQLite, anything else through our hash index
+    bool by_rowid = (col == DbKeyColumn(table_name));
+    bool scan = by_rowid || DbHasLeadingIndex(table_name,col);
+    auto hash_index = scan?nullptr:DbHashIndex(table_name,col);
+    //Without either a per key lookup would be a scan per key, so one scan serves the whole key set
+    bool scan_all = !by_rowid && !scan && !hash_index;
+    auto query_str = select_str + (scan_all?";":(by_rowid || hash_index)?" WHERE rowid = ?;":" WHERE \"" + col + "\" = ?;");
+    std::cerr << "Lookup query:" << query_str << "\n";
+
+    RowLayout layout {{"_rowid",0}};
+    for (size_t ind = 0; ind < cols.size(); ++ind) {
+      layout.emplace_back(cols[ind],ind + 1);
+    }
+    layout = BuildRowLayout(std::move(layout));
+    return DbRead([&](sqlite3* db) {
+      RequestArena arena;
+      Statement query(db,query_str,"DbLookupRows");
+      std::pmr::vector<std::pmr::string> rows_json(arena.get());
+      std::vector<std::string> missing;
+      std::vector<int64_t> rowids;
+      auto pack_row = [&]() {
+	AppendJSONRow(rows_json.emplace_back(),query.get(),layout);
+      };
+      if (scan_all) {
+	std::unordered_map<std::string,size_t> wanted;
+	for (const auto& key : keys) {
+	  wanted.emplace(key,wanted.size());
+	}
+	std::pmr::vector<std::pmr::vector<std::pmr::string>> matches(wanted.size(),arena.get());
+	while (query.Step()) {
+	  //NULLs and blobs never equal a key
+	  auto type = sqlite3_column_type(query.get(),col_pos + 1);
+	  if (type == SQLITE_NULL || type == SQLITE_BLOB) {
+	    continue;
+	  }
+	  auto match = wanted.find(ColumnToString(query.get(),col_pos + 1));
+	  if (match != wanted.end()) {
+	    AppendJSONRow(matches[match->second].emplace_back(),query.get(),layout);
+	  }
+	}
+	for (const auto& key : keys) {
+	  const auto& rows = matches[wanted[key]];
+	  if (rows.empty()) {
+	    missing.push_back(key);
+	  }
+	  rows_json.insert(rows_json.end(),rows.begin(),rows.end());
+	}
+      }
+      else {
+	for (const auto& key : keys) {
+	  size_t found = rows_json.size();
+	  if (by_rowid) {
+	    int64_t rowid;
+	    auto parsed = std::from_chars(key.data(),key.data() + key.length(),rowid);
+	    if (parsed.ec == std::errc() && parsed.ptr == key.data() + key.length()) {
+	      if (query.Bind(1,rowid).Step()) {
+		pack_row();
+	      }
+	      query.Reset();
+	    }
+	  }
+	  else if (hash_index) {
+	    rowids.clear();
+	    hash_index->Lookup(key,rowids);
+	    std::sort(rowids.begin(),rowids.end());
+	    for (auto rowid : rowids) {
+	      //Same hash is not the same key
+	      if (query.Bind(1,rowid).Step() && ColumnToString(query.get(),col_pos + 1) == key) {
+		pack_row();
+	      }
+	      query.Reset();
+	    }
+	  }
+	  else {
+	    //Column affinity would also match "02" to 2, the hash index path only takes the text itself
+	    query.Bind(1,key);
+	    while (query.Step()) {
+	      if (ColumnToString(query.get(),col_pos + 1) == key) {
+		pack_row();
+	      }
+	    }
+	    query.Reset();
+	  }
+	  if (found == rows_json.size()) {
+	    missing.push_back(key);
+	  }
+	}
+      }
+      JSONData table;
+      table["contents"] = PackJSONArray(rows_json);
+      table["missing"] = PackJSONArray(missing);
+      return table;
+    });
+  }
+
+  //One pass over the sort columns, the sorter hands back the rowids of the window in order
+  std::vector<int64_t> CSVApp::DbExternalSort(const std::string& table_name,
+					      const std::vector<std::pair<std::string,bool>>& sorts,
+					      const std::pair<uint32_t,uint32_t> window) {
+    auto filter = SortPruneFilter(table_name,sorts,window.second);
+    auto source = DbReadSource(table_name);
+    return DbRead([&](sqlite3* db) {
+      return ExternalSortRowids(db,source,sorts,window,filter);
+    });
+  }
+
+  //Each partition of the rowid space gets a reader connection and heap of its own
+  //In-memory databases have no readers and are scanned in one go
+  std::vector<int64_t> CSVApp::DbTopKSort(const std::string& table_name,
+					  const std::vector<std::pair<std::string,bool>>& sorts,
+					  const std::pair<uint32_t,uint32_t> window) {
+    int64_t max_rowid = DbEstimateRows(table_name);
+    size_t parts = readers_?readers_->Size():1;
+    int64_t step = max_rowid / static_cast<int64_t>(parts) + 1;
+    auto source = DbReadSource(table_name);
+    auto filter = SortPruneFilter(table_name,sorts,window.second);
+
+    auto scan_parts = [&](const std::string& query_str) {
+      auto scan = [&](sqlite3* db, int64_t lo, int64_t hi) {
+	return ScanTopK(db,query_str,sorts,window.second,lo,hi);
+      };
+      std::vector<std::vector<std::string>> results;
+      if (!readers_) {
+	results.push_back(scan(db_handle_,INT64_MIN,INT64_MAX));
+	return results;
+      }
+      std::vector<std::future<std::vector<std::string>>> pending;
+      for (size_t ind = 0; ind < parts; ++ind) {
+	int64_t lo = (ind == 0)?INT64_MIN:static_cast<int64_t>(ind) * step;
+	int64_t hi = (ind + 1 == parts)?INT64_MAX:static_cast<int64_t>(ind + 1) * step;
+	pending.push_back(readers_->Submit([&scan,lo,hi](sqlite3* db) {
+	  return scan(db,lo,hi);
+	}));
+      }
+      for (auto& part : pending) {
+	results.push_back(part.get());
+      }
+      return results;
+    };
+
+    return TopKSortRowids(scan_parts,source,sorts,window,filter);
+  }
+
+  std::vector<std::string> ScanTopK(sqlite3* db, const std::string& query_str,
+				    const std::vector<std::pair<std::string,bool>>& sorts,
+				    size_t k, int64_t lo, int64_t hi) {
+    TopKHeap heap(k);
+    Statement query(db,query_str,"ScanTopK");
+    query.Bind(1,lo).Bind(2,hi);
+    std::string key;
+    while (query.Step()) {
+      key.clear();
+      AppendSortKey(key,query.get(),sorts);
+      heap.Offer(key);
+    }
+    return heap.Take();
+  }
+
+  std::vector<int64_t> TopKSortRowids(const std::function<std::vector<std::vector<std::string>>(const std::string&)>& scan_parts,
+				      const std::string& source,
+				      const std::vector<std::pair<std::string,bool>>& sorts,
+				      const std::pair<uint32_t,uint32_t> window,
+				      const std::string& filter) {
+    auto results = scan_parts(BuildSortScanQuery(source,sorts,true,filter));
+    //Every part keeps up to the whole window, so fewer keys in all means the cut left out too much
+    size_t kept = 0;
+    for (const auto& part : results) {
+      kept += part.size();
+    }
+    if (!filter.empty() && kept < window.second) {
+      results = scan_parts(BuildSortScanQuery(source,sorts,true));
+    }
+    return MergeTopK(std::move(results),window.second,window.first);
+  }
+
+  std::vector<int64_t> ExternalSortRowids(sqlite3* db, const std::string& source,
+					  const std::vector<std::pair<std::string,bool>>& sorts,
+					  const std::pair<uint32_t,uint32_t> window,
+					  std::string filter) {
+    while (true) {
+      auto query_str = BuildSortScanQuery(source,sorts,false,filter);
+      std::cerr << "Sort scan query:" << query_str << "\n";
+      Statement query(db,query_str,"ExternalSortRowids");
+      if (!query.Ok()) {
+	return std::vector<int64_t>();
+      }
+      ExternalSorter sorter(window.second,kSortMemoryBytes,std::thread::hardware_concurrency());
+      size_t passed = 0;
+      std::string key;
+      while (query.Step()) {
+	key.clear();
+	AppendSortKey(key,query.get(),sorts);
+	sorter.Add(key);
+	++passed;
+      }
+      if (filter.empty() || passed >= window.second) {
+	return sorter.Finish(window.first);
+      }
+      filter.clear();
+    }
+  }
+
+  //Authorization assumed
+  void CSVApp::DbDeleteTable(const std::string& table_name) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    for (const auto& rollup : RollupsOf(table_name)) {
+      DbDropTableObjects(rollup,DbTableSchema(rollup));
+      BumpGeneration(rollup);
+    }
+    DbInvalidateSchema(table_name);
+    DbDropTableObjects(table_name,DbTableSchema(table_name));
+    BumpGeneration(table_name);
+  }
+
+  //Caller holds the write lock
+  void CSVApp::DbDropTableObjects(const std::string& table_name, const std::string& schema) {
+    std::string drop_query_str = "DROP TABLE IF EXISTS " + schema + ".\"";
+    drop_query_str+=table_name;
+    drop_query_str+="\";";
+    std::string cleanup_query_str = "DELETE FROM main.Files WHERE name=\"";
+    cleanup_query_str+=table_name;
+    cleanup_query_str+="\";";
+
+    std::string drop_index_str = "DROP TABLE IF EXISTS " + schema + ".\"";
+    drop_index_str+=SearchIndexName(table_name);
+    drop_index_str+="\";";
+    std::string drop_view_str = "DROP VIEW IF EXISTS " + schema + ".\"";
+    drop_view_str+=DecodedViewName(table_name);
+    drop_view_str+="\";";
+
+    //A rollup's triggers sit on its source and would outlive it
+    if (IsRollup(table_name)) {
+      for (const char* event : {"ai","ad","au"}) {
+	TryExecSimpleQuery("DROP TRIGGER IF EXISTS " + schema + ".\"" + RollupTriggerName(table_name,event) + "\";");
+      }
+      Statement forget(db_handle_,"DELETE FROM main.Rollups WHERE name = ?;","DbDropTableObjects");
+      forget.Bind(1,table_name).Step();
+      std::lock_guard<std::mutex> lock(schema_mutex_);
+      rollup_sources_.erase(table_name);
+    }
+    {
+      Statement forget(db_handle_,"DELETE FROM main.ColumnStats WHERE table_name = ?;","DbDropTableObjects");
+      forget.Bind(1,table_name).Step();
+    }
+    TryExecSimpleQuery(drop_view_str);
+    for (const auto& col : DbQueryColListOfType(table_name,kDictColumnType,schema)) {
+      TryExecSimpleQuery("DROP TABLE IF EXISTS " + schema + ".\"" + DictionaryTableName(table_name,col) + "\";");
+    }
+    TryExecSimpleQuery(drop_query_str);
+    TryExecSimpleQuery(drop_index_str);
+    TryExecSimpleQuery(cleanup_query_str);
+    DbInvalidateSchema(table_name);
+  }
+
+  void CSVApp::HandleUpload(const httplib::Request& req,httplib::Response& res) {
+    std::vector<std::string> issue_list;
+
+    auto csv_name = req.files.find("csv_name")->second.content;
+    if (csv_name.empty()) {
+      issue_list.emplace_back("Empty name field, using filename as fallback.");
+      csv_name = req.files.find("csv_file")->second.filename;
+    }
+    // Toss away authorization for time being
+
+    auto& csv = req.files.find("csv_file")->second.content;
+    if (!SampleForCSV(csv)) {
+      issue_list.emplace_back("Invalid CSV. Aborted");
+      res.status = 400;
+      res.body = PackJSONArray(issue_list);
+      return;
+    }
+
+    //Opt-in full text index over the string columns
+    auto search_mode = NoSearch;
+    auto fts_it = req.files.find("fts");
+    if (fts_it != req.files.end() && !fts_it->second.content.empty()) {
+      const auto& fts = fts_it->second.content;
+      if (fts == "1" || fts == "words") {
+	search_mode = WordSearch;
+      }
+      else if (fts == "trigram") {
+	search_mode = TrigramSearch;
+      }
+      else {
+	issue_list.emplace_back("Unknown search index mode, no index built.");
+      }
+    }
+
+    //Declared columns replace type inference altogether
+    std::vector<ColumnSpec> declared;
+    auto schema_it = req.files.find("schema");
+    if (schema_it != req.files.end() && !schema_it->second.content.empty()) {
+      auto parsed = ParseUploadSchema(schema_it->second.content);
+      if (!parsed) {
+	issue_list.emplace_back("Invalid schema. Aborted");
+	res.status = 400;
+	res.body = PackJSONArray(issue_list);
+	return;
+      }
+      declared = std::move(*parsed);
+    }
+
+    //An existing table is only swapped out when asked for
+    auto replace_it = req.files.find("replace");
+    bool replace = (replace_it != req.files.end() && replace_it->second.content == "1");
+
+    //Async uploads answer right away with a job to poll, the rest wait for their pipeline
+    auto job = NewJob(csv_name);
+    auto async_it = req.files.find("async");
+    if (async_it != req.files.end() && async_it->second.content == "1") {
+      auto content = std::make_shared<const std::string>(csv);
+      ingest_.Submit([this,csv_name,content,search_mode,replace,declared,job]() {
+	DbUpload(csv_name,*content,',',search_mode,replace,declared,job);
+      });
+      auto status = PackIngestJob(job,*JobStatus(job));
+      status["issues"] = PackJSONArray(issue_list);
+      res.status = 202;
+      res.body = PackJSON(status);
+      return;
+    }
+
+    if (!DbUpload(csv_name,csv,',',search_mode,replace,declared,job)) {
+      auto status = JobStatus(job);
+      issue_list.emplace_back(status->message);
+      res.status = status->status;
+      res.body = PackJSONArray(issue_list);
+      return;
+    }
+    auto status = JobStatus(job);
+    if (status->rows_rejected > 0) {
+      issue_list.emplace_back(std::to_string(status->rows_rejected) + " of " + std::to_string(status->rows_total) +
+			      " rows violated the schema's constraints and were skipped.");
+    }
+    res.status = 200;
+    res.body = PackJSONArray(issue_list);
+  }
+
+  uint64_t CSVApp::NewJob(const std::string& table_name) {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    auto id = next_job_++;
+    jobs_[id].table = table_name;
+    //Ids only grow, so the oldest finished jobs sit at the front
+    for (auto it = jobs_.begin(); jobs_.size() > kIngestJobHistory && it != jobs_.end();) {
+      if (it->second.state == "done" || it->second.state == "failed") {
+	it = jobs_.erase(it);
+      }
+      else {
+	++it;
+      }
+    }
+    return id;
+  }
+
+  void CSVApp::SetJobState(uint64_t job, const std::string& state, const std::string& message) {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    auto it = jobs_.find(job);
+    if (it != jobs_.end()) {
+      it->second.state = state;
+      it->second.message = message;
+    }
+  }
+
+  void CSVApp::FailJob(uint64_t job, int status, const std::string& message) {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    auto it = jobs_.find(job);
+    if (it != jobs_.end()) {
+      it->second.state = "failed";
+      it->second.message = message;
+      it->second.status = status;
+    }
+  }
+
+  void CSVApp::SetJobIndexProgress(uint64_t job, size_t built, size_t total) {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    auto it = jobs_.find(job);
+    if (it != jobs_.end()) {
+      it->second.indexes_built = built;
+      it->second.indexes_total = total;
+    }
+  }
+
+  void CSVApp::SetJobProgress(uint64_t job, size_t loaded, size_t rejected, size_t total) {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    auto it = jobs_.find(job);
+    if (it != jobs_.end()) {
+      it->second.rows_loaded = loaded;
+      it->second.rows_rejected = rejected;
+      it->second.rows_total = total;
+    }
+  }
+
+  std::optional<IngestJob> CSVApp::JobStatus(uint64_t job) {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    auto it = jobs_.find(job);
+    if (it == jobs_.end()) {
+      return std::optional<IngestJob>();
+    }
+    return it->second;
+  }
+
+  void CSVApp::HandleUploadStatus(const httplib::Request& req, httplib::Response& res) {
+    auto job_it = req.params.find("job");
+    if (job_it == req.params.end() ||
+	job_it->second.empty() ||
+	std::count(job_it->second.begin(),job_it->second.end(),',') > 0 ||
+	DetectTypes(job_it->second)[0] != Types::Int) {
+      res.status = 400;
+      res.body = "Invalid job";
+      return;
+    }
+    auto job = std::strtoull(job_it->second.c_str(),nullptr,10);
+    auto status = JobStatus(job);
+    if (!status) {
+      res.status = 404;
+      res.body = "Unknown job";
+      return;
+    }
+    res.status = 200;
+    res.body = PackJSON(PackIngestJob(job,*status));
+  }
+
+  //Leave validation to handlers
+  //Native UPSERT on rowid, so neither the table size nor row existence has to be checked beforehand
+  int64_t CSVApp::DbUpdateRow(const std::string& name,
+			      const JSONDocument& row,
+			      uint32_t row_node,
+			      std::optional<int64_t> at_row) {
+    std::vector<std::string> cols;
+    for (uint32_t ind = row.FirstChild(row_node); ind < row[row_node].end; ind = row.Next(row.Next(ind))) {
+      cols.emplace_back(row[ind].text);
+    }
+    auto schema = DbTableSchema(name);
+    auto query_str = BuildUpsertQuery(name,cols,schema);
+    auto coded = DbQueryColListOfType(name,kDictColumnType,schema);
+    int64_t rowid = -1;
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    sqlite3_stmt *query;
+    if (sqlite3_prepare_v2(db_handle_,
+			   query_str.c_str(),
+			   query_str.length() + 1,
+			   &query,
+			   nullptr) != SQLITE_OK) {
+      std::cerr << "In DbUpdateRow::prepare\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    if (at_row) {
+      sqlite3_bind_int64(query,1,*at_row);
+    }
+    else {
+      sqlite3_bind_null(query,1);
+    }
+    int bind_ind = 2;
+    for (uint32_t ind = row.FirstChild(row_node); ind < row[row_node].end; ind = row.Next(row.Next(ind))) {
+      bool is_coded = std::find(coded.begin(),coded.end(),row[ind].text) != coded.end();
+      BindJSONValue(query,bind_ind++,row[row.Next(ind)],is_coded);
+    }
+    if (sqlite3_step(query) == SQLITE_DONE) {
+      rowid = at_row?*at_row:sqlite3_last_insert_rowid(db_handle_);
+      BumpGeneration(name);
+    }
+    else {
+      std::cerr << "In DbUpdateRow::step\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    if (sqlite3_finalize(query) != SQLITE_OK) {
+      std::cerr << "In DbUpdateRow::finalize\n";
+      std::cerr << sqlite3_errmsg(db_handle_);
+      std::cerr << "\n";
+    }
+    return rowid;
+  }
+
+  //Validation happens up front against the cached schema, so the transaction only ever sees sane ops
+  //Statements are prepared once per distinct column set and reused for the whole batch
+  std::optional<std::vector<std::string>> CSVApp::DbApplyBatch(const std::string& name,
+							       const std::vector<std::string>& cols,
+							       const BatchOps& batch,
+							       bool atomic,
+							       bool& commit_failed) {
+    const auto& doc = batch.doc;
+    const auto& ops = batch.ops;
+    std::vector<JSONData> results(ops.size());
+    std::vector<std::vector<std::string>> op_cols(ops.size());
+    std::vector<std::vector<uint32_t>> op_vals(ops.size());
+    std::vector<std::optional<int64_t>> op_rowids(ops.size());
+    std::vector<bool> is_delete(ops.size(),false);
+    for (size_t ind = 0; ind < ops.size(); ++ind) {
+      auto& result = results[ind];
+      result["op"] = std::to_string(ind);
+      for (uint32_t key = doc.FirstChild(ops[ind]); key < doc[ops[ind]].end; key = doc.Next(doc.Next(key))) {
+	const auto& val = doc[doc.Next(key)];
+	if (doc[key].text == "_op") {
+	  if (val.kind == JSONValue::String && val.text == "delete") {
+	    is_delete[ind] = true;
+	  }
+	  else if (val.kind != JSONValue::String || val.text != "upsert") {
+	    result["status"] = "error";
+	    result["message"] = "Unknown operation";
+	  }
+	}
+	else if (doc[key].text == "_rowid") {
+	  //Quoted rowids are still accepted, that is what the flat parser used to require
+	  int64_t rowid = val.int_val;
+	  bool valid = (val.kind == JSONValue::Int);
+	  if (val.kind == JSONValue::String && !val.text.empty()) {
+	    auto [ptr,ec] = std::from_chars(val.text.data(),val.text.data() + val.text.length(),rowid);
+	    valid = (ec == std::errc() && ptr == val.text.data() + val.text.length());
+	  }
+	  if (valid) {
+	    op_rowids[ind] = rowid;
+	  }
+	  else {
+	    result["status"] = "error";
+	    result["message"] = "Incorrect row placement";
+	  }
+	}
+	else if (std::find(cols.begin(),cols.end(),doc[key].text) == cols.end()) {
+	  result["status"] = "error";
+	  result["message"] = "Invalid column name";
+	}
+	else {
+	  op_cols[ind].emplace_back(doc[key].text);
+	  op_vals[ind].push_back(doc.Next(key));
+	}
+      }
+      if (result.find("status") == result.end()) {
+	if (is_delete[ind] && !op_rowids[ind]) {
+	  result["status"] = "error";
+	  result["message"] = "Incorrect row placement";
+	}
+	else if (!is_delete[ind] && !op_rowids[ind] && op_cols[ind].empty()) {
+	  result["status"] = "error";
+	  result["message"] = "No row data available";
+	}
+      }
+    }
+
+    auto schema = DbTableSchema(name);
+    auto coded = DbQueryColListOfType(name,kDictColumnType,schema);
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    //Outside of a transaction every operation would commit on its own, atomic or not
+    if (!TryExecSimpleQuery("BEGIN IMMEDIATE;")) {
+      return std::nullopt;
+    }
+    std::map<std::string,sqlite3_stmt*> stmts;
+    size_t failed = 0;
+    for (size_t ind = 0; ind < ops.size(); ++ind) {
+      auto& result = results[ind];
+      if (result.find("status") != result.end()) {
+	++failed;
+	continue;
+      }
+      auto query_str = is_delete[ind]?BuildDeleteQuery(name,schema):BuildUpsertQuery(name,op_cols[ind],schema);
+      auto stmt_it = stmts.find(query_str);
+      if (stmt_it == stmts.end()) {
+	sqlite3_stmt *stmt = nullptr;
+	if (sqlite3_prepare_v2(db_handle_,
+			       query_str.c_str(),
+			       query_str.length() + 1,
+			       &stmt,
+			       nullptr) != SQLITE_OK) {
+	  std::cerr << "In DbApplyBatch::prepare\n";
+	  std::cerr << sqlite3_errmsg(db_handle_);
+	  std::cerr << "\n";
+	}
+	stmt_it = stmts.emplace(query_str,stmt).first;
+      }
+      auto stmt = stmt_it->second;
+      if (stmt == nullptr) {
+	result["status"] = "error";
+	result["message"] = "Statement preparation failed";
+	++failed;
+	continue;
+      }
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      if (op_rowids[ind]) {
+	sqlite3_bind_int64(stmt,1,*op_rowids[ind]);
+      }
+      else {
+	sqlite3_bind_null(stmt,1);
+      }
+      for (size_t col_ind = 0; col_ind < op_vals[ind].size(); ++col_ind) {
+	bool is_coded = std::find(coded.begin(),coded.end(),op_cols[ind][col_ind]) != coded.end();
+	BindJSONValue(stmt,col_ind + 2,doc[op_vals[ind][col_ind]],is_coded);
+      }
+      if (sqlite3_step(stmt) != SQLITE_DONE) {
+	result["status"] = "error";
+	result["message"] = sqlite3_errmsg(db_handle_);
+	++failed;
+      }
+      else if (is_delete[ind]) {
+	result["status"] = (sqlite3_changes(db_handle_) > 0)?"ok":"not_found";
+      }
+      else {
+	result["status"] = "ok";
+	result["rowid"] = std::to_string(op_rowids[ind]?*op_rowids[ind]:sqlite3_last_insert_rowid(db_handle_));
+      }
+    }
+    for (auto& stmt : stmts) {
+      if (stmt.second != nullptr && sqlite3_finalize(stmt.second) != SQLITE_OK) {
+	std::cerr << "In DbApplyBatch::finalize\n";
+	std::cerr << sqlite3_errmsg(db_handle_);
+	std::cerr << "\n";
+      }
+    }
+    //A reader's lock can hold off the commit, then nothing of the batch is applied either
+    bool rolled_back = (atomic && failed > 0);
+    commit_failed = !rolled_back && !TryExecSimpleQuery("COMMIT;");
+    if (rolled_back || commit_failed) {
+      TryExecSimpleQuery("ROLLBACK;");
+      for (auto& result : results) {
+	if (result["status"] != "error") {
+	  result["status"] = "rolled_back";
+	  result.erase("rowid");
+	}
+      }
+    }
+    if (!rolled_back && !commit_failed) {
+      BumpGeneration(name);
+    }
+
+    std::vector<std::string> packed;
+    packed.reserve(results.size());
+    for (const auto& result : results) {
+      packed.push_back(PackJSON(result));
+    }
+    return packed;
+  }
+
+  void CSVApp::HandleListing(const httplib::Request& req,httplib::Response& res) {
+    res.status = 200;
+    res.body = PackJSON(DbQueryList());
+  }
+
+  namespace {
+    struct SampleRequest {
+      size_t rows = 0;
+      uint64_t seed = 0;
+      bool seeded = false;
+    };
+
+    //sample and seed params, without a seed every request draws a new sample
+    SampleRequest SampleParams(const httplib::Request& req, std::vector<std::string>& issue_list) {
+      SampleRequest sample;
+      auto number = [&req,&issue_list](const char* key) -> std::optional<uint64_t> {
+	auto it = req.params.find(key);
+	if (it == req.params.end() || it->second.empty()) {
+	  return std::nullopt;
+	}
+	uint64_t val = 0;
+	auto [end, ec] = std::from_chars(it->second.data(),it->second.data() + it->second.size(),val);
+	if (ec != std::errc() || end != it->second.data() + it->second.size()) {
+	  issue_list.emplace_back(std::string("Invalid ") + key);
+	  return std::nullopt;
+	}
+	return val;
+      };
+      if (auto rows = number("sample")) {
+	sample.rows = std::min<uint64_t>(*rows,kMaxSampleRows);
+	if (*rows > kMaxSampleRows) {
+	  issue_list.emplace_back("Sample size capped");
+	}
+      }
+      if (auto seed = number("seed")) {
+	sample.seed = *seed;
+	sample.seeded = true;
+      }
+      else {
+	sample.seed = std::random_device{}();
+      }
+      return sample;
+    }
+  }
+
+  void CSVApp::HandleTableQuery(const httplib::Request& req,httplib::Response& res) {
+    //Uses a whole lot of params
+    //First: column numbers to display
+    auto col_its = req.params.equal_range("col");
+    //Second: column numbers that must be ordered by ascension
+    auto asc_its = req.params.equal_range("asc");
+    //Third: --//-- by descension
+    auto desc_its = req.params.equal_range("desc");
+    //Fourth: I kinda forgot about it, but the actual name of the table.
+    auto name_it = req.params.find("name");
+
+    //Now, a whole lotta checks
+    RequestArena arena;
+    std::vector<std::string> issue_list;
+
+    //First step, table name verification
+    //As bonus points, identification of columns we need to deal with
+    auto col_list_opt = (name_it != req.params.end())?
+      DbCachedColList(name_it->second):std::optional<std::vector<std::string>>();
+    if (!col_list_opt) {
+      res.status = 400;
+      res.body = "Can't find the named table";
+      return;
+    }
+    const auto& name = name_it->second;
+    const auto& col_list = *col_list_opt;
+    //Second step, throw out invalid col,asc,desc numbers
+    auto param_to_vec = [&issue_list,&arena](decltype(asc_its) its) {
+      std::pmr::vector<uint32_t> inds(arena.get());
+      for (auto it = its.first;it != its.second; ++it) {
+	if(DetectTypes(it->second)[0] == Types::Int) {
+	  inds.push_back(std::atoi(it->second.c_str()));
+	}
+	else {
+	  issue_list.emplace_back("Invalid indexing");
+	}
+      }
+      return inds;
+    };
+
+    auto col_inds = param_to_vec(col_its);
+    //Only checked here, sorts are read off the request target below to keep their order
+    param_to_vec(asc_its);
+    param_to_vec(desc_its);
+
+    std::vector<std::string> col_names;
+    for(const auto& ind : col_inds) {
+      if (ind >= col_list.size()) {
+	issue_list.emplace_back("A column index out of bounds");
+      }
+      else {
+	col_names.push_back(col_list[ind]);
+      }
+    }
+    //Sort priority is the order asc and desc come in, a column sorts by its first mention only
+    std::vector<std::pair<std::string,bool>> sort_names;
+    for (const auto& [param, asc] : OrderedSortParams(req.target)) {
+      if (DetectTypes(param)[0] != Types::Int) {
+	continue;
+      }
+      auto ind = static_cast<uint32_t>(std::atoi(param.c_str()));
+      if (ind >= col_list.size()) {
+	issue_list.emplace_back("A column index out of bounds");
+      }
+      else if (std::find_if(sort_names.begin(),sort_names.end(),
+			    [&](const auto& sort) { return sort.first == col_list[ind]; }) == sort_names.end()) {
+	sort_names.emplace_back(col_list[ind],asc);
+      }
+    }
+    //At last, validate row limits
+    //Fifth: the row range
+    auto row_param = [&req,&issue_list](const char* key, uint32_t fallback) {
+      auto it = req.params.find(key);
+      if (it == req.params.end() || it->second.empty()) {
+	return fallback;
+      }
+      if (std::count(it->second.begin(),it->second.end(),',') > 0 ||
+	  DetectTypes(it->second)[0] != Types::Int) {
+	issue_list.emplace_back("Invalid row limit");
+	return fallback;
+      }
+      return static_cast<uint32_t>(std::atoi(it->second.c_str()));
+    };
+    uint32_t from = row_param("from",0);
+    uint32_t to = row_param("to",100);
+    //sample=n gives n random probes instead of a window, a seed makes the sample repeatable
+    auto [sample, seed, seeded] = SampleParams(req,issue_list);
+    if (sample > 0 && !seeded) {
+      auto table = DbQueryTable(name,col_names,{},{0,0},sample,seed);
+      table["issues"] = PackJSONArray(issue_list);
+      res.status = 200;
+      res.body = PackJSON(table);
+      return;
+    }
+
+    //Identical polls are answered from the cache, the generation retires entries once the table is written to
+    //The ETag depends on the request, generation and epoch only, so revalidation doesn't even need the cache
+    auto cache_key = BuildViewCacheKey(name,col_names,sort_names,{from,to},issue_list);
+    if (sample > 0) {
+      cache_key += "\x1fsample\x1f";
+      AppendNumber(cache_key,sample);
+      cache_key += '\x1f';
+      AppendNumber(cache_key,seed);
+    }
+    cache_key += '\x1f';
+    AppendNumber(cache_key,TableGeneration(name));
+    char etag[24];
+    std::snprintf(etag,sizeof(etag),"\"%016llx\"",
+		  static_cast<unsigned long long>(HashKey(cache_key) ^ epoch_));
+    res.set_header("ETag",etag);
+    res.set_header("Cache-Control","no-cache");
+    if (ETagMatches(req.get_header_value("If-None-Match"),etag)) {
+      res.status = 304;
+      return;
+    }
+    if (auto cached = view_cache_.Get(cache_key)) {
+      res.set_header("X-Cache","HIT");
+      res.status = 200;
+      res.body = *cached;
+      return;
+    }
+
+    //With all that done, let us now build the proper query
+    auto table = DbQueryTable(name,col_names,sort_names,{from,to},sample,seed);
+    table["issues"] = PackJSONArray(issue_list);
+    auto body = std::make_shared<const std::string>(PackJSON(table));
+    view_cache_.Put(cache_key,body);
+    res.set_header("X-Cache","MISS");
+    res.status = 200;
+    res.body = *body;
+  }
+
+  void CSVApp::HandleTableUpdate(const httplib::Request& req, httplib::Response& res) {
+    auto name_it = req.params.find("name");
+    auto rowid_it = req.params.find("rowid");
+    auto rowdata = req.files.find("row_desc");
+
+    auto col_list = (name_it != req.params.end())?
+      DbCachedColList(name_it->second):std::optional<std::vector<std::string>>();
+    if (!col_list) {
+      res.status = 400;
+      res.body = "Can't find the named table";
+      return;
+    }
+    if (IsRollup(name_it->second)) {
+      res.status = 400;
+      res.body = "Rollups are read only";
+      return;
+    }
+
+    if (rowid_it == req.params.end() ||
+	rowid_it->second.empty() ||
+	std::count(rowid_it->second.begin(),rowid_it->second.end(),',') > 0 ||
+	DetectTypes(rowid_it->second)[0] != Types::Int) {
+      res.status = 400;
+      res.body = "Incorrect row placement";
+      return;
+    }
+
+    if (rowdata == req.files.end()) {
+      res.status = 400;
+      res.body = "No row data available";
+      return;
+    }
+
+    auto data = ParseJSON(rowdata->second.content);
+    if (!data || (*data)[0].kind != JSONValue::Object) {
+      res.status = 400;
+      res.body = "Invalid JSON input";
+      return;
+    }
+
+    //Validate column names.
+    //Types are left to SQLite, values are bound as whatever JSON type they came in
+    //General TODO: Make the DB operations at least Monadic, then backpropagating their errors will be way easier
+    for (uint32_t ind = data->FirstChild(0); ind < (*data)[0].end; ind = data->Next(data->Next(ind))) {
+      if (std::find(col_list->begin(),col_list->end(),(*data)[ind].text) == col_list->end()) {
+	res.status = 400;
+	res.body = "Invalid column name";
+	return;
+      }
+    }
+
+    //Updates the row if it exists and inserts it under the requested rowid otherwise
+    auto rowid = DbUpdateRow(name_it->second,*data,0,std::strtoll(rowid_it->second.c_str(),nullptr,10));
+    if (rowid < 0) {
+      res.status = 500;
+      res.body = "Row upsert failed";
+      return;
+    }
+    res.status = 200;
+    res.body = "Attempted row upsert";
+  }
+
+  void CSVApp::HandleBatch(const httplib::Request& req, httplib::Response& res) {
+    auto name_it = req.params.find("name");
+    auto cols = (name_it != req.params.end())?
+      DbCachedColList(name_it->second):std::optional<std::vector<std::string>>();
+    if (!cols) {
+      res.status = 400;
+      res.body = "Can't find the named table";
+      return;
+    }
+    if (IsRollup(name_it->second)) {
+      res.status = 400;
+      res.body = "Rollups are read only";
+      return;
+    }
+
+    //Either a raw JSON/NDJSON body or a form file, whichever the client finds handier
+    auto ops_it = req.files.find("ops");
+    const auto& body = (ops_it != req.files.end())?ops_it->second.content:req.body;
+    auto ops = ParseBatchOps(body);
+    if (!ops) {
+      res.status = 400;
+      res.body = "Invalid JSON input";
+      return;
+    }
+
+    auto atomic_it = req.params.find("atomic");
+    bool atomic = (atomic_it != req.params.end() && atomic_it->second == "1");
+    bool commit_failed = false;
+    auto results = DbApplyBatch(name_it->second,*cols,*ops,atomic,commit_failed);
+    if (!results) {
+      res.status = 500;
+      res.body = "Batch transaction failed";
+      return;
+    }
+    //An atomic batch rolled back for its own failed operations is still answered with 200
+    res.status = commit_failed?500:200;
+    res.body = PackJSONArray(*results);
+  }
+
+  void CSVApp::HandleSearch(const httplib::Request& req, httplib::Response& res) {
+    auto name_it = req.params.find("name");
+    auto query_it = req.params.find("q");
+    if (name_it == req.params.end() || !DbCachedColList(name_it->second)) {
+      res.status = 400;
+      res.body = "Can't find the named table";
+      return;
+    }
+    if (!DbHasSearchIndex(name_it->second)) {
+      res.status = 400;
+      res.body = "Table has no search index";
+      return;
+    }
+    if (query_it == req.params.end() || query_it->second.empty()) {
+      res.status = 400;
+      res.body = "Empty search query";
+      return;
+    }
+
+    std::vector<std::string> issue_list;
+    auto row_param = [&req,&issue_list](const char* key, uint32_t fallback) {
+      auto it = req.params.find(key);
+      if (it == req.params.end() || it->second.empty()) {
+	return fallback;
+      }
+      if (std::count(it->second.begin(),it->second.end(),',') > 0 ||
+	  DetectTypes(it->second)[0] != Types::Int) {
+	issue_list.emplace_back("Invalid row limit");
+	return fallback;
+      }
+      return static_cast<uint32_t>(std::atoi(it->second.c_str()));
+    };
+    uint32_t from = row_param("from",0);
+    uint32_t to = row_param("to",from + 100);
+
+    //By default the text is searched for as is, raw=1 passes FTS5 query syntax through
+    auto raw_it = req.params.find("raw");
+    bool raw = (raw_it != req.params.end() && raw_it->second == "1");
+    auto match = raw?query_it->second:QuoteSearchPhrase(query_it->second);
+
+    auto result = DbSearchTable(name_it->second,match,{from,to});
+    if (!result) {
+      res.status = 400;
+      res.body = "Invalid search query";
+      return;
+    }
+    (*result)["issues"] = PackJSONArray(issue_list);
+    res.status = 200;
+    res.body = PackJSON(*result);
+  }
+
+  void CSVApp::HandleAggregate(const httplib::Request& req, httplib::Response& res) {
+    auto name_it = req.params.find("name");
+    auto col_list = (name_it != req.params.end())?
+      DbCachedColList(name_it->second):std::optional<std::vector<std::string>>();
+    if (!col_list) {
+      res.status = 400;
+      res.body = "Can't find the named table";
+      return;
+    }
+    auto op_it = req.params.find("op");
+    auto op = (op_it == req.params.end())?AggregateOp::Count:ParseAggregateOp(op_it->second);
+    if (!op) {
+      res.status = 400;
+      res.body = "Unknown aggregate";
+      return;
+    }
+
+    //Columns by their index, as in /view
+    bool bad_col = false;
+    auto col_param = [&](const char* key) {
+      auto it = req.params.find(key);
+      if (it == req.params.end() || it->second.empty()) {
+	return std::string();
+      }
+      if (DetectTypes(it->second)[0] != Types::Int ||
+	  static_cast<size_t>(std::atoi(it->second.c_str())) >= col_list->size()) {
+	bad_col = true;
+	return std::string();
+      }
+      return (*col_list)[std::atoi(it->second.c_str())];
+    };
+    auto value_col = col_param("col");
+    auto group_col = col_param("group");
+    if (bad_col) {
+      res.status = 400;
+      res.body = "A column index out of bounds";
+      return;
+    }
+    if (value_col.empty() && *op != AggregateOp::Count) {
+      res.status = 400;
+      res.body = "Aggregate needs a column";
+      return;
+    }
+
+    std::vector<std::string> issue_list;
+    auto sample = SampleParams(req,issue_list);
+    auto result = DbAggregate(name_it->second,*op,value_col,group_col,sample.rows,sample.seed);
+    if (std::stoul(result["group_count"]) > kMaxAggregateGroups) {
+      issue_list.emplace_back("Too many groups, only the first ones are shown");
+    }
+    result["issues"] = PackJSONArray(issue_list);
+    res.status = 200;
+    res.body = PackJSON(result);
+  }
+
+  void CSVApp::HandleRollup(const httplib::Request& req, httplib::Response& res) {
+    //Either a raw JSON body or a form file, as with /batch
+    auto def_it = req.files.find("definition");
+    const auto& body = (def_it != req.files.end())?def_it->second.content:req.body;
+    auto spec = ParseRollupSpec(body);
+    if (!spec) {
+      res.status = 400;
+      res.body = "Invalid rollup definition";
+      return;
+    }
+    auto cols = DbCachedColList(spec->source);
+    if (!cols) {
+      res.status = 400;
+      res.body = "Can't find the named table";
+      return;
+    }
+    if (IsRollup(spec->source)) {
+      res.status = 400;
+      res.body = "Rollups can't be built over rollups";
+      return;
+    }
+    if (DbCachedColList(spec->name)) {
+      res.status = 409;
+      res.body = "Table already exists";
+      return;
+    }
+    auto known = [&cols](const std::string& col) {
+      return std::find(cols->begin(),cols->end(),col) != cols->end();
+    };
+    bool all_known = std::all_of(spec->group.begin(),spec->group.end(),known) &&
+      std::all_of(spec->aggregates.begin(),spec->aggregates.end(),known) &&
+      std::all_of(spec->where.begin(),spec->where.end(),[&known](const auto& cond) { return known(cond.first); });
+    if (!all_known) {
+      res.status = 400;
+      res.body = "Unknown column";
+      return;
+    }
+    bool commit_failed = false;
+    if (!DbCreateRollup(*spec,body,commit_failed)) {
+      res.status = commit_failed?500:400;
+      res.body = commit_failed?"Rollup could not be committed":"Rollup could not be built";
+      return;
+    }
+    JSONData result;
+    result["rollup"] = spec->name;
+    AppendNumber(result["groups"],DbQueryTableSize(spec->name));
+    result["issues"] = PackJSONArray(std::vector<std::string>());
+    res.status = 200;
+    res.body = PackJSON(result);
+  }
+
+  void CSVApp::HandleGet(const httplib::Request& req, httplib::Response& res) {
+    auto name_it = req.params.find("name");
+    auto cols = (name_it != req.params.end())?
+      DbCachedColList(name_it->second):std::optional<std::vector<std::string>>();
+    if (!cols) {
+      res.status = 400;
+      res.body = "Can't find the named table";
+      return;
+    }
+
+    //Any column can be looked up by, the declared key is the default
+    auto col_it = req.params.find("col");
+    std::string col;
+    if (col_it != req.params.end() && !col_it->second.empty()) {
+      col = col_it->second;
+    }
+    else {
+      col = DbKeyColumn(name_it->second).value_or(std::string());
+    }
+    if (std::find(cols->begin(),cols->end(),col) == cols->end()) {
+      res.status = 400;
+      res.body = "No such lookup column";
+      return;
+    }
+
+    //key parameters for a few keys, a JSON array body for many
+    std::vector<std::string> keys;
+    auto key_its = req.params.equal_range("key");
+    for (auto it = key_its.first; it != key_its.second; ++it) {
+      keys.push_back(it->second);
+    }
+    if (req.method == "POST") {
+      auto parsed = ParseKeyList(req.body);
+      if (!parsed) {
+	res.status = 400;
+	res.body = "Invalid JSON input";
+	return;
+      }
+      keys.insert(keys.end(),parsed->begin(),parsed->end());
+    }
+
+    res.status = 200;
+    res.body = PackJSON(DbLookupRows(name_it->second,col,keys));
+  }
+
+  TaskClass RouteClass(std::string_view request_line) {
+    auto start = request_line.find(' ');
+    if (start == std::string_view::npos) {
+      return TaskClass::Interactive;
+    }
+    auto path = request_line.substr(start + 1);
+    path = path.substr(0,std::min(path.find(' '),path.find('?')));
+    if (path == "/upload" || path == "/rollup") {
+      return TaskClass::Bulk;
+    }
+    if (path == "/update" || path == "/batch" || path == "/delete") {
+      return TaskClass::Update;
+    }
+    return TaskClass::Interactive;
+  }
 
-    if (sqlite3_finalize(query) != SQLITE_OK) {
-      std::cerr << "In DbQueryTable::finalize\n";
-      std::cerr << sqlite3_errmsg(db_handle_);
-      std::cerr << "\n";
+  bool SetAdmissionOption(AdmissionConfig& config, const std::string& key, const std::string& value) {
+    int64_t num = 0;
+    auto as_int = [&value,&num]() {
+      auto res = std::from_chars(value.data(),value.data() + value.length(),num);
+      return res.ec == std::errc() && res.ptr == value.data() + value.length() && num >= 0;
+    };
+    double rate = 0;
+    auto as_rate = [&value,&rate]() {
+      char* end = nullptr;
+      rate = std::strtod(value.c_str(),&end);
+      return !value.empty() && end == value.c_str() + value.length() && rate >= 0 && std::isfinite(rate);
+    };
+    static const char* queues[kTaskClasses] = {"interactive_queue","update_queue","bulk_queue"};
+    auto queue = std::find(std::begin(queues),std::end(queues),key);
+    if (queue != std::end(queues) && as_int()) {
+      config.queue_limits[queue - std::begin(queues)] = num;
     }
-    table["contents"] = PackJSONArray(rows_json);
-    return table;
+    else if (key == "target_delay_ms" && as_int() && num <= 60000) {
+      config.target_delay_ms = num;
+    }
+    else if (key == "interval_ms" && as_int() && num > 0 && num <= 60000) {
+      config.interval_ms = num;
+    }
+    else if (key == "ip_rate" && as_rate()) {
+      config.ip_rate = rate;
+    }
+    else if (key == "ip_burst" && as_rate() && rate >= 1) {
+      config.ip_burst = rate;
+    }
+    else {
+      return false;
+    }
+    return true;
   }
 
-  uint32_t CSVApp::DbQueryTableSize(const std::string& table_name) {
-    std::string query_str = "SELECT count(*) FROM main.\"" + table_name + "\";";
-    uint32_t result = 0;
-    sqlite3_stmt *query;
+  std::string BuildRejectResponse(int status, int retry_after_sec, std::string_view message) {
+    std::string response = "HTTP/1.1 " + std::to_string(status) + " " + httplib::detail::status_message(status) + "\r\n";
+    response += "Content-Type: text/plain\r\n";
+    response += "Content-Length: " + std::to_string(message.size()) + "\r\n";
+    response += "Retry-After: " + std::to_string(retry_after_sec) + "\r\n\r\n";
+    response += message;
+    return response;
+  }
 
-    if (sqlite3_prepare_v2(db_handle_,
-			   query_str.c_str(),
-			   query_str.length() + 1,
-			   &query,
-			   nullptr) != SQLITE_OK) {
-      std::cerr << "Query:" << query_str << "\n";
-      std::cerr << sqlite3_errmsg(db_handle_) << "\n";
+  RateLimiter::RateLimiter(double rate, double burst) : rate_(rate), burst_(std::max(burst,1.0)) {}
+
+  double RateLimiter::Take(const std::string& key, std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buckets_.size() >= kRateLimiterMaxBuckets) {
+      //A full bucket is no different from a missing one
+      for (auto it = buckets_.begin(); it != buckets_.end();) {
+	std::chrono::duration<double> idle = now - it->second.updated;
+	it = (it->second.tokens + idle.count() * rate_ >= burst_)?buckets_.erase(it):std::next(it);
+      }
     }
-    if (sqlite3_step(query) == SQLITE_ROW) {
-      result = static_cast<uint32_t>(sqlite3_column_int(query,0));
+    auto [it,fresh] = buckets_.try_emplace(key,Bucket {burst_,now});
+    auto& bucket = it->second;
+    if (!fresh) {
+      std::chrono::duration<double> elapsed = now - bucket.updated;
+      bucket.tokens = std::min(burst_,bucket.tokens + std::max(elapsed.count(),0.0) * rate_);
+      bucket.updated = now;
     }
-    else {
-      std::cerr << sqlite3_errmsg(db_handle_) << "\n";
+    if (bucket.tokens >= 1) {
+      bucket.tokens -= 1;
+      return 0;
     }
+    return (1 - bucket.tokens) / rate_;
+  }
 
-    if (sqlite3_finalize(query) != SQLITE_OK) {
-      std::cerr << sqlite3_errmsg(db_handle_) << "\n";
+  std::array<size_t,kTaskClasses> DefaultClassLimits(size_t threads) {
+    threads = std::max<size_t>(threads,1);
+    return {threads,std::max<size_t>(threads / 2,1),std::max<size_t>(threads / 4,1)};
+  }
+
+  namespace {
+    //Lets a task submitted from a worker go onto that worker's own deques
+    thread_local const PriorityExecutor* current_executor = nullptr;
+    thread_local size_t current_worker = 0;
+  }
+
+  PriorityExecutor::PriorityExecutor(size_t threads, std::array<size_t,kTaskClasses> limits, AdmissionConfig admission)
+    : limits_(limits), admission_(admission) {
+    threads = std::max<size_t>(threads,1);
+    for (size_t ind = 0; ind < threads; ++ind) {
+      workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t ind = 0; ind < threads; ++ind) {
+      workers_[ind]->thread = std::thread([this,ind]() { WorkerLoop(ind); });
     }
-    
-    return result;
   }
 
-  //Authorization assumed
-  void CSVApp::DbDeleteTable(const std::string& table_name) {
-    std::string drop_query_str = "DROP TABLE IF EXISTS main.\"";
-    drop_query_str+=table_name;
-    drop_query_str+="\";";
-    std::string cleanup_query_str = "DELETE FROM main.Files WHERE name=\"";
-    cleanup_query_str+=table_name;
-    cleanup_query_str+="\";";
+  PriorityExecutor::~PriorityExecutor() {
+    shutdown();
+  }
 
-    TryExecSimpleQuery(drop_query_str);
-    TryExecSimpleQuery(cleanup_query_str);
+  void PriorityExecutor::enqueue(std::function<void()> fn) {
+    Enqueue(std::move(fn),TaskClass::Interactive);
   }
 
-  void CSVApp::HandleUpload(const httplib::Request& req,httplib::Response& res) {
-    std::vector<std::string> issue_list;
+  void PriorityExecutor::Enqueue(std::function<void()> fn, TaskClass task_class) {
+    auto cls = static_cast<size_t>(task_class);
+    size_t target = (current_executor == this)?current_worker:(next_++ % workers_.size());
+    {
+      std::lock_guard<std::mutex> lock(workers_[target]->mutex);
+      workers_[target]->queues[cls].push_back({std::move(fn),std::chrono::steady_clock::now()});
+    }
+    ++queued_[cls];
+    Signal();
+  }
 
-    auto csv_name = req.files.find("csv_name")->second.content;
-    if (csv_name.empty()) {
-      issue_list.emplace_back("Empty name field, using filename as fallback.");
-      csv_name = req.files.find("csv_file")->second.filename;
+  Admission PriorityExecutor::Admit(TaskClass task_class) {
+    auto cls = static_cast<size_t>(task_class);
+    if (queued_[cls] == 0) {
+      //No standing queue left, whatever was shed for has drained
+      shedding_[cls] = false;
+      above_until_us_[cls] = 0;
+      return Admission::Admitted;
     }
-    // Toss away authorization for time being
+    if (admission_.queue_limits[cls] && queued_[cls] >= admission_.queue_limits[cls]) {
+      ++rejected_[cls];
+      return Admission::QueueFull;
+    }
+    if (shedding_[cls]) {
+      ++rejected_[cls];
+      return Admission::Overloaded;
+    }
+    return Admission::Admitted;
+  }
 
-    auto& csv = req.files.find("csv_file")->second.content;
-    if (!SampleForCSV(csv)) {
-      issue_list.emplace_back("Invalid CSV. Aborted");
-      res.status = 400;
-      res.body = PackJSONArray(issue_list);
+  int PriorityExecutor::RetryAfterSec() const {
+    return std::max<int>(1,(admission_.interval_ms + 999) / 1000);
+  }
+
+  void PriorityExecutor::TrackDelay(size_t cls, std::chrono::steady_clock::time_point now, uint64_t wait_us) {
+    if (admission_.target_delay_ms == 0 || wait_us < admission_.target_delay_ms * uint64_t {1000}) {
+      above_until_us_[cls] = 0;
+      shedding_[cls] = false;
+      return;
+    }
+    int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+    int64_t until = above_until_us_[cls];
+    if (until == 0) {
+      above_until_us_[cls].compare_exchange_strong(until,now_us + admission_.interval_ms * int64_t {1000});
     }
+    else if (now_us >= until) {
+      shedding_[cls] = true;
+    }
+  }
 
-    DbUpload(csv_name,csv);
-    res.status = 200;
-    res.body = PackJSONArray(issue_list);
+  void PriorityExecutor::Signal() {
+    {
+      std::lock_guard<std::mutex> lock(signal_mutex_);
+      ++signal_;
+    }
+    wake_.notify_one();
   }
 
-  //Leave validation to handlers
-  void CSVApp::DbAppendRow(const std::string& name,
-			   const JSONData& row) {
-    std::string col_names {"("},col_values {"VALUES ("},query_str {"INSERT INTO main.\""};
-    for (auto it = row.begin(); it != row.end(); ++it) {
-      bool last = (std::distance(it,row.end()) == 1);
-      col_names += it->first;
-      col_values += it->second;
-      if (last) {
-	col_names += ")";
-	col_values += ");";
+  bool PriorityExecutor::TryRun(size_t self) {
+    for (size_t cls = 0; cls < kTaskClasses; ++cls) {
+      if (queued_[cls] == 0) {
+	continue;
       }
-      else {
-	col_names += ",";
-	col_values += ",";
+      //A running slot is taken before looking for work, so the limit holds under contention
+      if (running_[cls].fetch_add(1) >= limits_[cls]) {
+	--running_[cls];
+	continue;
+      }
+      std::optional<Task> task;
+      for (size_t step = 0; step < workers_.size() && !task; ++step) {
+	auto& worker = *workers_[(self + step) % workers_.size()];
+	std::lock_guard<std::mutex> lock(worker.mutex);
+	auto& queue = worker.queues[cls];
+	if (queue.empty()) {
+	  continue;
+	}
+	//Owners take the oldest task, thieves the newest, which keeps them off each other's end
+	if (step == 0) {
+	  task = std::move(queue.front());
+	  queue.pop_front();
+	}
+	else {
+	  task = std::move(queue.back());
+	  queue.pop_back();
+	}
+      }
+      if (!task) {
+	--running_[cls];
+	continue;
+      }
+      --queued_[cls];
+      auto now = std::chrono::steady_clock::now();
+      uint64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(now - task->queued_at).count();
+      TrackDelay(cls,now,wait);
+      wait_us_[cls] += wait;
+      for (auto seen = max_wait_us_[cls].load(); wait > seen && !max_wait_us_[cls].compare_exchange_weak(seen,wait);) {
+      }
+      task->fn();
+      ++completed_[cls];
+      --running_[cls];
+      //Tasks held back by this class's limit can go now
+      if (queued_[cls] > 0) {
+	Signal();
       }
+      return true;
     }
-
-    query_str += name;
-    query_str += "\" ";
-    query_str += col_names;
-    query_str += col_values;
-
-    TryExecSimpleQuery(query_str);    
+    return false;
   }
 
-  void CSVApp::DbUpdateRow(const std::string& name,
-			   const JSONData& row,
-			   uint32_t at_row) {
-    std::string col_names {"("},col_values {"VALUES ("},query_str {"UPDATE main.\""};
-    for (auto it = row.begin(); it != row.end(); ++it) {
-      bool last = (std::distance(it,row.end()) == 1);
-      col_names += it->first;
-      col_values += it->second;
-      if (last) {
-	col_names += ")";
-	col_values += ")";
+  void PriorityExecutor::WorkerLoop(size_t self) {
+    current_executor = this;
+    current_worker = self;
+    while (true) {
+      uint64_t seen;
+      {
+	std::lock_guard<std::mutex> lock(signal_mutex_);
+	seen = signal_;
       }
-      else {
-	col_names += ",";
-	col_values += ",";
+      if (TryRun(self)) {
+	continue;
       }
+      std::unique_lock<std::mutex> lock(signal_mutex_);
+      if (stopping_ && std::all_of(queued_.begin(),queued_.end(),[](const auto& q) { return q == 0; })) {
+	return;
+      }
+      wake_.wait(lock,[&]() { return stopping_ || signal_ != seen; });
     }
+  }
 
-    query_str += name;
-    query_str += "\" SET ";
-    query_str += col_names;
-    query_str += " = ";
-    query_str += col_values;
-    query_str += " WHERE rowid = ";
-    query_str += std::to_string(at_row);
-    query_str += ";";
-
-    TryExecSimpleQuery(query_str);    
-
+  void PriorityExecutor::shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(signal_mutex_);
+      if (stopping_) {
+	return;
+      }
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+      worker->thread.join();
+    }
   }
 
-  void CSVApp::HandleListing(const httplib::Request& req,httplib::Response& res) {
-    res.status = 200;
-    res.body = PackJSON(DbQueryList());
+  JSONData PriorityExecutor::Stats() const {
+    static const char* names[kTaskClasses] = {"interactive","update","bulk"};
+    JSONData stats;
+    for (size_t cls = 0; cls < kTaskClasses; ++cls) {
+      std::string name = names[cls];
+      uint64_t completed = completed_[cls];
+      stats[name + "_queued"] = std::to_string(queued_[cls].load());
+      stats[name + "_running"] = std::to_string(running_[cls].load());
+      stats[name + "_limit"] = std::to_string(limits_[cls]);
+      stats[name + "_completed"] = std::to_string(completed);
+      stats[name + "_avg_wait_us"] = std::to_string(completed?wait_us_[cls] / completed:0);
+      stats[name + "_max_wait_us"] = std::to_string(max_wait_us_[cls].load());
+      stats[name + "_rejected"] = std::to_string(rejected_[cls].load());
+      stats[name + "_shedding"] = shedding_[cls]?"1":"0";
+    }
+    stats["workers"] = std::to_string(workers_.size());
+    return stats;
   }
 
-  void CSVApp::HandleTableQuery(const httplib::Request& req,httplib::Response& res) {
-    //Uses a whole lot of params
-    //First: column numbers to display
-    auto col_its = req.params.equal_range("col");
-    //Second: column numbers that must be ordered by ascension
-    auto asc_its = req.params.equal_range("asc");
-    //Third: --//-- by descension
-    auto desc_its = req.params.equal_range("desc");
-    //Fourth: I kinda forgot about it, but the actual name of the table.
-    auto name = req.params.find("name")->second;
-    //Fifth: the row range
-    auto from_row = req.params.find("from")->second;
-    auto to_row = req.params.find("to")->second;
+  namespace {
+    bool HeaderNameIs(std::string_view line, std::string_view name) {
+      if (line.size() <= name.size() || line[name.size()] != ':') {
+	return false;
+      }
+      for (size_t ind = 0; ind < name.size(); ++ind) {
+	if (std::tolower(static_cast<unsigned char>(line[ind])) != name[ind]) {
+	  return false;
+	}
+      }
+      return true;
+    }
 
-    //Now, a whole lotta checks
-    std::vector<std::string> issue_list;
+    std::string_view HeaderValue(std::string_view line) {
+      auto value = line.substr(line.find(':') + 1);
+      auto first = value.find_first_not_of(" \t");
+      return (first == std::string_view::npos)?std::string_view():value.substr(first);
+    }
+  }
 
-    //First step, table name verification
-    //As bonus points, identification of columns we need to deal with
-    auto table_list = DbQueryTableList();
-    if (std::find(table_list.begin(),table_list.end(),name) == table_list.end()) {
-      res.status = 400;
-      res.body = "Can't find the named table";
-      return;
+  RequestFrame FrameHttpRequest(std::string_view buffer, size_t max_body) {
+    RequestFrame frame;
+    auto header_end = buffer.find("\r\n\r\n");
+    if (header_end == std::string_view::npos) {
+      return frame;
     }
-    //Second step, throw out invalid col,asc,desc numbers
-    auto param_to_vec = [&issue_list](decltype(asc_its) its) {
-      std::vector<uint32_t> inds;
-      for (auto it = its.first;it != its.second; ++it) {
-	if(DetectTypes(it->second)[0] == Types::Int) {
-	  inds.push_back(std::atoi(it->second.c_str()));
-	}
-	else {
-	  issue_list.emplace_back("Invalid indexing");
+    size_t head = header_end + 4;
+    size_t content_length = 0;
+    bool chunked = false;
+    for (size_t pos = buffer.find("\r\n") + 2; pos < header_end;) {
+      auto line_end = buffer.find("\r\n",pos);
+      auto line = buffer.substr(pos,line_end - pos);
+      if (HeaderNameIs(line,"content-length")) {
+	auto value = HeaderValue(line);
+	auto parsed = std::from_chars(value.data(),value.data() + value.size(),content_length);
+	if (parsed.ec != std::errc()) {
+	  content_length = max_body + 1;
 	}
       }
-      return inds;
-    };
-
-    std::vector<uint32_t> col_inds = param_to_vec(col_its);
-    std::vector<uint32_t> asc_inds = param_to_vec(asc_its);
-    std::vector<uint32_t> desc_inds = param_to_vec(desc_its);
+      else if (HeaderNameIs(line,"transfer-encoding")) {
+	std::string value(HeaderValue(line));
+	std::transform(value.begin(),value.end(),value.begin(),[](unsigned char c) { return std::tolower(c); });
+	chunked = (value.find("chunked") != std::string::npos);
+      }
+      pos = line_end + 2;
+    }
 
-    auto col_list = DbQueryColList(name);
-    std::vector<std::string> col_names;
-    for(const auto& ind : col_inds) {
-      if (ind >= col_list.size()) {
-	issue_list.emplace_back("A column index out of bounds");
+    if (!chunked) {
+      if (content_length > max_body) {
+	frame.length = head;
+	frame.oversized = true;
       }
-      else {
-	col_names.push_back(col_list[ind]);
+      else if (buffer.size() >= head + content_length) {
+	frame.length = head + content_length;
       }
+      return frame;
     }
-    std::unordered_map<std::string,bool> sort_names;
-    for (const auto& ind : asc_inds) {
-      if (ind >= col_list.size()) {
-	issue_list.emplace_back("A column index out of bounds");
+    //Chunk sizes are skipped over until the last chunk and the trailer section after it
+    for (size_t pos = head;;) {
+      if (pos - head > max_body) {
+	frame.length = head;
+	frame.oversized = true;
+	return frame;
       }
-      else {
-	sort_names[col_list[ind]] = true;
+      auto line_end = buffer.find("\r\n",pos);
+      if (line_end == std::string_view::npos) {
+	return frame;
+      }
+      size_t chunk = 0;
+      auto parsed = std::from_chars(buffer.data() + pos,buffer.data() + line_end,chunk,16);
+      if (parsed.ec != std::errc()) {
+	frame.length = head;
+	frame.oversized = true;
+	return frame;
+      }
+      pos = line_end + 2;
+      if (chunk == 0) {
+	auto trailer_end = (buffer.substr(pos,2) == "\r\n")?pos:buffer.find("\r\n\r\n",pos);
+	if (trailer_end != std::string_view::npos && buffer.size() >= trailer_end + 2) {
+	  frame.length = trailer_end + ((trailer_end == pos)?2:4);
+	}
+	return frame;
+      }
+      pos += chunk + 2;
+      if (pos > buffer.size()) {
+	return frame;
       }
     }
-    for (const auto& ind : desc_inds) {
-      if (ind >= col_list.size()) {
-	issue_list.emplace_back("A column index out of bounds");
+  }
+
+  struct EventServer::Connection {
+    int fd = -1;
+    std::string remote_addr;
+    int remote_port = 0;
+    std::string in;
+    std::string out;
+    size_t out_pos = 0;
+    bool registered = false;
+    bool close_after = false;
+    std::chrono::steady_clock::time_point last_active;
+  };
+
+  struct EventServer::Loop {
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::thread thread;
+    //New connections from the acceptor and connections handed back by the compute tasks
+    std::mutex mutex;
+    std::vector<Connection*> incoming;
+    //Everything below is the loop thread's alone
+    std::unordered_map<Connection*,std::unique_ptr<Connection>> conns;
+    std::unordered_set<Connection*> busy;
+  };
+
+  EventServer::EventServer() = default;
+
+  EventServer::~EventServer() {
+    StopEvented();
+  }
+
+#ifdef __linux__
+  namespace {
+    //The whole request sits in memory already, responses are collected for the loop to send
+    class BufferStream : public httplib::Stream {
+    private:
+      std::string_view in_;
+      size_t pos_ = 0;
+      std::string& out_;
+      const std::string& remote_addr_;
+      int remote_port_;
+      int fd_;
+
+    public:
+      BufferStream(std::string_view in, std::string& out, const std::string& remote_addr, int remote_port, int fd)
+	: in_(in), out_(out), remote_addr_(remote_addr), remote_port_(remote_port), fd_(fd) {}
+      bool is_readable() const override { return pos_ < in_.size(); }
+      bool is_writable() const override { return true; }
+      ssize_t read(char *ptr, size_t size) override {
+	size = std::min(size,in_.size() - pos_);
+	std::memcpy(ptr,in_.data() + pos_,size);
+	pos_ += size;
+	return static_cast<ssize_t>(size);
       }
-      else {
-	sort_names[col_list[ind]] = false;
+      ssize_t write(const char *ptr, size_t size) override {
+	out_.append(ptr,size);
+	return static_cast<ssize_t>(size);
+      }
+      void get_remote_ip_and_port(std::string& ip, int& port) const override {
+	ip = remote_addr_;
+	port = remote_port_;
       }
+      void get_local_ip_and_port(std::string& ip, int& port) const override {
+	httplib::detail::get_local_ip_and_port(fd_,ip,port);
+      }
+      //Keeps httplib's FD_SETSIZE guard from turning away connections past the select() limit
+      socket_t socket() const override { return INVALID_SOCKET; }
+    };
+  }
+
+  bool EventServer::ListenEvented(const std::string& host, int port, size_t io_threads) {
+    if (!bind_to_port(host,port)) {
+      return false;
     }
-    //At last, validate row limits
-    uint32_t from,to;
-    if (!from_row.empty() && DetectTypes(from_row)[0] == Types::Int) {
-      from = std::atoi(from_row.c_str());
+    //httplib's backlog is sized for a thread pool, thousands of clients reconnect at once
+    ::listen(svr_sock_,SOMAXCONN);
+    keep_alive_timeout_sec_ = kEventIdleTimeoutSec;
+    keep_alive_max_count_ = std::numeric_limits<int>::max();
+    stopping_ = false;
+    compute_.reset(new_task_queue());
+    prioritized_ = dynamic_cast<PriorityExecutor*>(compute_.get());
+    for (size_t ind = 0; ind < std::max<size_t>(io_threads,1); ++ind) {
+      auto loop = std::make_unique<Loop>();
+      loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      loop->wake_fd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+      epoll_event wake {};
+      wake.events = EPOLLIN;
+      wake.data.ptr = nullptr;
+      epoll_ctl(loop->epoll_fd,EPOLL_CTL_ADD,loop->wake_fd,&wake);
+      loops_.push_back(std::move(loop));
     }
-    else {
-      from = 0;
+    for (auto& loop : loops_) {
+      loop->thread = std::thread([this,&loop]() { RunLoop(*loop); });
     }
-    if (!to_row.empty() && DetectTypes(to_row)[0] == Types::Int) {
-      from = std::atoi(to_row.c_str());
+
+    //Connections are dealt out round robin, a loop is never told about them by anyone else
+    for (size_t next = 0; !stopping_;) {
+      socket_t listen_sock = svr_sock_;
+      if (listen_sock == INVALID_SOCKET) {
+	break;
+      }
+      auto sock = accept4(listen_sock,nullptr,nullptr,SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (sock < 0) {
+	if (errno == EMFILE || errno == ENFILE) {
+	  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	continue;
+      }
+      int yes = 1;
+      setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&yes,sizeof(yes));
+      auto conn = std::make_unique<Connection>();
+      conn->fd = sock;
+      conn->last_active = std::chrono::steady_clock::now();
+      httplib::detail::get_remote_ip_and_port(sock,conn->remote_addr,conn->remote_port);
+      auto& loop = *loops_[next++ % loops_.size()];
+      {
+	std::lock_guard<std::mutex> lock(loop.mutex);
+	loop.incoming.push_back(conn.release());
+      }
+      uint64_t one = 1;
+      [[maybe_unused]] auto written = ::write(loop.wake_fd,&one,sizeof(one));
     }
-    else {
-      to = 100;
+
+    //Tasks still running hand their connections back to the loops, so those go last
+    compute_->shutdown();
+    for (auto& loop : loops_) {
+      uint64_t one = 1;
+      [[maybe_unused]] auto written = ::write(loop->wake_fd,&one,sizeof(one));
+      loop->thread.join();
+      for (auto conn : loop->incoming) {
+	if (!loop->conns.count(conn)) {
+	  ::close(conn->fd);
+	  delete conn;
+	}
+      }
+      for (auto& conn : loop->conns) {
+	::close(conn.first->fd);
+      }
+      ::close(loop->wake_fd);
+      ::close(loop->epoll_fd);
     }
+    loops_.clear();
+    return true;
+  }
 
-    //With all that done, let us now build the proper query
-    auto table = DbQueryTable(name,col_names,sort_names,{from,to});
-    table["issues"] = PackJSONArray(issue_list);
-    res.status = 200;
-    res.body = PackJSON(table);
+  void EventServer::StopEvented() {
+    stopping_ = true;
+    socket_t sock = svr_sock_.exchange(INVALID_SOCKET);
+    if (sock != INVALID_SOCKET) {
+      ::shutdown(sock,SHUT_RDWR);
+      ::close(sock);
+    }
   }
 
-  void CSVApp::HandleTableUpdate(const httplib::Request& req, httplib::Response& res) {
-    auto name = req.params.find("name")->second;
-    auto rowid_it = req.params.find("rowid");
-    auto rowdata = req.files.find("row_desc");
+  void EventServer::RunLoop(Loop& loop) {
+    std::vector<epoll_event> events(256);
+    auto last_sweep = std::chrono::steady_clock::now();
+    while (!stopping_) {
+      int count = epoll_wait(loop.epoll_fd,events.data(),events.size(),1000);
+      for (int ind = 0; ind < count; ++ind) {
+	auto conn = static_cast<Connection*>(events[ind].data.ptr);
+	if (!conn) {
+	  uint64_t value;
+	  [[maybe_unused]] auto got = ::read(loop.wake_fd,&value,sizeof(value));
+	  std::vector<Connection*> incoming;
+	  {
+	    std::lock_guard<std::mutex> lock(loop.mutex);
+	    incoming.swap(loop.incoming);
+	  }
+	  for (auto handed : incoming) {
+	    if (!loop.conns.count(handed)) {
+	      loop.conns[handed].reset(handed);
+	    }
+	    loop.busy.erase(handed);
+	    handed->last_active = std::chrono::steady_clock::now();
+	    Resume(loop,handed);
+	  }
+	  continue;
+	}
+	if (events[ind].events & EPOLLOUT) {
+	  Resume(loop,conn);
+	  continue;
+	}
+	//Drain the socket, it is edge of a one shot registration
+	bool open = true;
+	char buf[16384];
+	while (true) {
+	  auto got = ::recv(conn->fd,buf,sizeof(buf),0);
+	  if (got > 0) {
+	    conn->in.append(buf,got);
+	    continue;
+	  }
+	  open = (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+	  break;
+	}
+	if (!open) {
+	  Close(loop,conn);
+	  continue;
+	}
+	conn->last_active = std::chrono::steady_clock::now();
+	Resume(loop,conn);
+      }
 
-    auto table_list = DbQueryTableList();
-    if (std::find(table_list.begin(),table_list.end(),name) == table_list.end()) {
-      res.status = 400;
-      res.body = "Can't find the named table";
-      return;
+      //Idle keep-alive connections are dropped once they sit around too long
+      auto now = std::chrono::steady_clock::now();
+      if (now - last_sweep >= std::chrono::seconds(1)) {
+	last_sweep = now;
+	std::vector<Connection*> idle;
+	for (const auto& conn : loop.conns) {
+	  if (!loop.busy.count(conn.first) && conn.first->out_pos == conn.first->out.size() &&
+	      now - conn.first->last_active > std::chrono::seconds(kEventIdleTimeoutSec)) {
+	    idle.push_back(conn.first);
+	  }
+	}
+	for (auto conn : idle) {
+	  Close(loop,conn);
+	}
+      }
     }
+  }
 
-    if (rowid_it == req.params.end() ||
-	std::count(rowid_it->second.begin(),rowid_it->second.end(),',') > 0 ||
-	DetectTypes(rowid_it->second)[0] != Types::Int) {
-      res.status = 400;
-      res.body = "Incorrect row placement";
+  void EventServer::Resume(Loop& loop, Connection* conn) {
+    //Whatever the last response left unsent goes first
+    while (conn->out_pos < conn->out.size()) {
+      auto sent = ::send(conn->fd,conn->out.data() + conn->out_pos,conn->out.size() - conn->out_pos,MSG_NOSIGNAL);
+      if (sent < 0) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	  Arm(loop,conn,EPOLLOUT);
+	  return;
+	}
+	Close(loop,conn);
+	return;
+      }
+      conn->out_pos += sent;
+    }
+    conn->out.clear();
+    conn->out_pos = 0;
+    if (conn->close_after) {
+      Close(loop,conn);
       return;
     }
 
-    if (rowdata == req.files.end()) {
-      res.status = 400;
-      res.body = "No row data available";
+    auto frame = FrameHttpRequest(conn->in,payload_max_length_);
+    if (frame.length > 0) {
+      Dispatch(loop,conn,frame);
       return;
     }
-
-    auto data = ParseStrictJSON(rowdata->second.content);
-    if (!data) {
-      res.status = 400;
-      res.body = "Invalid JSON input";
+    if (conn->in.size() > kMaxRequestHeaderBytes && conn->in.find("\r\n\r\n") == std::string::npos) {
+      Close(loop,conn);
       return;
     }
+    Arm(loop,conn,EPOLLIN | EPOLLRDHUP);
+  }
 
-    //Validate column names.
-    //Unfortunately validating types is a fucking pain in written framework as is now
-    //General TODO: Make the DB operations at least Monadic, then backpropagating their errors will be way easier
-    auto col_list = DbQueryColList(name);
-    for (const auto& json_col : *data) {
-      if (std::find(col_list.begin(),col_list.end(),json_col.first) == col_list.end()) {
-	res.status = 400;
-	res.body = "Invalid column name";
-	return;
+  void EventServer::Arm(Loop& loop, Connection* conn, uint32_t events) {
+    epoll_event event {};
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = conn;
+    epoll_ctl(loop.epoll_fd,conn->registered?EPOLL_CTL_MOD:EPOLL_CTL_ADD,conn->fd,&event);
+    conn->registered = true;
+  }
+
+  void EventServer::Close(Loop& loop, Connection* conn) {
+    //Closing the descriptor takes it out of the epoll set as well
+    ::close(conn->fd);
+    loop.busy.erase(conn);
+    loop.conns.erase(conn);
+  }
+
+  void EventServer::Dispatch(Loop& loop, Connection* conn, RequestFrame frame) {
+    auto task_class = RouteClass(std::string_view(conn->in).substr(0,conn->in.find("\r\n")));
+    auto admission = prioritized_?prioritized_->Admit(task_class):Admission::Admitted;
+    if (admission != Admission::Admitted) {
+      //Answered right here, the request never waits in the queue it would make longer
+      conn->out = BuildRejectResponse(503,prioritized_->RetryAfterSec(),
+				      (admission == Admission::QueueFull)?"Queue full":"Overloaded");
+      conn->close_after = frame.oversized;
+      conn->in.erase(0,frame.length);
+      Resume(loop,conn);
+      return;
+    }
+    loop.busy.insert(conn);
+    auto task = [this,&loop,conn,frame]() {
+      BufferStream strm(std::string_view(conn->in).substr(0,frame.length),conn->out,
+			conn->remote_addr,conn->remote_port,conn->fd);
+      bool connection_closed = false;
+      if (!process_request(strm,false,connection_closed,nullptr) || connection_closed || frame.oversized) {
+	conn->close_after = true;
       }
+      conn->in.erase(0,frame.length);
+      {
+	std::lock_guard<std::mutex> lock(loop.mutex);
+	loop.incoming.push_back(conn);
+      }
+      uint64_t one = 1;
+      [[maybe_unused]] auto written = ::write(loop.wake_fd,&one,sizeof(one));
+    };
+    if (prioritized_) {
+      prioritized_->Enqueue(std::move(task),task_class);
     }
+    else {
+      compute_->enqueue(std::move(task));
+    }
+  }
+#else
+  bool EventServer::ListenEvented(const std::string& host, int port, size_t) {
+    return listen(host,port);
+  }
 
-    auto table_sz = DbQueryTableSize(name);
-    if (std::atoi(rowid_it->second.c_str()) > table_sz) {
-      DbAppendRow(name,*data);
-      res.status = 200;
-      res.body = "Attempted row append";
+  void EventServer::StopEvented() {
+    stop();
+  }
+
+  void EventServer::RunLoop(Loop&) {}
+  void EventServer::Resume(Loop&, Connection*) {}
+  void EventServer::Arm(Loop&, Connection*, uint32_t) {}
+  void EventServer::Close(Loop&, Connection*) {}
+  void EventServer::Dispatch(Loop&, Connection*, RequestFrame) {}
+#endif
+
+  httplib::Server::HandlerResponse CSVApp::AdmitClient(const httplib::Request& req, httplib::Response& res) {
+    if (!ip_limiter_.Enabled()) {
+      return httplib::Server::HandlerResponse::Unhandled;
     }
-    else {
-      DbUpdateRow(name,*data,std::atoi(rowid_it->second.c_str()));
-      res.status = 200;
-      res.body = "Attempted row update";
+    //Headers naming a user are not checked against anything, so only the peer address keys a bucket
+    auto wait = ip_limiter_.Take(req.remote_addr);
+    if (wait <= 0) {
+      return httplib::Server::HandlerResponse::Unhandled;
     }
-    
-    
+    ++rate_limited_;
+    res.status = 429;
+    res.set_header("Retry-After",std::to_string(static_cast<int>(std::ceil(wait))));
+    res.body = "Rate limit exceeded";
+    return httplib::Server::HandlerResponse::Handled;
   }
 
-  void CSVApp::Run(std::string addr, int port) {
-    svr_.listen(addr,port);
+  void CSVApp::HandleMetrics(const httplib::Request& req, httplib::Response& res) {
+    auto executor = executor_.load();
+    JSONData metrics = executor?executor->Stats():JSONData();
+    metrics["rate_limited"] = std::to_string(rate_limited_.load());
+    {
+      std::lock_guard<std::mutex> lock(jobs_mutex_);
+      size_t active = 0;
+      for (const auto& job : jobs_) {
+	active += (job.second.state != "done" && job.second.state != "failed");
+      }
+      metrics["ingest_jobs_active"] = std::to_string(active);
+    }
+    res.status = 200;
+    res.body = PackJSON(metrics);
+  }
+
+  void CSVApp::Run(std::string addr, int port, size_t io_threads) {
+    if (io_threads > 0) {
+      svr_.ListenEvented(addr,port,io_threads);
+    }
+    else {
+      svr_.listen(addr,port);
+    }
   }
   
 }
@@ -6,10 +6,29 @@ extern "C"
 #include <sqlite3.h>
 }
 
+#include <charconv>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <list>
 #include <map>
+#include <memory_resource>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include "httplib.h"
 
 
@@ -29,6 +48,12 @@ namespace fiasco {
     Int = 1,
     Float = 0
   };
+  //Full text index flavours, words for token search and trigram for plain substring search
+  enum SearchMode {
+    NoSearch = 0,
+    WordSearch = 1,
+    TrigramSearch = 2
+  };
 
   struct Substring {
     uint32_t offset;
@@ -41,48 +66,976 @@ namespace fiasco {
   //array string | JSON object
   //string
   //Then one defines tail-recursive serialization
+  //Well, here it is, albeit for parsing only
+
+  //A single parsed value. text is the unescaped content for strings and raw source text otherwise
+  //Containers are followed by their children in document order, end points one past the subtree
+  struct JSONValue {
+    enum Kind : uint8_t {
+      Null,
+      Bool,
+      Int,
+      Float,
+      String,
+      Array,
+      Object
+    };
+    Kind kind = Null;
+    int64_t int_val = 0;
+    double float_val = 0.0;
+    std::string_view text;
+    uint32_t end = 0;
+    //Element count for arrays, member count for objects
+    uint32_t size = 0;
+  };
+
+  class JSONParser;
+
+  //Flat tape of values, views point into the parsed source, so it has to outlive the document
+  //Object members are stored as key node followed by value node
+  class JSONDocument {
+    friend class JSONParser;
+  private:
+    std::vector<JSONValue> nodes_;
+    std::vector<uint32_t> roots_;
+    //Unescaped strings only, sized to the source once so views into it never move
+    std::unique_ptr<char[]> scratch_;
+    size_t scratch_len_ = 0;
+
+  public:
+    const JSONValue& operator[](uint32_t ind) const { return nodes_[ind]; }
+    const std::vector<uint32_t>& Roots() const { return roots_; }
+    uint32_t FirstChild(uint32_t ind) const { return ind + 1; }
+    uint32_t Next(uint32_t ind) const { return nodes_[ind].end; }
+    //Value node of a member, if the object has one
+    std::optional<uint32_t> Find(uint32_t obj, std::string_view key) const;
+  };
+
+  //Integers as std::to_string gives them, floats with six decimals, without its locale and stream setup
+  template <typename Str, typename Int>
+  std::enable_if_t<std::is_integral_v<Int>> AppendNumber(Str& out, Int val) {
+    char buf[24];
+    auto res = std::to_chars(buf,buf + sizeof(buf),val);
+    out.append(buf,res.ptr - buf);
+  }
+  template <typename Str>
+  void AppendNumber(Str& out, double val) {
+    //Fixed notation of the largest double is 309 digits before the point
+    char buf[330];
+    auto res = std::to_chars(buf,buf + sizeof(buf),val,std::chars_format::fixed,6);
+    out.append(buf,res.ptr - buf);
+  }
+
+  //Thread local text for SQL being put together. It only lives until prepared, so its capacity goes
+  //back to the thread's pool for the next statement rather than to the heap
+  class PooledString {
+  private:
+    std::string text_;
+
+  public:
+    PooledString();
+    ~PooledString();
+    PooledString(const PooledString&) = delete;
+    PooledString& operator=(const PooledString&) = delete;
+    std::string& operator*() { return text_; }
+    std::string* operator->() { return &text_; }
+  };
+  //Strings that grew past this are freed instead of pooled
+  static constexpr size_t kPooledStringMaxBytes = 1 << 20;
+  static constexpr size_t kPooledStringsPerThread = 8;
 
   std::string PackJSON(const JSONData& obj);
   std::string PackJSONArray(const std::vector<std::string>& arr);
-  //returns either a JSONData object or none
+  std::string PackJSONArray(const std::pmr::vector<std::pmr::string>& arr);
+  //Full grammar, one value unless a whitespace separated sequence (e.g. NDJSON) is allowed
+  std::optional<JSONDocument> ParseJSON(std::string_view serialized, bool allow_sequence = false);
+  //Binds by type, containers are bound as their JSON text. Integers and booleans for dictionary
+  //coded columns go in as text, so the encode triggers can tell them from codes
+  int BindJSONValue(sqlite3_stmt* stmt, int ind, const JSONValue& val, bool coded = false);
+  //Result cell as it goes into JSON, NULL is an empty string
+  std::string ColumnToString(sqlite3_stmt* stmt, int ind);
+
+  //Per request scratch memory. Each thread keeps one monotonic buffer, scopes hand it out and the
+  //outermost one rewinds it, so temporaries of a steady stream of requests never reach malloc
+  class RequestArena {
+  private:
+    bool outermost_;
+
+  public:
+    RequestArena();
+    ~RequestArena();
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+    std::pmr::memory_resource* get() const;
+  };
+  //Kept by every thread that ever served a request, anything past it comes from the heap
+  static constexpr size_t kRequestArenaBytes = 256 * 1024;
+
+  //Result columns of a row object in PackJSON's key order, a repeated key keeps its last column
+  using RowLayout = std::vector<std::pair<std::string_view,int>>;
+  RowLayout BuildRowLayout(RowLayout cols);
+  //Same text PackJSON gives for the row as a JSONData of ColumnToString cells
+  void AppendJSONRow(std::pmr::string& out, sqlite3_stmt* stmt, const RowLayout& layout);
+
+  //Prepared statement that finalizes itself. Failures are logged under the caller's name, the way the
+  //hand written prepare/step/finalize sequences do
+  class Statement {
+  private:
+    sqlite3* db_;
+    sqlite3_stmt* stmt_ = nullptr;
+    const char* where_;
+    int last_ = SQLITE_OK;
+
+  public:
+    Statement(sqlite3* db, const std::string& sql, const char* where);
+    ~Statement();
+    Statement(const Statement&) = delete;
+    Statement& operator=(const Statement&) = delete;
+    bool Ok() const { return stmt_ != nullptr; }
+    sqlite3_stmt* get() const { return stmt_; }
+    //Text is not copied, it has to outlive the steps
+    Statement& Bind(int ind, std::string_view text);
+    //So a temporary string can't be bound and gone by the time of the step
+    template <typename T, typename = std::enable_if_t<std::is_same_v<T,std::string>>>
+    Statement& Bind(int ind, T&& text) = delete;
+    Statement& Bind(int ind, int64_t val);
+    //true on a row, false once done or on an error until Reset
+    bool Step();
+    //Back to the first row, bindings are kept
+    void Reset();
+    bool Failed() const { return last_ != SQLITE_OK && last_ != SQLITE_ROW && last_ != SQLITE_DONE; }
+  };
+  //returns either a JSONData object or none, non-string values are kept as their JSON text
   std::optional<JSONData> ParseStrictJSON(const std::string& serialized);
+
+  //Batch bodies are either a JSON array of objects or NDJSON of those
+  //Keys _op and _rowid are reserved for the operation itself
+  struct BatchOps {
+    JSONDocument doc;
+    std::vector<uint32_t> ops;
+  };
+  std::optional<BatchOps> ParseBatchOps(std::string_view body);
   
 //  std::vector<size_t> OffsetsForSplit(const std::string& multiline, char separator = '\n');
   std::vector<Substring> SplitIntoViews(const std::string& str, char separator = '\n');
   bool SampleForCSV(const std::string& csv_content, char separator = ',',size_t samples = 10);
   std::vector<Types> DetectTypes(const std::string& csv_row, char separator = ',');
+  //One column of an upload schema, the key has to be an int and becomes the table's rowid
+  struct ColumnSpec {
+    std::string name;
+    Types type = Types::String;
+    bool key = false;
+    bool not_null = false;
+    bool index = false;
+  };
+  //JSON array of {"name", "type" (int, float or text), "key", "not_null", "index"}, nullopt if malformed
+  std::optional<std::vector<ColumnSpec>> ParseUploadSchema(std::string_view serialized);
 
-  
-  class CSVApp {
+  //Statement builders for the prepared write paths, rowid is always the first parameter
+  //schema is the database holding the table, see CSVApp::DbTableSchema
+  std::string BuildUpsertQuery(const std::string& table_name,
+			       const std::vector<std::string>& cols,
+			       const std::string& schema = "main");
+  std::string BuildDeleteQuery(const std::string& table_name, const std::string& schema = "main");
+
+  //FTS5 index over the text columns of a table, kept in sync by triggers
+  std::string SearchIndexName(const std::string& table_name);
+  std::vector<std::string> BuildSearchIndexQueries(const std::string& table_name,
+						   const std::vector<std::string>& text_cols,
+						   SearchMode mode,
+						   const std::string& schema = "main");
+  //Index over rows still loaded under staged_name, it is published by renaming it to SearchIndexName(table_name)
+  std::vector<std::string> BuildStagedSearchIndexQueries(const std::string& table_name,
+							 const std::string& staged_name,
+							 const std::vector<std::string>& text_cols,
+							 SearchMode mode,
+							 const std::string& schema = "main");
+  std::string ColumnIndexName(const std::string& table_name, const std::string& col);
+  std::string BuildColumnIndexQuery(const std::string& table_name, const std::string& col, const std::string& schema = "main");
+  //Index over rows still loaded under staged_name, already named after table_name as renaming can't change that
+  std::string BuildStagedColumnIndexQuery(const std::string& table_name,
+					  const std::string& staged_name,
+					  const std::string& col,
+					  const std::string& schema = "main");
+  //Keeps the index of a published table in step with its writes
+  std::vector<std::string> BuildSearchTriggerQueries(const std::string& table_name,
+						     const std::vector<std::string>& text_cols,
+						     const std::string& schema = "main");
+  //Parameters are match expression, limit and offset, columns come after rowid, rank and snippet
+  //Rows are read from source, see CSVApp::DbReadSource
+  std::string BuildSearchQuery(const std::string& table_name,
+			       const std::vector<std::string>& cols,
+			       const std::string& source);
+  //Turns arbitrary user text into a single FTS5 phrase
+  std::string QuoteSearchPhrase(const std::string& text);
+  //Number of rows in a from-to window, both ends included like the rowid ranges of /view
+  uint64_t WindowRows(const std::pair<uint32_t,uint32_t>& row_range);
+
+  //asc and desc values of a request target in the order they were given, true for ascending
+  std::vector<std::pair<std::string,bool>> OrderedSortParams(std::string_view target);
+  //Everything that determines a /view response body, sorts in the order they end up in ORDER BY
+  std::string BuildViewCacheKey(const std::string& table_name,
+				const std::vector<std::string>& cols,
+				const std::vector<std::pair<std::string,bool>>& sorts,
+				const std::pair<uint32_t,uint32_t> row_range,
+				const std::vector<std::string>& issues);
+  //Whether an If-None-Match header lists the tag or is *, weak tags count as their strong form
+  bool ETagMatches(std::string_view header, std::string_view etag);
+
+  //Serialized responses, sharded so concurrent pollers don't queue on one lock
+  //Every shard is an LRU bounded in bytes, stale entries are never looked up again and simply age out
+  class ViewCache {
   private:
-    sqlite3 *db_handle_;
-    httplib::Server svr_;
+    struct Shard {
+      std::mutex mutex;
+      std::list<std::pair<std::string,std::shared_ptr<const std::string>>> lru;
+      std::unordered_map<std::string,decltype(lru)::iterator> index;
+      size_t bytes = 0;
+    };
+    std::vector<std::unique_ptr<Shard>> shards_;
+    size_t shard_capacity_;
+
+    Shard& ShardFor(const std::string& key);
+
+  public:
+    ViewCache(size_t shard_count, size_t capacity_bytes);
+    std::shared_ptr<const std::string> Get(const std::string& key);
+    void Put(const std::string& key, std::shared_ptr<const std::string> body);
+  };
+
+  //Low cardinality string columns are stored as integer codes into a per column dictionary table
+  //Codes are handed out in value order at upload, later values are appended by triggers
+  //Reads go through a view joining the dictionaries back in
+  std::string_view UnquoteField(std::string_view field);
+  void SplitFields(std::string_view line, char separator, std::vector<std::string_view>& fields);
+  //Sorted distinct values of every column worth encoding, empty for the rest
+  std::vector<std::vector<std::string_view>> DetectDictionaries(const std::string& content,
+								const std::vector<Substring>& lines,
+								size_t first_line,
+								const std::vector<Types>& types,
+								char separator = ',');
+  std::string DictionaryTableName(const std::string& table_name, const std::string& col);
+  std::string DecodedViewName(const std::string& table_name);
+  //Dictionary table followed by the triggers encoding text written to the column
+  std::vector<std::string> BuildDictionaryQueries(const std::string& table_name, const std::string& col,
+						  const std::string& schema = "main");
+  std::string BuildDecodedView(const std::string& table_name,
+			       const std::vector<std::string>& cols,
+			       const std::vector<bool>& coded,
+			       const std::string& schema = "main");
+
+  static constexpr size_t kDictionaryMinRows = 1000;
+  static constexpr size_t kDictionaryMaxCodes = 65536;
+  //At least this many rows per distinct value
+  static constexpr size_t kDictionaryMinRepeats = 10;
+
+  //One column's distribution as seen by the upload that loaded it, later writes don't update it
+  struct ColumnStats {
+    std::string column;
+    //Values compare as numbers rather than text
+    bool numeric = false;
+    uint64_t rows = 0;
+    uint64_t nulls = 0;
+    //HyperLogLog estimate of the non NULL values, within a few percent
+    uint64_t distinct = 0;
+    std::string min;
+    std::string max;
+    //Upper bounds of equi-depth buckets over the non NULL values, in SQLite's order
+    std::vector<std::string> bounds;
+  };
+  static constexpr int kHllBits = 12;
+  static constexpr size_t kHistogramBuckets = 16;
+  static constexpr size_t kHistogramSample = 4096;
+  //Takes the values of a column as they stream by, min and max, a HyperLogLog sketch and a reservoir
+  //sample the histogram is cut from, so nothing needs a second pass over the rows
+  class ColumnProfile {
+  private:
+    //Numbers before text, numbers by value and text bytewise, as SQLite orders them
+    struct Value {
+      bool text;
+      double num;
+      std::string str;
+      bool operator<(const Value& other) const;
+    };
+    ColumnStats stats_;
+    std::array<uint8_t,(1 << kHllBits)> registers_ {};
+    std::vector<Value> sample_;
+    std::optional<Value> min_;
+    std::optional<Value> max_;
+    uint64_t rng_ = 0x9e3779b97f4a7c15ULL;
+
+    Value Make(std::string_view value) const;
+
+  public:
+    ColumnProfile(std::string column, bool numeric);
+    //nullopt is a NULL, an empty value is the empty string
+    void Add(std::optional<std::string_view> value);
+    ColumnStats Finish();
+  };
+  //A bound such that the leading rows of the order, first for ascending and last for descending
+  //sorts, all pass "col IS NULL OR col <= bound" or "col >= bound". Has a bucket of slack, and
+  //nullopt when the cut wouldn't leave out any bucket
+  std::optional<std::string> HistogramCut(const ColumnStats& stats, uint64_t leading, bool asc);
+  //SQL literal for a bound or min/max of the column
+  std::string StatLiteral(const ColumnStats& stats, const std::string& value);
+
+  //Materialized GROUP BY over one table, stored as a table of its own and kept up to date by triggers
+  //on the source, so every write only touches the rows of its groups
+  struct RollupSpec {
+    std::string name;
+    std::string source;
+    std::vector<std::string> group;
+    //Every one gets sum_<col>, count_<col> and avg_<col> columns next to the group's rows
+    std::vector<std::string> aggregates;
+    //Column and SQL literal its value must be
+    std::vector<std::pair<std::string,std::string>> where;
+  };
+  //{"name", "table", "group": [cols], "aggregates": [cols], "where": {col: value}}, nullopt if malformed
+  std::optional<RollupSpec> ParseRollupSpec(std::string_view serialized);
+  std::string RollupTriggerName(const std::string& rollup, const std::string& event);
+  //Rollup table and the index over its group columns
+  std::vector<std::string> BuildRollupTableQueries(const RollupSpec& spec, const std::string& schema = "main");
+  //Recomputes the rollup from source and (re)creates its triggers. Triggers see the stored dictionary
+  //codes of the coded columns, so they decode them the way the decoded view does
+  std::vector<std::string> BuildRollupRefreshQueries(const RollupSpec& spec,
+						     const std::vector<std::string>& coded,
+						     const std::string& source,
+						     const std::string& schema = "main");
+
+  //Shard k is the file <db>.shard<k> ATTACHed as shard<k>, placement is a stable hash of the table name
+  //The chosen schema is recorded in Files.internal_name, so the shard count can change for new tables
+  std::string ShardSchemaName(size_t shard);
+  size_t ShardForTable(const std::string& table_name, size_t shard_count);
+  //FNV-1a, std::hash is free to differ between builds
+  uint64_t HashKey(std::string_view key);
+
+  //Open addressing over key hashes with linear probing, a rowid per slot and no deletes
+  //Only hashes are stored, so callers have to check the rows they get back against the key
+  class HashIndex {
+  private:
+    struct Slot {
+      uint64_t hash = 0;
+      int64_t rowid = 0;
+    };
+    //Power of two, at most half full, hash 0 marks a free slot
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+
+    void Place(const Slot& slot);
+
+  public:
+    explicit HashIndex(size_t expected = 0);
+    void Insert(std::string_view key, int64_t rowid);
+    //Appends every rowid stored under the key's hash
+    void Lookup(std::string_view key, std::vector<int64_t>& rowids) const;
+    size_t Size() const { return size_; }
+    size_t Bytes() const { return slots_.capacity() * sizeof(Slot); }
+  };
+  //Lookups by a non key column are served from a hash index up to this many rows
+  static constexpr size_t kHashIndexMaxRows = 1 << 22;
+  //All cached hash indexes together, the least recently used ones go first
+  static constexpr size_t kHashIndexBudgetBytes = size_t(512) << 20;
+  //JSON array of keys for a multi-get, numbers are taken as their text. nullopt if malformed
+  std::optional<std::vector<std::string>> ParseKeyList(std::string_view serialized);
+
+  //SQLite settings applied whenever the db is opened
+  //cache_size follows SQLite, negative values are KiB and positive ones pages
+  struct StorageProfile {
+    std::string journal_mode = "WAL";
+    int page_size = 4096;
+    int64_t cache_size = -65536;
+    int64_t mmap_size = 256 * 1024 * 1024;
+    std::string temp_store = "MEMORY";
+    std::string synchronous = "NORMAL";
+    //Uploads copy their rows into the target and build its indexes with synchronous=OFF
+    bool bulk_load = true;
+    //Uploaded tables are spread over this many ATTACHed files next to the main db, 0 keeps them in main
+    int shards = 0;
+  };
+  //false on an unknown option or a value SQLite wouldn't take
+  bool SetStorageOption(StorageProfile& profile, const std::string& key, const std::string& value);
+  //"key = value" lines, # starts a comment. nullopt on the first bad line
+  std::optional<StorageProfile> ParseStorageProfile(const std::string& config, StorageProfile profile = {});
+  //page_size comes first, it can't change once the db is in WAL mode
+  //Connection wide settings only come with the main schema
+  std::vector<std::string> BuildStoragePragmas(const StorageProfile& profile, const std::string& schema = "main");
+
+  //Fixed pool running upload pipelines, tasks still queued at shutdown are run before the workers exit
+  class IngestScheduler {
+  private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()>> queue_;
+    std::vector<std::thread> workers_;
+    bool stopping_ = false;
+
+  public:
+    explicit IngestScheduler(size_t workers);
+    ~IngestScheduler();
+    void Submit(std::function<void()> task);
+    void Shutdown();
+  };
 
+  //Upload progress as reported by /upload_status
+  struct IngestJob {
+    std::string table;
+    //queued, loading, publishing, indexing, done or failed
+    std::string state = "queued";
+    std::string message;
+    //HTTP status of a failed upload: 400 for unusable input, 409 for a name clash, 500 for storage errors
+    int status = 0;
+    size_t rows_loaded = 0;
+    //Rows a constraint of the declared schema turned away, they count towards rows_total only
+    size_t rows_rejected = 0;
+    size_t rows_total = 0;
+    size_t indexes_built = 0;
+    size_t indexes_total = 0;
+  };
+  JSONData PackIngestJob(uint64_t id, const IngestJob& job);
+
+  //Dedicated threads, each owning a read only connection. Reads are handed over and waited for, so
+  //long scans run side by side instead of queueing on the shared connection's mutex
+  class DbReaderPool {
+  private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void(sqlite3*)>> queue_;
+    std::vector<std::thread> workers_;
+    bool stopping_ = false;
+
+  public:
+    //Takes ownership of the connections, one thread each
+    explicit DbReaderPool(std::vector<sqlite3*> connections);
+    ~DbReaderPool();
+    //Queues fn for the next free connection. Tasks running on the pool must not wait on it
+    template <typename Fn>
+    auto Submit(Fn fn) -> std::future<decltype(fn(std::declval<sqlite3*>()))> {
+      using Result = decltype(fn(std::declval<sqlite3*>()));
+      auto task = std::make_shared<std::packaged_task<Result(sqlite3*)>>(std::move(fn));
+      auto result = task->get_future();
+      {
+	std::lock_guard<std::mutex> lock(mutex_);
+	queue_.push_back([task](sqlite3* db) { (*task)(db); });
+      }
+      ready_.notify_one();
+      return result;
+    }
+    template <typename Fn>
+    auto Run(Fn fn) -> decltype(fn(std::declval<sqlite3*>())) {
+      return Submit(std::move(fn)).get();
+    }
+    size_t Size() const {
+      return workers_.size();
+    }
+  };
+  static constexpr size_t kDbReaders = 4;
+
+  //Small enough that a batch of a few columns and its text stay in L2
+  static constexpr size_t kRowBatchRows = 256;
+  //Typed cells of up to kRowBatchRows rows by fixed column ordinals. Text is copied into a buffer of the
+  //batch since SQLite's own goes away with the next step, both are reused from one fill to the next
+  class RowBatch {
+  public:
+    enum class Kind : uint8_t {
+      Null,
+      Int,
+      Float,
+      Text
+    };
+    struct Cell {
+      Kind kind = Kind::Null;
+      uint32_t length = 0;
+      union {
+	int64_t num;
+	double real;
+	size_t offset;
+      };
+    };
+
+  private:
+    size_t columns_;
+    size_t rows_ = 0;
+    std::vector<Cell> cells_;
+    std::string text_;
+
+  public:
+    explicit RowBatch(size_t columns);
+    //Takes the row the statement is on
+    void Append(sqlite3_stmt* stmt);
+    //Starts over and steps until full or out of rows, false when no row was read
+    bool Fill(Statement& stmt);
+    void Clear();
+    bool Full() const { return rows_ == kRowBatchRows; }
+    size_t Rows() const { return rows_; }
+    size_t Columns() const { return columns_; }
+    const Cell& At(size_t row, size_t col) const { return cells_[row * columns_ + col]; }
+    std::string_view Text(const Cell& cell) const { return std::string_view(text_).substr(cell.offset,cell.length); }
+  };
+  //The batch's rows as PackJSON objects, continuing the JSON array opened in out
+  void AppendJSONRows(std::string& out, const RowBatch& batch, const RowLayout& layout);
+
+  static constexpr size_t kIngestWorkers = 4;
+  static constexpr size_t kIngestProgressRows = 65536;
+  //How long a publishing copy waits for writers of the target schema
+  static constexpr int kPublishBusyMs = 30000;
+  //How long the shared connection waits for a lock, it holds the write mutex meanwhile
+  static constexpr int kWriteBusyMs = 1000;
+  //Finished jobs kept around for status polls
+  static constexpr size_t kIngestJobHistory = 256;
+
+  static constexpr size_t kViewCacheShards = 16;
+  static constexpr size_t kViewCacheBytes = 64 * 1024 * 1024;
+
+  //Order preserving binary encodings, memcmp over concatenated column keys gives SQLite's ORDER BY order
+  //NULLs first, then numbers by value, then text and blobs bytewise. DESC complements the column's segment
+  void AppendNullKey(std::string& key, bool desc);
+  void AppendNumericKey(std::string& key, double val, int64_t tiebreak, bool desc);
+  void AppendBytesKey(std::string& key, std::string_view bytes, bool is_blob, bool desc);
+  void AppendColumnKey(std::string& key, sqlite3_stmt* stmt, int ind, bool desc);
+  //Trailing rowid keeps keys unique and is what the sorters hand back
+  void AppendRowidKey(std::string& key, int64_t rowid);
+  int64_t RowidFromKey(std::string_view key);
+  //Whole row key for a scan built by BuildSortScanQuery, rowid in column 0 and sort columns after it
+  void AppendSortKey(std::string& key, sqlite3_stmt* stmt,
+		     const std::vector<std::pair<std::string,bool>>& sorts);
+  //With partitioned set the scan takes a (lo, hi] rowid range as parameters 1 and 2
+  //A filter, e.g. a histogram cut, goes in front of the rowid range
+  std::string BuildSortScanQuery(const std::string& source,
+				 const std::vector<std::pair<std::string,bool>>& sorts,
+				 bool partitioned,
+				 const std::string& filter = "");
+
+  //Keeps the k smallest keys seen, a scan costs O(N log k) and k keys of memory
+  class TopKHeap {
+  private:
+    size_t limit_;
+    std::priority_queue<std::string> heap_;
+
+  public:
+    explicit TopKHeap(size_t limit) : limit_(limit) {}
+    void Offer(const std::string& key);
+    //Kept keys in ascending order, leaves the heap empty
+    std::vector<std::string> Take();
+  };
+  //Rowids at positions [skip, limit) of the union of per partition results
+  std::vector<int64_t> MergeTopK(std::vector<std::vector<std::string>> parts, size_t limit, size_t skip);
+
+  //External merge sort over encoded keys with runs sorted in parallel while the scan goes on
+  //Only the first limit keys are ever needed, so every sorted run is cut down to that
+  //before it is kept in memory or spilled to a temporary file
+  class ExternalSorter {
+  private:
+    struct Run {
+      std::string arena;
+      std::vector<std::pair<uint32_t,uint32_t>> keys;
+      FILE* spill = nullptr;
+      size_t spilled = 0;
+    };
+    size_t limit_;
+    size_t memory_bytes_;
+    size_t run_bytes_;
+    size_t threads_;
+    std::unique_ptr<Run> current_;
+    std::vector<std::unique_ptr<Run>> runs_;
+    std::deque<std::future<void>> pending_;
+    std::mutex kept_mutex_;
+    size_t kept_bytes_ = 0;
+
+    void SealRun();
+    void SortRun(Run& run);
+
+  public:
+    ExternalSorter(size_t limit, size_t memory_bytes, size_t threads);
+    ~ExternalSorter();
+    void Add(std::string_view key);
+    //Rowids at sorted positions [skip, limit)
+    std::vector<int64_t> Finish(size_t skip);
+  };
+
+  static constexpr size_t kExternalSortMinRows = 100000;
+  static constexpr size_t kSortMemoryBytes = 256 * 1024 * 1024;
+  //Windows ending below this are served by partitioned top-K heaps instead of a full sort
+  static constexpr size_t kTopKMaxRows = 10000;
+  //Keys of the k first rows in (lo, hi] of a partitioned BuildSortScanQuery
+  std::vector<std::string> ScanTopK(sqlite3* db, const std::string& query_str,
+				    const std::vector<std::pair<std::string,bool>>& sorts,
+				    size_t k, int64_t lo, int64_t hi);
+  //The filter is a cut from upload statistics. Once later writes leave fewer rows passing it than the
+  //window needs, the scan is done again without it. scan_parts runs the query over every partition
+  std::vector<int64_t> TopKSortRowids(const std::function<std::vector<std::vector<std::string>>(const std::string&)>& scan_parts,
+				      const std::string& source,
+				      const std::vector<std::pair<std::string,bool>>& sorts,
+				      const std::pair<uint32_t,uint32_t> window,
+				      const std::string& filter);
+  std::vector<int64_t> ExternalSortRowids(sqlite3* db, const std::string& source,
+					  const std::vector<std::pair<std::string,bool>>& sorts,
+					  const std::pair<uint32_t,uint32_t> window,
+					  std::string filter);
+  //Replaces the table's sqlite_stat1 rows: its row count and, for indexes led by a profiled column,
+  //the rows per distinct value. Same numbers ANALYZE would find, without its scan
+  void WriteStat1(sqlite3* db, const std::string& table_name, const std::string& schema,
+		  const std::vector<ColumnStats>& stats);
+
+  //Sampled reads probe uniform random rowids between min(rowid) and max(rowid). Uploads number rows densely,
+  //so holes left by deletes only cost a missed probe and the rows found are still a uniform sample. Once
+  //probes miss too often the rows are picked by rank instead, over two passes of the rowids
+  static constexpr size_t kMaxSampleRows = 1000000;
+  //Probes per requested row before falling back to ranks, also the smallest span worth probing
+  static constexpr size_t kSampleProbeFactor = 4;
+  //Rowids of the sampled rows in ascending order. Every probed slot counts for the estimators whether it
+  //held a row or not, when picked by rank slots are the rows and probes the rows picked
+  struct RowidSample {
+    std::vector<int64_t> rowids;
+    uint64_t probes = 0;
+    uint64_t slots = 0;
+  };
+  //Multiplier of the standard error for 95% intervals
+  static constexpr double kSampleZ = 1.96;
+  //Aggregates with more groups than this only report the first ones
+  static constexpr size_t kMaxAggregateGroups = 1000;
+  //n distinct rowids (or ranks) in ascending order, every one of 1 to max_rowid when n >= max_rowid
+  std::vector<int64_t> SampleRowids(int64_t max_rowid, size_t n, uint64_t seed);
+  enum class AggregateOp {
+    Count,
+    Sum,
+    Avg
+  };
+  std::optional<AggregateOp> ParseAggregateOp(std::string_view name);
+  //Sums over the non NULL values of one group, misses and other groups count as zeros
+  struct SampleMoments {
+    uint64_t rows = 0;
+    double sum = 0;
+    double sum_sq = 0;
+  };
+  struct Estimate {
+    double value = 0;
+    //Half width of the interval, nullopt when the sample is too small to tell
+    std::optional<double> error;
+  };
+  //Normal approximation over probes slots drawn without replacement out of population slots
+  Estimate EstimateAggregate(AggregateOp op, const SampleMoments& group, uint64_t probes, uint64_t population,
+			     double z = kSampleZ);
+
+  //Request priority, interactive reads go before updates and those before bulk ingest
+  enum class TaskClass : uint8_t {
+    Interactive = 0,
+    Update = 1,
+    Bulk = 2
+  };
+  static constexpr size_t kTaskClasses = 3;
+  //Class of a request by the path in its request line
+  TaskClass RouteClass(std::string_view request_line);
+
+  //Admission control, set with -admission key=value
+  struct AdmissionConfig {
+    //Requests waiting per class before new ones are turned away, 0 is unbounded
+    std::array<size_t,kTaskClasses> queue_limits {4096,1024,64};
+    //CoDel: a class whose queueing delay stayed over the target for a whole interval sheds new requests
+    //until a request gets through under the target or its queue empties. A target of 0 turns it off
+    uint32_t target_delay_ms = 50;
+    uint32_t interval_ms = 500;
+    //Token bucket in requests per second, 0 turns it off. One per client address, as nothing a client
+    //says about itself is verified
+    double ip_rate = 0;
+    double ip_burst = 50;
+  };
+  //false on an unknown option or a bad value
+  bool SetAdmissionOption(AdmissionConfig& config, const std::string& key, const std::string& value);
+  enum class Admission {
+    Admitted,
+    QueueFull,
+    Overloaded
+  };
+  //Whole canned response for requests turned away before reaching a handler
+  std::string BuildRejectResponse(int status, int retry_after_sec, std::string_view message);
+
+  //Token buckets by key. Buckets that have refilled are dropped once there are too many
+  class RateLimiter {
+  private:
+    struct Bucket {
+      double tokens;
+      std::chrono::steady_clock::time_point updated;
+    };
+    std::mutex mutex_;
+    std::unordered_map<std::string,Bucket> buckets_;
+    double rate_;
+    double burst_;
+
+  public:
+    RateLimiter(double rate, double burst);
+    //0 when the request may go ahead, otherwise seconds until a token is available
+    double Take(const std::string& key, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+    bool Enabled() const { return rate_ > 0; }
+  };
+  static constexpr size_t kRateLimiterMaxBuckets = 65536;
+
+  //Work stealing pool for httplib's new_task_queue. Every worker has a deque per class and takes the
+  //highest class it may run, from its own deques first and then from the others'. A class never has
+  //more than its limit of tasks running, so bulk work can't take every worker
+  class PriorityExecutor : public httplib::TaskQueue {
+  private:
+    struct Task {
+      std::function<void()> fn;
+      std::chrono::steady_clock::time_point queued_at;
+    };
+    struct Worker {
+      std::mutex mutex;
+      std::array<std::deque<Task>,kTaskClasses> queues;
+      std::thread thread;
+    };
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::array<size_t,kTaskClasses> limits_;
+    std::array<std::atomic<size_t>,kTaskClasses> queued_ {};
+    std::array<std::atomic<size_t>,kTaskClasses> running_ {};
+    std::array<std::atomic<uint64_t>,kTaskClasses> completed_ {};
+    std::array<std::atomic<uint64_t>,kTaskClasses> wait_us_ {};
+    std::array<std::atomic<uint64_t>,kTaskClasses> max_wait_us_ {};
+    std::array<std::atomic<uint64_t>,kTaskClasses> rejected_ {};
+    //CoDel state, when the delay first went over the target plus an interval, in steady clock us
+    std::array<std::atomic<int64_t>,kTaskClasses> above_until_us_ {};
+    std::array<std::atomic<bool>,kTaskClasses> shedding_ {};
+    AdmissionConfig admission_;
+    std::atomic<size_t> next_ {0};
+    //Bumped whenever a task may have become runnable, idle workers sleep until it moves
+    std::mutex signal_mutex_;
+    std::condition_variable wake_;
+    uint64_t signal_ = 0;
+    bool stopping_ = false;
+
+    void Signal();
+    void TrackDelay(size_t cls, std::chrono::steady_clock::time_point now, uint64_t wait_us);
+    bool TryRun(size_t self);
+    void WorkerLoop(size_t self);
+
+  public:
+    PriorityExecutor(size_t threads, std::array<size_t,kTaskClasses> limits, AdmissionConfig admission = {});
+    ~PriorityExecutor() override;
+    //httplib's entry point, whole connections in thread per connection mode, run as interactive
+    void enqueue(std::function<void()> fn) override;
+    void Enqueue(std::function<void()> fn, TaskClass task_class);
+    //Asked before Enqueue, rejections are counted
+    Admission Admit(TaskClass task_class);
+    //Seconds a shed client is told to wait
+    int RetryAfterSec() const;
+    //Runs what is queued, then joins the workers
+    void shutdown() override;
+    //Queue depth, running tasks, limit, completed tasks and queueing delay per class
+    JSONData Stats() const;
+  };
+  //Interactive requests may use every worker, the other classes only part of them
+  std::array<size_t,kTaskClasses> DefaultClassLimits(size_t threads);
+
+  //Framing of the first request buffered on a connection
+  struct RequestFrame {
+    //0 while more bytes are needed
+    size_t length = 0;
+    //Body over the limit, it is not waited for, the handler rejects the request and the connection closes
+    bool oversized = false;
+  };
+  RequestFrame FrameHttpRequest(std::string_view buffer, size_t max_body);
+
+  //Headers that don't end within this many bytes close the connection
+  static constexpr size_t kMaxRequestHeaderBytes = 65536;
+  //Idle keep-alive connections cost a socket and a buffer, so they are kept a while
+  static constexpr int kEventIdleTimeoutSec = 120;
+
+  //The routes of an httplib::Server behind an epoll front end. A few I/O threads move bytes and park idle
+  //keep-alive connections, complete requests go to the compute task queue. Connections are owned by one
+  //loop thread each and are only ever touched by it or, while busy, by the single task serving them
+  class EventServer : public httplib::Server {
+  private:
+    struct Connection;
+    struct Loop;
+    std::vector<std::unique_ptr<Loop>> loops_;
+    std::unique_ptr<httplib::TaskQueue> compute_;
+    //Set when compute_ is one, requests are then queued by their class
+    PriorityExecutor* prioritized_ = nullptr;
+    std::atomic<bool> stopping_{false};
+
+    void RunLoop(Loop& loop);
+    //Called on the loop thread whenever the connection is not busy
+    void Resume(Loop& loop, Connection* conn);
+    void Arm(Loop& loop, Connection* conn, uint32_t events);
+    void Close(Loop& loop, Connection* conn);
+    void Dispatch(Loop& loop, Connection* conn, RequestFrame frame);
+
+  public:
+    EventServer();
+    ~EventServer();
+    //Blocks like listen(), falls back to it where there is no epoll
+    bool ListenEvented(const std::string& host, int port, size_t io_threads);
+    void StopEvented();
+  };
 
+  class CSVApp {
+  private:
+    sqlite3 *db_handle_;
+    EventServer svr_;
+    //Single connection means a single writer transaction at a time
+    std::mutex write_mutex_;
+    //Column lists of known tables, dropped whenever a table is (re)created or deleted
+    std::mutex schema_mutex_;
+    std::unordered_map<std::string,std::vector<std::string>> schema_cache_;
+    std::unordered_map<std::string,std::string> read_source_cache_;
+    std::unordered_map<std::string,std::string> table_schema_cache_;
+    //New tables go to shard_schemas_. Every attached shard is in attached_schemas_, including those
+    //a lowered shard count left out that still hold tables
+    std::vector<std::string> shard_schemas_;
+    std::vector<std::string> attached_schemas_;
+    //Source table of every rollup, as recorded in main.Rollups
+    std::unordered_map<std::string,std::string> rollup_sources_;
+    //Upload statistics by table, loaded from main.ColumnStats on first use
+    std::unordered_map<std::string,std::vector<ColumnStats>> stats_cache_;
+    //Bumped by every write to a table, part of every cache key and ETag
+    std::mutex generation_mutex_;
+    std::unordered_map<std::string,uint64_t> generations_;
+    //Generations start over with the process, the epoch keeps ETags from before a restart from matching
+    uint64_t epoch_;
+    //Hash indexes by table and column along with the generation they were built from
+    struct CachedHashIndex {
+      uint64_t generation;
+      std::shared_ptr<const HashIndex> index;
+      uint64_t last_used;
+    };
+    std::mutex hash_index_mutex_;
+    std::map<std::pair<std::string,std::string>,CachedHashIndex> hash_indexes_;
+    size_t hash_index_bytes_ = 0;
+    uint64_t hash_index_clock_ = 0;
+    ViewCache view_cache_;
+    StorageProfile profile_;
+    std::mutex jobs_mutex_;
+    std::map<uint64_t,IngestJob> jobs_;
+    uint64_t next_job_ = 1;
+    //Made and owned by svr_, read by /metrics
+    std::atomic<PriorityExecutor*> executor_ {nullptr};
+    AdmissionConfig admission_;
+    RateLimiter ip_limiter_;
+    std::atomic<uint64_t> rate_limited_ {0};
+    //Empty for in memory dbs, which other connections can't open
+    std::unique_ptr<DbReaderPool> readers_;
+    //Last so its workers are stopped before anything they use goes away
+    IngestScheduler ingest_;
 
-    void TryExecSimpleQuery(const std::string& query);
+    bool TryExecSimpleQuery(const std::string& query);
+    //Steps through whatever the pragma returns, the first value is handed back
+    std::string DbApplyPragma(const std::string& pragma);
 
     void DbSetup();
+    void DbOpenReaders(const std::string& db_file);
+    void DbAttachHeldShards(const std::string& db_file);
+    //Hidden tables and staging files of uploads cut off by a crash or restart
+    void DbDropPublishLeftovers(const std::string& db_file);
+    //Runs fn on a reader connection and waits for it, on the shared connection when there are none
+    template <typename Fn>
+    auto DbRead(Fn fn) -> decltype(fn(std::declval<sqlite3*>())) {
+      return readers_?readers_->Run(std::move(fn)):fn(db_handle_);
+    }
     Role DbCheckUser(const std::string& username);
     int DbRegUser(const std::string& username);
-    void DbUpload(const std::string& name,
+    //Without a job one is made up, false when the table could not be published. The job then
+    //tells why, along with the status to answer with
+    bool DbUpload(const std::string& name,
 		  const std::string& content,
 		  char separator = ',',
-		  size_t batch_size = 100);
+		  SearchMode search_mode = NoSearch,
+		  bool replace = false,
+		  const std::vector<ColumnSpec>& declared = {},
+		  uint64_t job = 0);
+    //Caller holds the write lock
+    bool DbRegisterTable(const std::string& name, const std::string& schema);
+    void DbLoadRollups();
+    std::vector<std::string> RollupsOf(const std::string& source);
+    bool IsRollup(const std::string& name);
+    //Builds the rollup and registers it as a table, false if SQLite refused any of it.
+    //commit_failed tells the build went through but its commit did not
+    bool DbCreateRollup(const RollupSpec& spec, const std::string& definition, bool& commit_failed);
+    //Recompute and re-trigger the rollups of a source that was just replaced, dropping the ones that
+    //no longer fit its columns. Caller holds the write lock inside a transaction
+    void DbRestoreRollups(const std::string& source, const std::string& schema);
+    //Records the upload's statistics and hands SQLite's planner the same numbers through sqlite_stat1
+    //Caller holds the write lock inside a transaction
+    void DbStoreColumnStats(const std::string& table_name, const std::string& schema,
+			    const std::vector<ColumnStats>& stats);
+    std::vector<ColumnStats> DbTableStats(const std::string& table_name);
+    std::optional<ColumnStats> DbColumnStats(const std::string& table_name, const std::string& col);
+    //Histogram cut on the leading sort column for a scan that only needs the first rows of the order
+    std::string SortPruneFilter(const std::string& table_name,
+				const std::vector<std::pair<std::string,bool>>& sorts,
+				uint64_t leading);
+    std::string StagingFileName(uint64_t job);
+    uint64_t NewJob(const std::string& table_name);
+    void SetJobState(uint64_t job, const std::string& state, const std::string& message = "");
+    void FailJob(uint64_t job, int status, const std::string& message);
+    void SetJobProgress(uint64_t job, size_t loaded, size_t rejected, size_t total);
+    void SetJobIndexProgress(uint64_t job, size_t built, size_t total);
+    std::optional<IngestJob> JobStatus(uint64_t job);
+    std::vector<std::string> DbQueryColListOfType(const std::string& table_name, const std::string& type,
+						  const std::string& schema);
+    bool DbHasSearchIndex(const std::string& table_name);
+    //nullopt on a malformed match expression
+    std::optional<JSONData> DbSearchTable(const std::string& table_name,
+					  const std::string& match,
+					  const std::pair<uint32_t,uint32_t> row_range);
     std::vector<std::string> DbQueryTableList();
     std::vector<std::string> DbQueryColList(const std::string& table_name);
+    //nullopt when the table is not registered
+    std::optional<std::vector<std::string>> DbCachedColList(const std::string& table_name);
+    void DbInvalidateSchema(const std::string& table_name);
+    //Qualified name to read decoded rows of a table from
+    std::string DbReadSource(const std::string& table_name);
+    //Attached database holding the table, main for unsharded and unknown tables
+    std::string DbTableSchema(const std::string& table_name);
+    uint64_t TableGeneration(const std::string& table_name);
+    void BumpGeneration(const std::string& table_name);
     JSONData DbQueryList();
     uint32_t DbQueryTableSize(const std::string& table_name);
+    //max(rowid), an index lookup rather than a scan
+    int64_t DbEstimateRows(const std::string& table_name);
+    RowidSample DbSampleRowids(const std::string& table_name, size_t n, uint64_t seed);
+    bool DbHasLeadingIndex(const std::string& table_name, const std::string& col);
+    //Column declared INTEGER PRIMARY KEY, if any
+    std::optional<std::string> DbKeyColumn(const std::string& table_name);
+    //nullptr when the table is too large to keep one in memory
+    std::shared_ptr<const HashIndex> DbHashIndex(const std::string& table_name, const std::string& col);
+    //Rows whose col equals one of the keys in key order, the key column goes straight to the rowid
+    JSONData DbLookupRows(const std::string& table_name,
+			  const std::string& col,
+			  const std::vector<std::string>& keys);
+    std::vector<int64_t> DbExternalSort(const std::string& table_name,
+					const std::vector<std::pair<std::string,bool>>& sorts,
+					const std::pair<uint32_t,uint32_t> window);
+    std::vector<int64_t> DbTopKSort(const std::string& table_name,
+				    const std::vector<std::pair<std::string,bool>>& sorts,
+				    const std::pair<uint32_t,uint32_t> window);
+    //Sorts by priority. With sample set the rows are that many random probes in rowid order,
+    //sorts and range are ignored
     JSONData DbQueryTable(const std::string& table_name,
 			  const std::vector<std::string>& cols,
-			  const std::unordered_map<std::string,bool> sorts,
-			  const std::pair<uint32_t,uint32_t> row_range);
+			  const std::vector<std::pair<std::string,bool>>& sorts,
+			  const std::pair<uint32_t,uint32_t> row_range,
+			  size_t sample = 0, uint64_t seed = 0);
+    //Exact GROUP BY when sample is 0, estimates with error bounds from sample probes otherwise
+    //An empty value_col counts rows, an empty group_col makes a single group
+    JSONData DbAggregate(const std::string& table_name,
+			 AggregateOp op,
+			 const std::string& value_col,
+			 const std::string& group_col,
+			 size_t sample, uint64_t seed);
     void DbDeleteTable(const std::string& table_name);
-    void DbUpdateRow(const std::string& name,
-		     const JSONData& row,
-		     uint32_t at_row);
-    void DbAppendRow(const std::string& name,
-		     const JSONData& row);
+    //Table, dictionaries, decoded view, search index and catalog entry. Caller holds the write lock
+    void DbDropTableObjects(const std::string& table_name, const std::string& schema);
+    //Upserts at at_row or appends when there is none, returns the written rowid or -1
+    int64_t DbUpdateRow(const std::string& name,
+			const JSONDocument& row,
+			uint32_t row_node,
+			std::optional<int64_t> at_row);
+    //Returns per-operation results as packed JSON objects, none when the transaction can't start.
+    //commit_failed tells the commit itself failed, every operation is then rolled back
+    std::optional<std::vector<std::string>> DbApplyBatch(const std::string& name,
+							 const std::vector<std::string>& cols,
+							 const BatchOps& batch,
+							 bool atomic,
+							 bool& commit_failed);
 
     void HandleUpload(const httplib::Request& req,
 		      httplib::Response& res);
@@ -94,13 +1047,31 @@ namespace fiasco {
 			  httplib::Response& res);
     void HandleTableUpdate(const httplib::Request& req,
 			   httplib::Response& res);
+    void HandleBatch(const httplib::Request& req,
+		     httplib::Response& res);
+    void HandleSearch(const httplib::Request& req,
+		      httplib::Response& res);
+    void HandleUploadStatus(const httplib::Request& req,
+			    httplib::Response& res);
+    void HandleGet(const httplib::Request& req,
+		   httplib::Response& res);
+    void HandleMetrics(const httplib::Request& req,
+		       httplib::Response& res);
+    void HandleAggregate(const httplib::Request& req,
+			 httplib::Response& res);
+    void HandleRollup(const httplib::Request& req,
+		      httplib::Response& res);
+    //Pre-routing token bucket check, answers 429 itself when the client is over its rate
+    httplib::Server::HandlerResponse AdmitClient(const httplib::Request& req,
+						 httplib::Response& res);
     
   public:
     //Setup the DB if need be and setup request handlers
-    CSVApp(const std::string& db_file, bool in_memory = false);
+    CSVApp(const std::string& db_file, bool in_memory = false, StorageProfile profile = {},
+	   AdmissionConfig admission = {});
     virtual ~CSVApp();
-    //Passthrough to svr.listen()
-    void Run(std::string addr, int port);
+    //Passthrough to svr.listen(), or the epoll front end with io_threads event loops
+    void Run(std::string addr, int port, size_t io_threads = 0);
   };
 }
   
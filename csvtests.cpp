@@ -1,5 +1,8 @@
 #include <gtest/gtest.h>
 #include "csvloadapp.hpp"
+#include <atomic>
+#include <cmath>
+#include <future>
 
 TEST(JSONPackTest, EmptyJSONPack) {
   EXPECT_EQ(std::string {"{}"},
@@ -177,3 +180,863 @@ TEST(JSONParse, ScreenedJSON) {
     EXPECT_EQ((*maybe_json)["param1"],"\"screened_value\"");
   }
 }
+
+TEST(JSONParse, TypedValues) {
+  std::string json {
+    "{\"int\":-42,\"float\":2.5e1,\"null\":null,\"flag\":true,\"arr\":[1,[2],{}],\"str\":\"x\"}"
+  };
+  auto doc = fiasco::ParseJSON(json);
+  EXPECT_TRUE(doc);
+  if (doc) {
+    EXPECT_EQ(fiasco::JSONValue::Object,(*doc)[0].kind);
+    EXPECT_EQ(6,(*doc)[0].size);
+    auto int_val = doc->Find(0,"int");
+    auto float_val = doc->Find(0,"float");
+    auto arr_val = doc->Find(0,"arr");
+    EXPECT_TRUE(int_val && float_val && arr_val);
+    if (int_val && float_val && arr_val) {
+      EXPECT_EQ(fiasco::JSONValue::Int,(*doc)[*int_val].kind);
+      EXPECT_EQ(-42,(*doc)[*int_val].int_val);
+      EXPECT_EQ(fiasco::JSONValue::Float,(*doc)[*float_val].kind);
+      EXPECT_DOUBLE_EQ(25.0,(*doc)[*float_val].float_val);
+      EXPECT_EQ(3,(*doc)[*arr_val].size);
+      EXPECT_EQ("[1,[2],{}]",(*doc)[*arr_val].text);
+    }
+    EXPECT_EQ(fiasco::JSONValue::Null,(*doc)[*doc->Find(0,"null")].kind);
+    EXPECT_FALSE(doc->Find(0,"missing"));
+  }
+}
+
+TEST(JSONParse, UnicodeEscapes) {
+  std::string json {
+    "[\"caf\\u00e9\",\"\\ud83d\\ude00\",\"long string without any escapes in it\\n\"]"
+  };
+  auto doc = fiasco::ParseJSON(json);
+  EXPECT_TRUE(doc);
+  if (doc) {
+    auto fst = doc->FirstChild(0);
+    auto snd = doc->Next(fst);
+    auto thd = doc->Next(snd);
+    EXPECT_EQ("caf\xc3\xa9",(*doc)[fst].text);
+    EXPECT_EQ("\xf0\x9f\x98\x80",(*doc)[snd].text);
+    EXPECT_EQ("long string without any escapes in it\n",(*doc)[thd].text);
+  }
+  EXPECT_FALSE(fiasco::ParseJSON("[\"\\ud83d\"]"));
+}
+
+TEST(JSONParse, InvalidJSON) {
+  EXPECT_FALSE(fiasco::ParseJSON("[1,]"));
+  EXPECT_FALSE(fiasco::ParseJSON("01"));
+  EXPECT_FALSE(fiasco::ParseJSON("{\"a\" 1}"));
+  EXPECT_FALSE(fiasco::ParseJSON("\"tab\tinside\""));
+  EXPECT_FALSE(fiasco::ParseJSON("{} {}"));
+  EXPECT_TRUE(fiasco::ParseJSON("{} {}",true));
+}
+
+TEST(BatchParse, NDJSONOps) {
+  std::string ndjson {
+    "{\"_rowid\":2,\"name\":\"bob\"}\n{\"_op\":\"delete\",\"_rowid\":\"1\"}\n"
+  };
+  auto ops = fiasco::ParseBatchOps(ndjson);
+  EXPECT_TRUE(ops);
+  if (ops) {
+    EXPECT_EQ(2,ops->ops.size());
+    EXPECT_EQ("bob",ops->doc[*ops->doc.Find(ops->ops[0],"name")].text);
+    EXPECT_EQ("delete",ops->doc[*ops->doc.Find(ops->ops[1],"_op")].text);
+  }
+}
+
+TEST(BatchParse, ArrayOps) {
+  std::string valid_array {
+    "[{\"name\":\"}{\"} , {\"_rowid\":3}]"
+  };
+  std::string invalid_array {
+    "[{\"name\":\"bob\"} {\"_rowid\":3}]"
+  };
+  auto ops = fiasco::ParseBatchOps(valid_array);
+  EXPECT_FALSE(fiasco::ParseBatchOps(invalid_array));
+  EXPECT_FALSE(fiasco::ParseBatchOps("[1,2]"));
+  EXPECT_TRUE(ops);
+  if (ops) {
+    EXPECT_EQ(2,ops->ops.size());
+    EXPECT_EQ("}{",ops->doc[*ops->doc.Find(ops->ops[0],"name")].text);
+  }
+}
+
+TEST(BatchQuery, Upsert) {
+  EXPECT_EQ(std::string {"INSERT INTO main.\"t\" (rowid,\"a\",\"b\") VALUES (?,?,?) "
+			 "ON CONFLICT(rowid) DO UPDATE SET \"a\"=excluded.\"a\",\"b\"=excluded.\"b\";"},
+	    fiasco::BuildUpsertQuery("t",{"a","b"}));
+  EXPECT_EQ(std::string {"INSERT INTO main.\"t\" (rowid) VALUES (?) ON CONFLICT(rowid) DO NOTHING;"},
+	    fiasco::BuildUpsertQuery("t",{}));
+}
+
+TEST(SearchQuery, PhraseQuoting) {
+  EXPECT_EQ(std::string {"\"say \"\"hi\"\" OR\""},
+	    fiasco::QuoteSearchPhrase("say \"hi\" OR"));
+}
+
+TEST(SearchQuery, InclusiveWindow) {
+  EXPECT_EQ(101,fiasco::WindowRows({0,100}));
+  EXPECT_EQ(1,fiasco::WindowRows({5,5}));
+  EXPECT_EQ(0,fiasco::WindowRows({6,5}));
+  EXPECT_EQ(uint64_t(1) << 32,fiasco::WindowRows({0,UINT32_MAX}));
+}
+
+TEST(SearchQuery, IndexKeptInSync) {
+  auto queries = fiasco::BuildSearchIndexQueries("t",{"a"},fiasco::TrigramSearch);
+  EXPECT_EQ(5,queries.size());
+  EXPECT_EQ(std::string {"CREATE VIRTUAL TABLE main.\"t__fts\" USING fts5(\"a\", content='t', "
+			 "content_rowid='rowid', tokenize='trigram');"},
+	    queries[0]);
+  EXPECT_EQ(std::string {"CREATE TRIGGER main.\"t__fts_ad\" AFTER DELETE ON \"t\" BEGIN "
+			 "INSERT INTO \"t__fts\"(\"t__fts\",rowid,\"a\") VALUES ('delete',old.rowid,old.\"a\"); END;"},
+	    queries[3]);
+}
+
+TEST(SearchQuery, StagedIndexRenamedOnPublish) {
+  auto queries = fiasco::BuildStagedSearchIndexQueries("t","t__publish1",{"a","b"},fiasco::WordSearch,"target");
+  EXPECT_EQ(2,queries.size());
+  EXPECT_EQ(std::string {"CREATE VIRTUAL TABLE target.\"t__publish1__fts\" USING fts5(\"a\",\"b\", content='t', "
+			 "content_rowid='rowid');"},
+	    queries[0]);
+  EXPECT_EQ(std::string {"INSERT INTO target.\"t__publish1__fts\"(rowid,\"a\",\"b\") SELECT rowid,\"a\",\"b\" "
+			 "FROM target.\"t__publish1\";"},
+	    queries[1]);
+  EXPECT_EQ(3,fiasco::BuildSearchTriggerQueries("t",{"a"}).size());
+}
+
+TEST(ViewCacheTest, HitAndMiss) {
+  fiasco::ViewCache cache(4,1024);
+  EXPECT_EQ(nullptr,cache.Get("a"));
+  cache.Put("a",std::make_shared<const std::string>("body"));
+  auto hit = cache.Get("a");
+  EXPECT_NE(nullptr,hit);
+  if (hit) {
+    EXPECT_EQ("body",*hit);
+  }
+}
+
+TEST(ViewCacheTest, SortsInRequestOrder) {
+  EXPECT_EQ((std::vector<std::pair<std::string,bool>> {{"2",false},{"0",true},{"1",false}}),
+	    fiasco::OrderedSortParams("/view?name=t&desc=2&from=0&asc=0&col=1&desc=1"));
+  EXPECT_EQ((std::vector<std::pair<std::string,bool>> {{"1",true},{"",false}}),
+	    fiasco::OrderedSortParams("/view?asc=%31&descx=3&desc="));
+  EXPECT_TRUE(fiasco::OrderedSortParams("/view").empty());
+}
+
+TEST(ViewCacheTest, ETagListMatching) {
+  EXPECT_TRUE(fiasco::ETagMatches("\"abc\"","\"abc\""));
+  EXPECT_TRUE(fiasco::ETagMatches("\"x\", W/\"abc\" ","\"abc\""));
+  EXPECT_TRUE(fiasco::ETagMatches("*","\"abc\""));
+  //Substrings of a listed tag and empty entries are no match
+  EXPECT_FALSE(fiasco::ETagMatches("\"xabcx\"","\"abc\""));
+  EXPECT_FALSE(fiasco::ETagMatches("\"abc\"x, ,","\"abc\""));
+  EXPECT_FALSE(fiasco::ETagMatches("","\"abc\""));
+}
+
+TEST(ViewCacheTest, EvictsLeastRecentlyUsed) {
+  // Single shard of 30 bytes fits two of these entries
+  fiasco::ViewCache cache(1,30);
+  cache.Put("k1",std::make_shared<const std::string>("0123456789"));
+  cache.Put("k2",std::make_shared<const std::string>("0123456789"));
+  cache.Get("k1");
+  cache.Put("k3",std::make_shared<const std::string>("0123456789"));
+  EXPECT_NE(nullptr,cache.Get("k1"));
+  EXPECT_EQ(nullptr,cache.Get("k2"));
+  EXPECT_NE(nullptr,cache.Get("k3"));
+  cache.Put("huge",std::make_shared<const std::string>(std::string(100,'x')));
+  EXPECT_EQ(nullptr,cache.Get("huge"));
+}
+
+TEST(SortKeyTest, MatchesSQLiteOrder) {
+  auto num = [](double val, int64_t exact) {
+    std::string key;
+    fiasco::AppendNumericKey(key,val,exact,false);
+    return key;
+  };
+  auto text = [](std::string_view val) {
+    std::string key;
+    fiasco::AppendBytesKey(key,val,false,false);
+    return key;
+  };
+  std::string null_key;
+  fiasco::AppendNullKey(null_key,false);
+  EXPECT_LT(null_key,num(-1e300,INT64_MIN));
+  EXPECT_LT(num(-2.5,-2),num(-1,-1));
+  EXPECT_LT(num(-0.0,0),num(0.5,0));
+  EXPECT_EQ(num(-0.0,0),num(0,0));
+  EXPECT_LT(num(9007199254740992.0,9007199254740992),num(9007199254740992.0,9007199254740993));
+  EXPECT_LT(num(1e300,INT64_MAX),text(""));
+  EXPECT_LT(text("a"),text(std::string_view("a\0",2)));
+  EXPECT_LT(text(std::string_view("a\0",2)),text("a\x01"));
+  EXPECT_LT(text("ab"),text("b"));
+}
+
+TEST(SortKeyTest, DescendingAndRowid) {
+  std::string low, high;
+  fiasco::AppendBytesKey(low,"a",false,true);
+  fiasco::AppendBytesKey(high,"ab",false,true);
+  EXPECT_GT(low,high);
+  fiasco::AppendRowidKey(low,-5);
+  EXPECT_EQ(-5,fiasco::RowidFromKey(low));
+}
+
+TEST(ExternalSortTest, WindowAcrossRuns) {
+  // Tiny budget forces many runs, most of them spilled
+  fiasco::ExternalSorter sorter(30,2048,3);
+  for (int64_t rowid = 1; rowid <= 1000; ++rowid) {
+    std::string key;
+    fiasco::AppendNumericKey(key,static_cast<double>(rowid % 97),rowid % 97,true);
+    fiasco::AppendRowidKey(key,rowid);
+    sorter.Add(key);
+  }
+  auto rowids = sorter.Finish(10);
+  ASSERT_EQ(20,rowids.size());
+  // Ten rows hold 96 and are skipped, ties keep rowid order
+  EXPECT_EQ(95,rowids[0]);
+  EXPECT_EQ(968,rowids[9]);
+  EXPECT_EQ(94,rowids[10]);
+}
+
+TEST(TopKTest, PartitionedHeapsMerge) {
+  std::vector<std::vector<std::string>> parts;
+  for (int64_t part = 0; part < 4; ++part) {
+    fiasco::TopKHeap heap(5);
+    for (int64_t rowid = part * 100 + 1; rowid <= (part + 1) * 100; ++rowid) {
+      std::string key;
+      fiasco::AppendNumericKey(key,static_cast<double>(rowid % 50),rowid % 50,false);
+      fiasco::AppendRowidKey(key,rowid);
+      heap.Offer(key);
+    }
+    auto kept = heap.Take();
+    EXPECT_EQ(5,kept.size());
+    EXPECT_TRUE(std::is_sorted(kept.begin(),kept.end()));
+    parts.push_back(std::move(kept));
+  }
+  // Every partition holds two zeros and two ones, the window skips the zeros
+  auto rowids = fiasco::MergeTopK(std::move(parts),10,8);
+  ASSERT_EQ(2,rowids.size());
+  EXPECT_EQ(1,rowids[0]);
+  EXPECT_EQ(51,rowids[1]);
+}
+
+TEST(DictionaryTest, SplitAndUnquote) {
+  std::vector<std::string_view> fields;
+  fiasco::SplitFields("1,\"DE\",,'x'\r",',',fields);
+  ASSERT_EQ(4,fields.size());
+  EXPECT_EQ("DE",fiasco::UnquoteField(fields[1]));
+  EXPECT_EQ("",fields[2]);
+  EXPECT_EQ("x",fiasco::UnquoteField(fields[3]));
+  EXPECT_EQ("\"",fiasco::UnquoteField("\""));
+}
+
+TEST(DictionaryTest, DetectsLowCardinality) {
+  std::string csv;
+  for (size_t ind = 0; ind < 2000; ++ind) {
+    csv += std::to_string(ind) + ",\"" + (ind % 3 ? "DE" : "US") + "\",name" + std::to_string(ind) + "\n";
+  }
+  auto lines = fiasco::SplitIntoViews(csv);
+  auto dicts = fiasco::DetectDictionaries(csv,lines,0,fiasco::DetectTypes(csv.substr(0,csv.find('\n'))));
+  ASSERT_EQ(3,dicts.size());
+  EXPECT_TRUE(dicts[0].empty());
+  ASSERT_EQ(2,dicts[1].size());
+  EXPECT_EQ("DE",dicts[1][0]);
+  EXPECT_EQ("US",dicts[1][1]);
+  EXPECT_TRUE(dicts[2].empty());
+  // Empty fields are NULLs, not a value of the dictionary
+  csv += "2000,,name\n";
+  lines = fiasco::SplitIntoViews(csv);
+  EXPECT_EQ(2,fiasco::DetectDictionaries(csv,lines,0,{fiasco::Types::Int,fiasco::Types::String})[1].size());
+  // Too few rows to bother
+  auto small = fiasco::DetectDictionaries(csv,lines,1990,{fiasco::Types::Int,fiasco::Types::String});
+  EXPECT_TRUE(small[1].empty());
+}
+
+TEST(DictionaryTest, TriggersEncodeEveryValue) {
+  sqlite3* db = nullptr;
+  ASSERT_EQ(SQLITE_OK,sqlite3_open(":memory:",&db));
+  auto exec = [db](const std::string& sql) {
+    return sqlite3_exec(db,sql.c_str(),nullptr,nullptr,nullptr) == SQLITE_OK;
+  };
+  ASSERT_TRUE(exec("CREATE TABLE t (a int, b dict_blob);"));
+  for (const auto& query : fiasco::BuildDictionaryQueries("t","b")) {
+    ASSERT_TRUE(exec(query));
+  }
+  ASSERT_TRUE(exec(fiasco::BuildDecodedView("t",{"a","b"},{false,true})));
+  ASSERT_TRUE(exec("INSERT INTO t VALUES (1,'x'), (2,1.5), (3,NULL);"));
+  //JSON numbers for a coded column are bound as text, not taken for codes
+  auto doc = fiasco::ParseJSON("[7]");
+  ASSERT_TRUE(doc);
+  {
+    fiasco::Statement insert(db,"INSERT INTO t VALUES (?,?);","Test");
+    insert.Bind(1,int64_t {4});
+    fiasco::BindJSONValue(insert.get(),2,(*doc)[doc->FirstChild(0)],true);
+    insert.Step();
+  }
+  ASSERT_TRUE(exec("UPDATE t SET b = 'x' WHERE a = 2;"));
+  ASSERT_TRUE(exec("INSERT INTO t (rowid, a, b) VALUES (1, 1, '7') ON CONFLICT(rowid) DO UPDATE SET b = excluded.b;"));
+  ASSERT_TRUE(exec("INSERT INTO t (rowid, a, b) VALUES (1, 1, 'x') ON CONFLICT(rowid) DO UPDATE SET b = excluded.b;"));
+
+  fiasco::Statement codes(db,"SELECT count(*) FROM t WHERE b IS NOT NULL AND typeof(b) != 'integer';","Test");
+  ASSERT_TRUE(codes.Step());
+  EXPECT_EQ(0,sqlite3_column_int(codes.get(),0));
+  fiasco::Statement decoded(db,"SELECT b FROM t__decoded ORDER BY a;","Test");
+  std::vector<std::string> values;
+  while (decoded.Step()) {
+    values.push_back(fiasco::ColumnToString(decoded.get(),0));
+  }
+  EXPECT_EQ((std::vector<std::string> {"x","x","","7"}),values);
+  sqlite3_close(db);
+}
+
+TEST(DictionaryTest, DecodedView) {
+  EXPECT_EQ(std::string {"CREATE VIEW main.\"t__decoded\" AS SELECT base.rowid AS rowid, base.\"a\" AS \"a\", "
+			 "d1.value AS \"b\" FROM \"t\" AS base LEFT JOIN \"t__dict_b\" AS d1 ON d1.code = base.\"b\";"},
+	    fiasco::BuildDecodedView("t",{"a","b"},{false,true}));
+}
+
+TEST(StorageProfileTest, ConfigFile) {
+  auto profile = fiasco::ParseStorageProfile("# bulk box\njournal_mode = wal\n\npage_size=8192 # bigger\n"
+					     "synchronous = off\nbulk_load = false\n");
+  ASSERT_TRUE(profile.has_value());
+  EXPECT_EQ("WAL",profile->journal_mode);
+  EXPECT_EQ(8192,profile->page_size);
+  EXPECT_EQ("OFF",profile->synchronous);
+  EXPECT_FALSE(profile->bulk_load);
+  EXPECT_EQ(std::string {"PRAGMA main.page_size = 8192;"},fiasco::BuildStoragePragmas(*profile)[0]);
+}
+
+TEST(UploadSchemaTest, ParsesColumns) {
+  auto columns = fiasco::ParseUploadSchema("[{\"name\":\"id\",\"type\":\"int\",\"key\":true},"
+					   "{\"name\":\"note\",\"not_null\":true,\"index\":true},"
+					   "{\"name\":\"price\",\"type\":\"real\"}]");
+  ASSERT_TRUE(columns);
+  ASSERT_EQ(3,columns->size());
+  EXPECT_TRUE((*columns)[0].key);
+  EXPECT_EQ(fiasco::Types::Int,(*columns)[0].type);
+  EXPECT_EQ(fiasco::Types::String,(*columns)[1].type);
+  EXPECT_TRUE((*columns)[1].not_null && (*columns)[1].index && !(*columns)[1].key);
+  EXPECT_EQ(fiasco::Types::Float,(*columns)[2].type);
+  EXPECT_EQ(std::string {"CREATE INDEX main.\"t__idx_note\" ON \"t\" (\"note\");"},
+	    fiasco::BuildColumnIndexQuery("t","note"));
+  EXPECT_EQ(std::string {"CREATE INDEX target.\"t__idx_note\" ON \"t__publish3\" (\"note\");"},
+	    fiasco::BuildStagedColumnIndexQuery("t","t__publish3","note","target"));
+}
+
+TEST(UploadSchemaTest, RejectsBadSchemas) {
+  EXPECT_FALSE(fiasco::ParseUploadSchema("[]"));
+  EXPECT_FALSE(fiasco::ParseUploadSchema("{\"name\":\"a\"}"));
+  EXPECT_FALSE(fiasco::ParseUploadSchema("[{\"name\":\"a\",\"type\":\"date\"}]"));
+  EXPECT_FALSE(fiasco::ParseUploadSchema("[{\"name\":\"a\",\"type\":\"text\",\"key\":true}]"));
+  EXPECT_FALSE(fiasco::ParseUploadSchema("[{\"name\":\"a\"},{\"name\":\"a\"}]"));
+  EXPECT_FALSE(fiasco::ParseUploadSchema("[{\"name\":\"a\",\"type\":\"int\",\"key\":true},"
+					 "{\"name\":\"b\",\"type\":\"int\",\"key\":true}]"));
+}
+
+TEST(HashIndexTest, FindsEveryRowOfAKey) {
+  fiasco::HashIndex index;
+  for (int64_t rowid = 1; rowid <= 10000; ++rowid) {
+    index.Insert("key" + std::to_string(rowid % 1000),rowid);
+  }
+  EXPECT_EQ(10000,index.Size());
+  // Grown to stay at most half full
+  EXPECT_GE(index.Bytes(),2 * 10000 * (sizeof(uint64_t) + sizeof(int64_t)));
+  std::vector<int64_t> rowids;
+  index.Lookup("key7",rowids);
+  std::sort(rowids.begin(),rowids.end());
+  std::vector<int64_t> expected;
+  for (int64_t rowid = 7; rowid <= 10000; rowid += 1000) {
+    expected.push_back(rowid);
+  }
+  // Hash collisions may add candidates but never drop a row
+  EXPECT_TRUE(std::includes(rowids.begin(),rowids.end(),expected.begin(),expected.end()));
+  rowids.clear();
+  index.Lookup("key1000",rowids);
+  EXPECT_TRUE(rowids.empty());
+}
+
+TEST(HashIndexTest, KeyList) {
+  auto keys = fiasco::ParseKeyList("[\"a\", 42, 1.5]");
+  ASSERT_TRUE(keys);
+  EXPECT_EQ((std::vector<std::string> {"a","42","1.5"}),*keys);
+  EXPECT_FALSE(fiasco::ParseKeyList("[{\"a\":1}]"));
+  EXPECT_FALSE(fiasco::ParseKeyList("\"a\""));
+}
+
+TEST(EventServerTest, FramesRequests) {
+  std::string get {"GET /view?name=t HTTP/1.1\r\nHost: a\r\n\r\n"};
+  EXPECT_EQ(0,fiasco::FrameHttpRequest(get.substr(0,get.size() - 1),1024).length);
+  EXPECT_EQ(get.size(),fiasco::FrameHttpRequest(get + get,1024).length);
+
+  std::string post {"POST /get HTTP/1.1\r\nContent-Length: 5\r\n\r\n[1,2]"};
+  EXPECT_EQ(0,fiasco::FrameHttpRequest(post.substr(0,post.size() - 1),1024).length);
+  EXPECT_EQ(post.size(),fiasco::FrameHttpRequest(post,1024).length);
+  auto oversized = fiasco::FrameHttpRequest(post,4);
+  EXPECT_TRUE(oversized.oversized);
+  EXPECT_EQ(post.size() - 5,oversized.length);
+
+  std::string chunked {"POST /get HTTP/1.1\r\ntransfer-encoding: Chunked\r\n\r\n3\r\n[1,\r\n2\r\n2]\r\n0\r\n\r\n"};
+  EXPECT_EQ(0,fiasco::FrameHttpRequest(chunked.substr(0,chunked.size() - 2),1024).length);
+  EXPECT_EQ(chunked.size(),fiasco::FrameHttpRequest(chunked + get,1024).length);
+}
+
+TEST(StorageProfileTest, RejectsBadValues) {
+  fiasco::StorageProfile profile;
+  EXPECT_FALSE(fiasco::SetStorageOption(profile,"page_size","1000"));
+  EXPECT_FALSE(fiasco::SetStorageOption(profile,"journal_mode","fast"));
+  EXPECT_FALSE(fiasco::SetStorageOption(profile,"cache_size","12MB"));
+  EXPECT_FALSE(fiasco::SetStorageOption(profile,"locking_mode","EXCLUSIVE"));
+  EXPECT_TRUE(fiasco::SetStorageOption(profile,"cache_size","-200000"));
+  EXPECT_EQ(-200000,profile.cache_size);
+  EXPECT_FALSE(fiasco::ParseStorageProfile("mmap_size 10\n").has_value());
+}
+
+TEST(ShardTest, StablePlacement) {
+  EXPECT_EQ(std::string {"shard3"},fiasco::ShardSchemaName(3));
+  EXPECT_EQ(0,fiasco::ShardForTable("anything",1));
+  EXPECT_EQ(fiasco::ShardForTable("orders",8),fiasco::ShardForTable("orders",8));
+  std::vector<size_t> hits(4);
+  for (size_t ind = 0; ind < 400; ++ind) {
+    ++hits[fiasco::ShardForTable("table" + std::to_string(ind),4)];
+  }
+  for (auto count : hits) {
+    EXPECT_GT(count,50);
+  }
+  EXPECT_EQ(std::string {"DELETE FROM shard1.\"t\" WHERE rowid = ?;"},fiasco::BuildDeleteQuery("t","shard1"));
+}
+
+TEST(IngestTest, SchedulerDrainsOnShutdown) {
+  std::atomic<int> done {0};
+  {
+    fiasco::IngestScheduler scheduler(2);
+    for (int ind = 0; ind < 20; ++ind) {
+      scheduler.Submit([&done]() { ++done; });
+    }
+  }
+  EXPECT_EQ(20,done.load());
+  fiasco::IngestJob job;
+  job.table = "t";
+  auto status = fiasco::PackIngestJob(7,job);
+  EXPECT_EQ("queued",status["state"]);
+  EXPECT_EQ("7",status["job"]);
+}
+
+TEST(PriorityExecutorTest, ClassesAndLimits) {
+  EXPECT_EQ(fiasco::TaskClass::Bulk,fiasco::RouteClass("POST /upload HTTP/1.1"));
+  EXPECT_EQ(fiasco::TaskClass::Update,fiasco::RouteClass("POST /update?name=t HTTP/1.1"));
+  EXPECT_EQ(fiasco::TaskClass::Interactive,fiasco::RouteClass("GET /view?name=t HTTP/1.1"));
+  EXPECT_EQ(fiasco::TaskClass::Interactive,fiasco::RouteClass("GET /uploads HTTP/1.1"));
+  EXPECT_EQ(fiasco::TaskClass::Interactive,fiasco::RouteClass("garbage"));
+
+  std::mutex mutex;
+  std::vector<fiasco::TaskClass> order;
+  std::atomic<int> bulk_running {0};
+  std::atomic<int> bulk_peak {0};
+  std::promise<void> release;
+  auto gate = release.get_future().share();
+  {
+    fiasco::PriorityExecutor executor(1,{1,1,1});
+    //Holds the only worker so the rest queue up behind it
+    executor.Enqueue([gate]() { gate.wait(); },fiasco::TaskClass::Interactive);
+    for (auto cls : {fiasco::TaskClass::Bulk,fiasco::TaskClass::Update,fiasco::TaskClass::Interactive}) {
+      executor.Enqueue([&,cls]() {
+	std::lock_guard<std::mutex> lock(mutex);
+	order.push_back(cls);
+      },cls);
+    }
+    release.set_value();
+  }
+  ASSERT_EQ(3,order.size());
+  EXPECT_EQ(fiasco::TaskClass::Interactive,order[0]);
+  EXPECT_EQ(fiasco::TaskClass::Update,order[1]);
+  EXPECT_EQ(fiasco::TaskClass::Bulk,order[2]);
+
+  {
+    fiasco::PriorityExecutor executor(4,{4,2,1});
+    for (int ind = 0; ind < 8; ++ind) {
+      executor.Enqueue([&]() {
+	int now = ++bulk_running;
+	for (int peak = bulk_peak; now > peak && !bulk_peak.compare_exchange_weak(peak,now);) {
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	--bulk_running;
+      },fiasco::TaskClass::Bulk);
+    }
+    auto stats = executor.Stats();
+    EXPECT_EQ("1",stats["bulk_limit"]);
+  }
+  EXPECT_EQ(1,bulk_peak.load());
+  EXPECT_EQ(2,fiasco::DefaultClassLimits(4)[1]);
+  EXPECT_EQ(1,fiasco::DefaultClassLimits(2)[2]);
+}
+
+TEST(AdmissionTest, BucketsAndQueueLimits) {
+  fiasco::AdmissionConfig config;
+  EXPECT_TRUE(fiasco::SetAdmissionOption(config,"bulk_queue","2"));
+  EXPECT_TRUE(fiasco::SetAdmissionOption(config,"ip_rate","0.5"));
+  EXPECT_FALSE(fiasco::SetAdmissionOption(config,"ip_rate","-1"));
+  EXPECT_FALSE(fiasco::SetAdmissionOption(config,"interval_ms","0"));
+  EXPECT_FALSE(fiasco::SetAdmissionOption(config,"queue","5"));
+  EXPECT_FALSE(fiasco::SetAdmissionOption(config,"user_rate","1"));
+  EXPECT_EQ(2,config.queue_limits[2]);
+  EXPECT_DOUBLE_EQ(0.5,config.ip_rate);
+
+  auto start = std::chrono::steady_clock::now();
+  fiasco::RateLimiter limiter(2,2);
+  EXPECT_EQ(0,limiter.Take("a",start));
+  EXPECT_EQ(0,limiter.Take("a",start));
+  EXPECT_DOUBLE_EQ(0.5,limiter.Take("a",start));
+  EXPECT_EQ(0,limiter.Take("b",start));
+  EXPECT_EQ(0,limiter.Take("a",start + std::chrono::milliseconds(500)));
+
+  auto response = fiasco::BuildRejectResponse(503,2,"Overloaded");
+  EXPECT_EQ(0,response.find("HTTP/1.1 503 Service Unavailable\r\n"));
+  EXPECT_NE(std::string::npos,response.find("Retry-After: 2\r\n\r\nOverloaded"));
+  EXPECT_NE(std::string::npos,response.find("Content-Length: 10\r\n"));
+
+  std::promise<void> release;
+  auto gate = release.get_future().share();
+  fiasco::PriorityExecutor executor(1,{1,1,1},config);
+  executor.Enqueue([gate]() { gate.wait(); },fiasco::TaskClass::Interactive);
+  for (int ind = 0; ind < 2; ++ind) {
+    EXPECT_EQ(fiasco::Admission::Admitted,executor.Admit(fiasco::TaskClass::Bulk));
+    executor.Enqueue([]() {},fiasco::TaskClass::Bulk);
+  }
+  EXPECT_EQ(fiasco::Admission::QueueFull,executor.Admit(fiasco::TaskClass::Bulk));
+  EXPECT_EQ(fiasco::Admission::Admitted,executor.Admit(fiasco::TaskClass::Update));
+  release.set_value();
+  executor.shutdown();
+  EXPECT_EQ("1",executor.Stats()["bulk_rejected"]);
+}
+
+TEST(StatementTest, StepsAndReaderPool) {
+  sqlite3* db = nullptr;
+  ASSERT_EQ(SQLITE_OK,sqlite3_open(":memory:",&db));
+  {
+    fiasco::Statement create(db,"CREATE TABLE t (k INTEGER, v TEXT);","Test");
+    EXPECT_FALSE(create.Step());
+    EXPECT_FALSE(create.Failed());
+    fiasco::Statement insert(db,"INSERT INTO t VALUES (?,?);","Test");
+    for (int64_t ind = 0; ind < 3; ++ind) {
+      auto value = "v" + std::to_string(ind);
+      insert.Bind(1,ind).Bind(2,value);
+      insert.Step();
+      insert.Reset();
+    }
+    fiasco::Statement select(db,"SELECT v FROM t WHERE k >= ? ORDER BY k;","Test");
+    select.Bind(1,int64_t {1});
+    std::vector<std::string> values;
+    while (select.Step()) {
+      values.push_back(fiasco::ColumnToString(select.get(),0));
+    }
+    EXPECT_EQ((std::vector<std::string> {"v1","v2"}),values);
+    fiasco::Statement broken(db,"SELECT nope FROM t;","Test");
+    EXPECT_FALSE(broken.Ok());
+    EXPECT_FALSE(broken.Step());
+  }
+
+  sqlite3* reader = nullptr;
+  ASSERT_EQ(SQLITE_OK,sqlite3_open(":memory:",&reader));
+  fiasco::DbReaderPool pool({reader});
+  auto answer = pool.Run([](sqlite3* conn) {
+    fiasco::Statement query(conn,"SELECT 40 + 2;","Test");
+    return query.Step()?sqlite3_column_int(query.get(),0):0;
+  });
+  EXPECT_EQ(42,answer);
+  EXPECT_EQ(1u,pool.Size());
+  auto queued = pool.Submit([](sqlite3* conn) {
+    return conn != nullptr;
+  });
+  EXPECT_TRUE(queued.get());
+  sqlite3_close(db);
+}
+
+TEST(RequestArenaTest, RowsPackLikeMaps) {
+  sqlite3* db = nullptr;
+  ASSERT_EQ(SQLITE_OK,sqlite3_open(":memory:",&db));
+  fiasco::Statement query(db,"SELECT 7, 'text', NULL, 2.5;","Test");
+  ASSERT_TRUE(query.Step());
+  fiasco::JSONData row;
+  fiasco::RowLayout cols {{"b",0},{"_rowid",1},{"a",2},{"B",3},{"a",1}};
+  for (const auto& [name,ind] : cols) {
+    row[std::string(name)] = fiasco::ColumnToString(query.get(),ind);
+  }
+
+  const void* first = nullptr;
+  for (int round = 0; round < 2; ++round) {
+    fiasco::RequestArena arena;
+    {
+      //Nested scopes share the buffer and leave the rewinding to the outermost one
+      fiasco::RequestArena nested;
+      EXPECT_EQ(arena.get(),nested.get());
+    }
+    std::pmr::vector<std::pmr::string> rows(arena.get());
+    fiasco::AppendJSONRow(rows.emplace_back(),query.get(),fiasco::BuildRowLayout(cols));
+    EXPECT_EQ(fiasco::PackJSON(row),std::string(rows.back()));
+    EXPECT_EQ("[" + fiasco::PackJSON(row) + "]",fiasco::PackJSONArray(rows));
+    if (round == 0) {
+      first = rows.data();
+    }
+    else {
+      EXPECT_EQ(first,rows.data());
+    }
+  }
+  sqlite3_close_v2(db);
+}
+
+TEST(TextBufferTest, NumbersAndPooling) {
+  for (double val : {0.0,1.5,-2.25,1e20,123456.7890123,-0.0000004}) {
+    std::string out;
+    fiasco::AppendNumber(out,val);
+    EXPECT_EQ(std::to_string(val),out);
+  }
+  std::string out;
+  fiasco::AppendNumber(out,int64_t {-9007199254740993});
+  out += ',';
+  fiasco::AppendNumber(out,uint32_t {4000000000u});
+  EXPECT_EQ("-9007199254740993,4000000000",out);
+
+  fiasco::JSONData obj {{"b","2"},{"a","x"}};
+  EXPECT_EQ("{\"a\":\"x\",\"b\":\"2\"}",fiasco::PackJSON(obj));
+  EXPECT_EQ("{}",fiasco::PackJSON({}));
+  EXPECT_EQ("[]",fiasco::PackJSONArray(std::vector<std::string>()));
+
+  const char* data = nullptr;
+  {
+    fiasco::PooledString sql;
+    sql->assign(1000,'x');
+    data = sql->data();
+  }
+  fiasco::PooledString reused;
+  EXPECT_TRUE(reused->empty());
+  EXPECT_EQ(data,reused->data());
+}
+
+TEST(RowBatchTest, TypedCellsAcrossBatches) {
+  sqlite3* db = nullptr;
+  ASSERT_EQ(SQLITE_OK,sqlite3_open(":memory:",&db));
+  {
+    fiasco::Statement create(db,"CREATE TABLE t (a, b);","Test");
+    create.Step();
+    fiasco::Statement insert(db,"INSERT INTO t VALUES (?,?);","Test");
+    for (int64_t ind = 0; ind < 300; ++ind) {
+      auto value = "row" + std::to_string(ind);
+      insert.Bind(1,ind + 5000000000).Bind(2,value);
+      insert.Step();
+      insert.Reset();
+    }
+  }
+  fiasco::Statement select(db,"SELECT a, b, NULL, 0.5 FROM t ORDER BY a;","Test");
+  fiasco::RowBatch batch(4);
+  fiasco::RowLayout layout {{"b",1},{"a",0},{"n",2},{"f",3}};
+  layout = fiasco::BuildRowLayout(layout);
+  std::string contents {"["};
+  std::vector<size_t> sizes;
+  while (batch.Fill(select)) {
+    sizes.push_back(batch.Rows());
+    EXPECT_EQ(fiasco::RowBatch::Kind::Int,batch.At(0,0).kind);
+    EXPECT_EQ(fiasco::RowBatch::Kind::Null,batch.At(0,2).kind);
+    //Text of the earlier batch doesn't leak into this one
+    EXPECT_EQ("row" + std::to_string(batch.At(0,0).num - 5000000000),batch.Text(batch.At(0,1)));
+    fiasco::AppendJSONRows(contents,batch,layout);
+  }
+  contents += ']';
+  EXPECT_EQ((std::vector<size_t> {fiasco::kRowBatchRows,300 - fiasco::kRowBatchRows}),sizes);
+  EXPECT_EQ(0,contents.find("[{\"a\":\"5000000000\",\"b\":\"row0\",\"f\":\"0.500000\",\"n\":\"\"},{\"a\":\"5000000001\""));
+  EXPECT_EQ(299,std::count(contents.begin(),contents.end(),'}') - 1);
+  sqlite3_close_v2(db);
+}
+
+TEST(SampleTest, RowidsAndEstimates) {
+  auto rowids = fiasco::SampleRowids(1000,100,7);
+  ASSERT_EQ(100,rowids.size());
+  EXPECT_TRUE(std::is_sorted(rowids.begin(),rowids.end()));
+  EXPECT_EQ(rowids.end(),std::adjacent_find(rowids.begin(),rowids.end()));
+  EXPECT_GE(rowids.front(),1);
+  EXPECT_LE(rowids.back(),1000);
+  EXPECT_EQ(rowids,fiasco::SampleRowids(1000,100,7));
+  EXPECT_EQ((std::vector<int64_t> {1,2,3}),fiasco::SampleRowids(3,10,7));
+  EXPECT_TRUE(fiasco::SampleRowids(0,10,7).empty());
+
+  EXPECT_EQ(fiasco::AggregateOp::Avg,fiasco::ParseAggregateOp("avg"));
+  EXPECT_FALSE(fiasco::ParseAggregateOp("median"));
+
+  //A quarter of 100 probes out of 10000 slots hit the group, values 1 and 3 half each
+  fiasco::SampleMoments group {25,50,125};
+  auto count = fiasco::EstimateAggregate(fiasco::AggregateOp::Count,group,100,10000);
+  EXPECT_DOUBLE_EQ(2500,count.value);
+  ASSERT_TRUE(count.error);
+  EXPECT_NEAR(1.96 * 10000 * std::sqrt(0.25 * 0.75 / 99 * 0.99),*count.error,1e-6);
+  auto sum = fiasco::EstimateAggregate(fiasco::AggregateOp::Sum,group,100,10000);
+  EXPECT_DOUBLE_EQ(5000,sum.value);
+  auto avg = fiasco::EstimateAggregate(fiasco::AggregateOp::Avg,group,100,10000);
+  EXPECT_DOUBLE_EQ(2,avg.value);
+  EXPECT_NEAR(1.96 * std::sqrt(25.0 / 24 / 25 * 0.99),*avg.error,1e-9);
+  //Every slot probed is a census, one row alone has no spread to go by
+  EXPECT_EQ(0,*fiasco::EstimateAggregate(fiasco::AggregateOp::Sum,group,10000,10000).error);
+  EXPECT_FALSE(fiasco::EstimateAggregate(fiasco::AggregateOp::Avg,{1,3,9},100,10000).error);
+}
+
+TEST(StatsTest, ProfileAndCuts) {
+  fiasco::ColumnProfile numbers("n",true);
+  for (int num = 1000; num > 0; --num) {
+    numbers.Add(std::to_string(num));
+  }
+  for (int ind = 0; ind < 10; ++ind) {
+    numbers.Add(std::nullopt);
+  }
+  auto stats = numbers.Finish();
+  EXPECT_EQ(1010,stats.rows);
+  EXPECT_EQ(10,stats.nulls);
+  EXPECT_NEAR(1000,stats.distinct,50);
+  //Compared as numbers, not as text
+  EXPECT_EQ("1",stats.min);
+  EXPECT_EQ("1000",stats.max);
+  ASSERT_EQ(fiasco::kHistogramBuckets,stats.bounds.size());
+  EXPECT_EQ("62",stats.bounds.front());
+  EXPECT_EQ("1000",stats.bounds.back());
+
+  //100 leading rows take the 10 NULLs and 90 values, two buckets of 62.5 plus one of slack
+  EXPECT_EQ(std::optional<std::string>("187"),fiasco::HistogramCut(stats,100,true));
+  EXPECT_EQ(std::optional<std::string>("812"),fiasco::HistogramCut(stats,100,false));
+  EXPECT_FALSE(fiasco::HistogramCut(stats,1000,true));
+  EXPECT_FALSE(fiasco::HistogramCut(fiasco::ColumnStats(),10,true));
+
+  fiasco::ColumnProfile words("w",false);
+  for (auto word : {"b","a","a","c","10","9"}) {
+    words.Add(word);
+  }
+  auto text = words.Finish();
+  EXPECT_EQ(5,text.distinct);
+  EXPECT_EQ("10",text.min);
+  EXPECT_EQ("c",text.max);
+
+  //A quoted "" is stored as '', a value and not a NULL
+  fiasco::ColumnProfile blanks("b",true);
+  blanks.Add(std::string_view());
+  blanks.Add(std::nullopt);
+  auto blank = blanks.Finish();
+  EXPECT_EQ(2,blank.rows);
+  EXPECT_EQ(1,blank.nulls);
+  EXPECT_EQ("",blank.min);
+
+  EXPECT_EQ("187",fiasco::StatLiteral(stats,"187"));
+  EXPECT_EQ("'abc'",fiasco::StatLiteral(stats,"abc"));
+  EXPECT_EQ("'9'",fiasco::StatLiteral(text,"9"));
+  EXPECT_EQ("'o''k'",fiasco::StatLiteral(text,"o'k"));
+}
+
+TEST(StatsTest, WritesStat1) {
+  sqlite3* db;
+  ASSERT_EQ(SQLITE_OK,sqlite3_open(":memory:",&db));
+  auto exec = [db](const std::string& sql) {
+    fiasco::Statement stmt(db,sql,"Test");
+    stmt.Step();
+    return stmt.Ok() && !stmt.Failed();
+  };
+  auto dump = [db]() {
+    fiasco::Statement stmt(db,"SELECT idx, stat FROM sqlite_stat1 WHERE tbl = 't' ORDER BY idx;","Test");
+    std::string rows;
+    while (stmt.Step()) {
+      rows += fiasco::ColumnToString(stmt.get(),0) + "," + fiasco::ColumnToString(stmt.get(),1) + ";";
+    }
+    return rows;
+  };
+  ASSERT_TRUE(exec("CREATE TABLE t (a, b, c);"));
+  ASSERT_TRUE(exec("CREATE INDEX t_a ON t (a);"));
+  ASSERT_TRUE(exec("CREATE INDEX t_cb ON t (c, b);"));
+  std::vector<fiasco::ColumnStats> stats(3);
+  stats[0].column = "a";
+  stats[0].rows = 1000;
+  stats[0].distinct = 8;
+  stats[1].column = "b";
+  stats[1].rows = 1000;
+  stats[1].distinct = 1000;
+  stats[2].column = "c";
+  stats[2].rows = 1000;
+  // Only indexes led by a profiled column get a row, the table always has its count
+  fiasco::WriteStat1(db,"t","main",stats);
+  EXPECT_EQ(",1000;t_a,1000 125;",dump());
+  // Rewritten rather than added to
+  stats[0].rows = stats[1].rows = stats[2].rows = 10;
+  fiasco::WriteStat1(db,"t","main",stats);
+  EXPECT_EQ(",10;t_a,10 2;",dump());
+  sqlite3_close_v2(db);
+}
+
+TEST(StatsTest, SortsRescanPastStaleCuts) {
+  sqlite3* db;
+  ASSERT_EQ(SQLITE_OK,sqlite3_open(":memory:",&db));
+  {
+    fiasco::Statement create(db,"CREATE TABLE t (x);","Test");
+    create.Step();
+    fiasco::Statement insert(db,"INSERT INTO t VALUES (?);","Test");
+    for (int64_t ind = 0; ind < 100; ++ind) {
+      insert.Bind(1,100 - ind).Step();
+      insert.Reset();
+    }
+  }
+  // x = 1 to 10 sit at rowids 100 down to 91
+  std::vector<int64_t> expected;
+  for (int64_t rowid = 100; rowid > 90; --rowid) {
+    expected.push_back(rowid);
+  }
+  std::vector<std::pair<std::string,bool>> sorts {{"x",true}};
+  std::pair<uint32_t,uint32_t> window {0,10};
+  auto scan_parts = [db,&sorts,&window](const std::string& query_str) {
+    return std::vector<std::vector<std::string>> {fiasco::ScanTopK(db,query_str,sorts,window.second,INT64_MIN,INT64_MAX)};
+  };
+  // A cut from before later writes passing too few rows is dropped, one passing enough is kept
+  for (std::string cut : {"\"x\" <= 3","\"x\" <= 50",""}) {
+    EXPECT_EQ(expected,fiasco::ExternalSortRowids(db,"main.\"t\"",sorts,window,cut)) << cut;
+    EXPECT_EQ(expected,fiasco::TopKSortRowids(scan_parts,"t",sorts,window,cut)) << cut;
+  }
+  sqlite3_close_v2(db);
+}
+
+TEST(RollupTest, TriggersTrackGroupBy) {
+  EXPECT_FALSE(fiasco::ParseRollupSpec("{\"name\":\"r\"}"));
+  EXPECT_FALSE(fiasco::ParseRollupSpec("{\"name\":\"r\",\"table\":\"t\",\"group\":[\"a\\\"b\"]}"));
+  auto spec = fiasco::ParseRollupSpec("{\"name\":\"r\",\"table\":\"t\",\"group\":[\"country\"],"
+				      "\"aggregates\":[\"price\"],\"where\":{\"state\":\"o'k\"}}");
+  ASSERT_TRUE(spec);
+  EXPECT_EQ((std::vector<std::pair<std::string,std::string>> {{"state","'o''k'"}}),spec->where);
+
+  sqlite3* db = nullptr;
+  ASSERT_EQ(SQLITE_OK,sqlite3_open(":memory:",&db));
+  auto exec = [db](const std::string& sql) {
+    fiasco::Statement stmt(db,sql,"Test");
+    stmt.Step();
+    return stmt.Ok() && !stmt.Failed();
+  };
+  ASSERT_TRUE(exec("CREATE TABLE t (country, price, state);"));
+  ASSERT_TRUE(exec("INSERT INTO t VALUES ('US',1,'o''k'),('US',3,'o''k'),('DE',2,'o''k'),('DE',5,'no');"));
+  auto queries = fiasco::BuildRollupTableQueries(*spec);
+  auto refresh = fiasco::BuildRollupRefreshQueries(*spec,{},"main.\"t\"");
+  queries.insert(queries.end(),refresh.begin(),refresh.end());
+  for (const auto& query : queries) {
+    ASSERT_TRUE(exec(query)) << query;
+  }
+  ASSERT_TRUE(exec("INSERT INTO t VALUES ('FR',4,'o''k'),('US',NULL,'o''k');"));
+  ASSERT_TRUE(exec("UPDATE t SET country = 'FR' WHERE price = 2;"));
+  ASSERT_TRUE(exec("DELETE FROM t WHERE price = 1;"));
+  ASSERT_TRUE(exec("UPDATE t SET state = 'o''k' WHERE price = 5;"));
+
+  auto dump = [db](const std::string& sql) {
+    fiasco::Statement stmt(db,sql,"Test");
+    std::string rows;
+    while (stmt.Step()) {
+      for (int ind = 0; ind < sqlite3_column_count(stmt.get()); ++ind) {
+	rows += fiasco::ColumnToString(stmt.get(),ind) + ",";
+      }
+      rows += ';';
+    }
+    return rows;
+  };
+  auto expected = dump("SELECT country, count(*), coalesce(sum(price),0), count(price), avg(price) FROM t "
+		       "WHERE state = 'o''k' GROUP BY country ORDER BY country;");
+  EXPECT_EQ("DE,1,5,1,5.000000,;FR,2,6,2,3.000000,;US,2,3,1,3.000000,;",expected);
+  EXPECT_EQ(expected,dump("SELECT * FROM r ORDER BY country;"));
+  sqlite3_close_v2(db);
+}
@@ -4,6 +4,10 @@
 namespace fiasco {
   //Prepare CSV table
   static const std::string kTablesTable("CREATE TABLE main.Files ( name varchar(30) NOT NULL, internal_name varchar(64) NOT NULL, creator_id INTEGER NOT NULL);");
+  //Rollup definitions as posted, the rollup tables themselves are registered in Files
+  static const std::string kRollupsTable("CREATE TABLE IF NOT EXISTS main.Rollups ( name TEXT NOT NULL PRIMARY KEY, source TEXT NOT NULL, definition TEXT NOT NULL);");
+  //Per column statistics of the last upload of every table, histogram bounds are separated by \x1f
+  static const std::string kColumnStatsTable("CREATE TABLE IF NOT EXISTS main.ColumnStats ( table_name TEXT NOT NULL, ordinal INTEGER NOT NULL, col TEXT NOT NULL, numeric INTEGER NOT NULL, rows INTEGER NOT NULL, nulls INTEGER NOT NULL, distinct_count INTEGER NOT NULL, min, max, histogram TEXT NOT NULL, PRIMARY KEY (table_name, col));");
   //Prepare permissions table
   static const std::string kUsersTable("CREATE TABLE main.Users ( name varchar(30) NOT NULL PRIMARY KEY, role INTEGER NOT NULL);");
   //Setup an admin user
@@ -15,6 +19,10 @@ namespace fiasco {
   static const std::string kUserReg("INSERT INTO main.Users (name,role) VALUES (?,2) RETURNING rowid");
   static const std::string kTableReg("INSERT INTO main.Files (name,internal_name,creator_id) VALUES (?,?,?)");
   static const std::string kTableContent("INSERT INTO main.{} VALUES {};");
+  //Column types as declared by uploads, dictionary codes get BLOB affinity so text like '42' is never taken for a code
+  static const std::string kTextColumnType("varchar(255)");
+  static const std::string kDictColumnType("dict_blob");
+  static const std::string kDictTableColumns("code INTEGER PRIMARY KEY, value TEXT NOT NULL UNIQUE");
   //Querying list of CSVs + their columns + list of them user can delete
   static const std::string kTableQuery("SELECT name FROM main.Files;");
   static const std::string kColTemplate("PRAGMA main.table_info({});");